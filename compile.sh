@@ -108,6 +108,26 @@ stepDebug() {
     echo "$(tput setaf 10)Step 4bis: Successfully uploaded and monitored!$(tput sgr0)"
 }
 
+# Image size and static RAM of each configuration, one build directory each.
+# Boot time per configuration: the boot_* counters (tools/chris_rawhid.py counters).
+stepSizes() {
+    for config in defaults nimble usb_only; do
+        defaults="sdkconfig.defaults"
+        if [[ $config != defaults ]]; then
+            defaults="$defaults;sdkconfig.$config"
+        fi
+        echo "$(tput setaf 6)Sizes: $config...$(tput sgr0)"
+        idf.py -B build_$config -D SDKCONFIG=build_$config/sdkconfig -D SDKCONFIG_DEFAULTS="$defaults" build size
+        resCompile=$?
+        if [[ $resCompile != 0 ]]; then
+            echo -ne "$(tput setaf 9)$(tput bold)FAILED at SIZES:\n$(tput sgr0)$(tput setaf 9)"
+            echo "Error while compiling $config !"
+            echo -ne "$(tput sgr0)"
+            exit $resCompile
+        fi
+    done
+    echo "$(tput setaf 10)Sizes: Successfully compiled all configurations!$(tput sgr0)"
+}
 
 stepi() {
     case $1 in
@@ -156,6 +176,9 @@ stepi() {
         step3
         stepDebug;;
 
+    sizes)
+        stepSizes;;
+
     *)
         echo -ne "$(tput setaf 9)$(tput bold)"
         echo "Invalid step $1"
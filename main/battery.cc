@@ -0,0 +1,159 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_adc/adc_oneshot.h"
+#include "esp_adc/adc_cali.h"
+#include "esp_adc/adc_cali_scheme.h"
+
+#include "kb_config.h"
+#include "esp_hidd_prf_api.h"
+#include "battery.h"
+
+static const char *TAG = "BATTERY";
+
+// Uncalibrated conversions, 12 dB attenuation
+#define ADC_FULL_SCALE_MV 3100
+#define ADC_MAX_RAW 4095
+
+typedef struct {
+    uint16_t mv;
+    uint8_t percent;
+} battery_point_t;
+
+// 1S LiPo at a keyboard load, highest voltage first. Flat between 3.9 and 3.7 V.
+static const battery_point_t curve[] = {
+    {4200, 100},
+    {4100, 90},
+    {4020, 80},
+    {3950, 70},
+    {3870, 60},
+    {3840, 50},
+    {3800, 40},
+    {3770, 30},
+    {3730, 20},
+    {3690, 10},
+    {3610, 5},
+    {3300, 0},
+};
+#define CURVE_COUNT (sizeof(curve) / sizeof(curve[0]))
+
+static adc_oneshot_unit_handle_t adc = nullptr;
+static adc_cali_handle_t cali = nullptr;
+static esp_timer_handle_t timer = nullptr;
+
+// Running average, in mV << BATTERY_FILTER_SHIFT; 0 before the first sample
+static uint32_t filtered = 0;
+// Filtered voltage the current level was computed from
+static uint32_t levelMv = 0;
+static volatile uint8_t level = 0xFF;
+
+static uint8_t to_percent(uint32_t mv)
+{
+    if (mv >= curve[0].mv)
+        return curve[0].percent;
+    for (size_t i = 1; i < CURVE_COUNT; i++)
+    {
+        if (mv >= curve[i].mv)
+        {
+            // linear between the two points around it
+            const battery_point_t &hi = curve[i - 1];
+            const battery_point_t &lo = curve[i];
+            return lo.percent + (mv - lo.mv) * (hi.percent - lo.percent) / (hi.mv - lo.mv);
+        }
+    }
+    return 0;
+}
+
+// Cell voltage, trimmed mean of BATTERY_OVERSAMPLE conversions. 0 on error.
+static uint32_t read_mv()
+{
+    int sum = 0, lo = INT32_MAX, hi = 0;
+    for (int i = 0; i < BATTERY_OVERSAMPLE; i++)
+    {
+        int raw = 0, mv = 0;
+        if (adc_oneshot_read(adc, BATTERY_ADC_CHANNEL, &raw) != ESP_OK)
+            return 0;
+        if (cali == nullptr || adc_cali_raw_to_voltage(cali, raw, &mv) != ESP_OK)
+            mv = raw * ADC_FULL_SCALE_MV / ADC_MAX_RAW;
+        sum += mv;
+        lo = mv < lo ? mv : lo;
+        hi = mv > hi ? mv : hi;
+    }
+    // without the extremes, a conversion hit by a radio burst does not count
+    return (uint32_t)(sum - lo - hi) / (BATTERY_OVERSAMPLE - 2) * BATTERY_DIVIDER_MUL;
+}
+
+// Runs on the esp_timer task
+static void timer_cb(void *arg)
+{
+    if (!esp_timer_is_active(timer))
+        esp_timer_start_periodic(timer, (uint64_t)BATTERY_SAMPLE_S * 1000000);
+
+    uint32_t mv = read_mv();
+    kb_counter_set(KB_COUNTER_BATTERY_MV, mv);
+    if (mv < BATTERY_MIN_VALID_MV)
+        return; // no cell on the pin, or the ADC failed
+
+    if (filtered == 0)
+        filtered = mv << BATTERY_FILTER_SHIFT;
+    else
+        filtered = filtered - (filtered >> BATTERY_FILTER_SHIFT) + mv;
+    uint32_t avg = filtered >> BATTERY_FILTER_SHIFT;
+
+    // the first level is taken as is, then only a real move of the voltage changes it
+    uint32_t moved = avg > levelMv ? avg - levelMv : levelMv - avg;
+    if (level != 0xFF && moved < BATTERY_HYSTERESIS_MV)
+        return;
+    uint8_t percent = to_percent(avg);
+    levelMv = avg;
+    if (percent == level)
+        return;
+
+    level = percent;
+    kb_counter_set(KB_COUNTER_BATTERY_PERCENT, percent);
+    kb_counter_add(KB_COUNTER_BATTERY_LEVEL_UPDATES, 1);
+    esp_err_t err = esp_hidd_set_battery_level(percent);
+    if (err != ESP_OK)
+        ESP_LOGW(TAG, "Battery level not updated: %s", esp_err_to_name(err));
+    ESP_LOGI(TAG, "%lu mV, %u%%", (unsigned long)avg, percent);
+}
+
+uint8_t battery_percent()
+{
+    return level;
+}
+
+void battery_init()
+{
+    adc_oneshot_unit_init_cfg_t unitCfg = {};
+    unitCfg.unit_id = ADC_UNIT_1;
+    unitCfg.ulp_mode = ADC_ULP_MODE_DISABLE;
+    if (adc_oneshot_new_unit(&unitCfg, &adc) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "ADC unit unavailable, no battery level");
+        return;
+    }
+    adc_oneshot_chan_cfg_t chanCfg = {};
+    chanCfg.atten = ADC_ATTEN_DB_12;
+    chanCfg.bitwidth = ADC_BITWIDTH_DEFAULT;
+    ESP_ERROR_CHECK(adc_oneshot_config_channel(adc, BATTERY_ADC_CHANNEL, &chanCfg));
+
+#if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
+    adc_cali_curve_fitting_config_t caliCfg = {};
+    caliCfg.unit_id = ADC_UNIT_1;
+    caliCfg.chan = BATTERY_ADC_CHANNEL;
+    caliCfg.atten = ADC_ATTEN_DB_12;
+    caliCfg.bitwidth = ADC_BITWIDTH_DEFAULT;
+    if (adc_cali_create_scheme_curve_fitting(&caliCfg, &cali) != ESP_OK)
+        cali = nullptr;
+#endif
+    if (cali == nullptr)
+        ESP_LOGW(TAG, "No ADC calibration in eFuse, battery voltage approximate");
+
+    esp_timer_create_args_t args = {};
+    args.callback = timer_cb;
+    args.name = "battery";
+    // a sample missed in light sleep is not worth a wake up of its own
+    args.skip_unhandled_events = true;
+    ESP_ERROR_CHECK(esp_timer_create(&args, &timer));
+    ESP_ERROR_CHECK(esp_timer_start_once(timer, (uint64_t)BATTERY_FIRST_SAMPLE_MS * 1000));
+}
@@ -0,0 +1,60 @@
+/*
+ * Battery level for the BLE Battery Service. The cell voltage is read
+ * through a resistor divider with the ADC in one-shot mode, once every
+ * BATTERY_SAMPLE_S from an esp_timer, never from the scan task: the ADC is
+ * only powered for the few conversions of a sample.
+ *
+ * Each sample is the trimmed mean of BATTERY_OVERSAMPLE conversions, then
+ * averaged over the previous samples, and mapped to percent through the
+ * discharge curve of a 1S LiPo cell. The level only moves once the voltage
+ * moved BATTERY_HYSTERESIS_MV, and the host is only notified of a change.
+ *
+ * The PCB has no battery input yet: the pin and the divider below are the
+ * assumed wiring. A reading below BATTERY_MIN_VALID_MV means no cell, the
+ * level is then left as it is.
+ */
+
+#ifndef BATTERY_H__
+#define BATTERY_H__
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Divider wired to GPIO1 (ADC1 channel 0). GPIO2 is the other free ADC1 pin,
+// left for the back button commented out in main.cc
+#define BATTERY_ADC_CHANNEL ADC_CHANNEL_0
+// 100k / 100k divider: the pin sees half of the cell voltage
+#define BATTERY_DIVIDER_MUL 2
+#define BATTERY_SAMPLE_S 60
+// First sample once boot and BLE init are done
+#define BATTERY_FIRST_SAMPLE_MS 2000
+#define BATTERY_OVERSAMPLE 8
+// Weight of a new sample in the running average, 1 / 2^shift
+#define BATTERY_FILTER_SHIFT 2
+#define BATTERY_HYSTERESIS_MV 10
+#define BATTERY_MIN_VALID_MV 2500
+
+#if CONFIG_KB_BATTERY
+
+void battery_init(void);
+
+/// Last level set, 0..100; 0xFF before the first valid sample.
+uint8_t battery_percent(void);
+
+#else
+
+// Built without battery measurement (CONFIG_KB_BATTERY): the level stays unknown
+static inline void battery_init(void) {}
+static inline uint8_t battery_percent(void) { return 0xFF; }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BATTERY_H__ */
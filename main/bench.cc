@@ -0,0 +1,289 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "tinyusb.h"
+#include "class/hid/hid_device.h"
+#if CONFIG_KB_BLE
+#include "esp_hidd_prf_api.h"
+#endif
+#include "hid_dev.h"
+
+#include "kb_config.h"
+#include "bench.h"
+
+static const char *TAG = "BENCH";
+
+#define BENCH_STACK_SIZE 3072
+
+static const char *const transportNames[BENCH_TRANSPORT_COUNT] = {"usb", "ble"};
+static const char *const kindNames[BENCH_KIND_COUNT] = {"keyboard", "consumer", "nkro"};
+
+StaticTask_t benchTaskTCB;
+StackType_t benchTaskStack[BENCH_STACK_SIZE];
+static TaskHandle_t benchTask = nullptr;
+
+// One token per report allowed in flight
+static StaticSemaphore_t slotsBuffer;
+static SemaphoreHandle_t slots = nullptr;
+
+// Submit times of the reports in flight, both transports complete in order
+static portMUX_TYPE inflightLock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t inflight[BENCH_MAX_WINDOW];
+static uint8_t inflightHead = 0;
+static uint8_t inflightCount = 0;
+
+static volatile bool active = false;
+static bench_result_t result = {};
+static uint64_t latSumUs = 0;
+static uint16_t durationMs = 0;
+#if CONFIG_KB_BLE
+static uint16_t bleConnId = 0;
+#endif
+
+static void bench_complete(bool ok)
+{
+    int64_t now = esp_timer_get_time();
+    bool give = false;
+
+    portENTER_CRITICAL(&inflightLock);
+    if (active && inflightCount > 0)
+    {
+        int64_t sent = inflight[inflightHead];
+        inflightHead = (inflightHead + 1) % BENCH_MAX_WINDOW;
+        inflightCount--;
+        if (ok)
+        {
+            uint32_t lat = (uint32_t)(now - sent);
+            result.completed++;
+            latSumUs += lat;
+            if (lat < result.latMinUs)
+                result.latMinUs = lat;
+            if (lat > result.latMaxUs)
+                result.latMaxUs = lat;
+        }
+        else
+            result.dropped++;
+        give = true;
+    }
+    portEXIT_CRITICAL(&inflightLock);
+
+    if (give)
+        xSemaphoreGive(slots);
+}
+
+void bench_usb_report_complete(uint8_t instance)
+{
+    if (!active || result.transport != BENCH_TRANSPORT_USB)
+        return;
+    uint8_t itf = result.kind == BENCH_KIND_CONSUMER ? KB_USB_CC_ITF : KB_USB_KBD_ITF;
+    if (instance == itf)
+        bench_complete(true);
+}
+
+void bench_ble_report_sent(bool ok)
+{
+    if (active && result.transport == BENCH_TRANSPORT_BLE)
+        bench_complete(ok);
+}
+
+// Reports carry no key, the host sees a stream of "all released"
+static bool bench_submit()
+{
+    uint8_t keys[6] = {0};
+    uint8_t cc[HID_CC_IN_RPT_LEN];
+#if CONFIG_KB_BLE
+    uint8_t bitmap[HID_NKRO_BITMAP_LEN] = {0};
+#endif
+
+    if (result.transport == BENCH_TRANSPORT_USB)
+    {
+        if (result.kind == BENCH_KIND_CONSUMER)
+        {
+            hid_consumer_build_report(cc, 0);
+            return tud_hid_n_report(KB_USB_CC_ITF, KB_USB_CC_REPORT_ID, cc, sizeof(cc));
+        }
+        return tud_hid_n_keyboard_report(KB_USB_KBD_ITF, 0, 0, keys);
+    }
+
+#if CONFIG_KB_BLE
+    if (result.kind == BENCH_KIND_CONSUMER)
+        return esp_hidd_send_consumer_value(bleConnId, 0, false) == ESP_OK;
+    if (result.kind == BENCH_KIND_NKRO)
+        return esp_hidd_send_keyboard_bitmap(bleConnId, 0, bitmap, sizeof(bitmap)) == ESP_OK;
+    return esp_hidd_send_keyboard_value(bleConnId, 0, keys, sizeof(keys)) == ESP_OK;
+#else
+    return false;
+#endif
+}
+
+static bool bench_ready()
+{
+    if (result.transport == BENCH_TRANSPORT_USB)
+        return tud_hid_n_ready(result.kind == BENCH_KIND_CONSUMER ? KB_USB_CC_ITF : KB_USB_KBD_ITF);
+    return true;
+}
+
+static void bench_run()
+{
+    int64_t start = esp_timer_get_time();
+    int64_t end = start + (int64_t)durationMs * 1000;
+
+    while (esp_timer_get_time() < end)
+    {
+        if (xSemaphoreTake(slots, pdMS_TO_TICKS(BENCH_COMPLETION_TIMEOUT_MS)) != pdTRUE)
+        {
+            // the oldest report never completed, give its slot back
+            portENTER_CRITICAL(&inflightLock);
+            if (inflightCount > 0)
+            {
+                inflightHead = (inflightHead + 1) % BENCH_MAX_WINDOW;
+                inflightCount--;
+            }
+            result.dropped++;
+            portEXIT_CRITICAL(&inflightLock);
+            xSemaphoreGive(slots);
+            continue;
+        }
+
+        if (!bench_ready())
+        {
+            xSemaphoreGive(slots);
+            vTaskDelay(1);
+            continue;
+        }
+
+        // recorded first, the completion may come before the submit call returns
+        portENTER_CRITICAL(&inflightLock);
+        inflight[(inflightHead + inflightCount) % BENCH_MAX_WINDOW] = esp_timer_get_time();
+        inflightCount++;
+        portEXIT_CRITICAL(&inflightLock);
+
+        if (bench_submit())
+        {
+            result.submitted++;
+            continue;
+        }
+
+        portENTER_CRITICAL(&inflightLock);
+        inflightCount--;
+        result.dropped++;
+        portEXIT_CRITICAL(&inflightLock);
+        xSemaphoreGive(slots);
+    }
+    result.durationUs = (uint32_t)(esp_timer_get_time() - start);
+
+    // let the last reports complete
+    int64_t drainEnd = esp_timer_get_time() + BENCH_COMPLETION_TIMEOUT_MS * 1000;
+    while (inflightCount > 0 && esp_timer_get_time() < drainEnd)
+        vTaskDelay(1);
+
+    portENTER_CRITICAL(&inflightLock);
+    result.dropped += inflightCount;
+    inflightCount = 0;
+    result.latAvgUs = result.completed ? (uint32_t)(latSumUs / result.completed) : 0;
+    if (result.completed == 0)
+        result.latMinUs = 0;
+    active = false;
+    result.running = false;
+    portEXIT_CRITICAL(&inflightLock);
+
+    ESP_LOGI(TAG, "%s %s, window %d: %lu reports in %lu ms = %lu/s, %lu dropped, latency min %lu avg %lu max %lu us",
+             transportNames[result.transport], kindNames[result.kind], result.window,
+             (unsigned long)result.completed, (unsigned long)(result.durationUs / 1000),
+             (unsigned long)((uint64_t)result.completed * 1000000 / result.durationUs),
+             (unsigned long)result.dropped, (unsigned long)result.latMinUs, (unsigned long)result.latAvgUs,
+             (unsigned long)result.latMaxUs);
+}
+
+esp_err_t bench_start(uint8_t transport, uint8_t kind, uint16_t duration, uint8_t window)
+{
+    if (benchTask == nullptr || active)
+        return ESP_ERR_INVALID_STATE;
+    if (transport >= BENCH_TRANSPORT_COUNT || kind >= BENCH_KIND_COUNT)
+        return ESP_ERR_INVALID_ARG;
+    // the NKRO report only exists on BLE
+    if (kind == BENCH_KIND_NKRO && transport == BENCH_TRANSPORT_USB)
+        return ESP_ERR_NOT_SUPPORTED;
+    if (duration < BENCH_MIN_DURATION_MS || duration > BENCH_MAX_DURATION_MS || window == 0 ||
+        window > BENCH_MAX_WINDOW)
+        return ESP_ERR_INVALID_SIZE;
+
+    if (transport == BENCH_TRANSPORT_USB)
+    {
+        if (!tud_mounted())
+            return ESP_ERR_NOT_FOUND;
+        window = 1;
+    }
+#if CONFIG_KB_BLE
+    else if (!esp_hidd_get_conn_id(&bleConnId))
+        return ESP_ERR_NOT_FOUND;
+    else if (kind == BENCH_KIND_NKRO && hidProtocolMode != HID_PROTOCOL_MODE_REPORT)
+        return ESP_ERR_NOT_SUPPORTED; // the host asked for the boot protocol
+#else
+    else
+        return ESP_ERR_NOT_FOUND; // built without BLE
+#endif
+
+    xQueueReset(slots);
+    for (uint8_t i = 0; i < window; i++)
+        xSemaphoreGive(slots);
+
+    memset(&result, 0, sizeof(result));
+    result.running = true;
+    result.transport = transport;
+    result.kind = kind;
+    result.window = window;
+    result.latMinUs = UINT32_MAX;
+    latSumUs = 0;
+    inflightHead = 0;
+    inflightCount = 0;
+    durationMs = duration;
+    // from now on the scanner keeps off the HID reports
+    active = true;
+    xTaskNotifyGive(benchTask);
+    return ESP_OK;
+}
+
+bool bench_active()
+{
+    return active;
+}
+
+void bench_result(bench_result_t *out)
+{
+    portENTER_CRITICAL(&inflightLock);
+    *out = result;
+    if (out->running)
+    {
+        out->latAvgUs = out->completed ? (uint32_t)(latSumUs / out->completed) : 0;
+        if (out->completed == 0)
+            out->latMinUs = 0;
+    }
+    portEXIT_CRITICAL(&inflightLock);
+}
+
+void bench_task(void *param)
+{
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        bench_run();
+    }
+}
+
+void start_bench_task()
+{
+    slots = xSemaphoreCreateCountingStatic(BENCH_MAX_WINDOW, 0, &slotsBuffer);
+    benchTask = xTaskCreateStatic(
+        bench_task,     // Task function
+        "BenchTask",    // Name
+        BENCH_STACK_SIZE,
+        NULL,           // Parameter
+        3,              // Priority, above the scanner, below TinyUSB and raw HID
+        benchTaskStack, // Stack array
+        &benchTaskTCB   // Task control block
+    );
+}
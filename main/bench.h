@@ -0,0 +1,95 @@
+/*
+ * HID throughput benchmark: while a run is active the matrix is not
+ * scanned, synthetic reports are pushed to one transport as fast as it
+ * accepts them, and the completion of each one is timed.
+ *
+ * Runs are started and read back from the raw HID interface
+ * (tools/chris_rawhid.py bench), the result is also logged.
+ */
+
+#ifndef BENCH_H__
+#define BENCH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    BENCH_TRANSPORT_USB = 0, // TinyUSB, completion = tud_hid_report_complete_cb()
+    BENCH_TRANSPORT_BLE,     // hid_dev_send_report(), completion = GATTS CONF event
+
+    BENCH_TRANSPORT_COUNT
+} bench_transport_t;
+
+typedef enum {
+    BENCH_KIND_KEYBOARD = 0,
+    BENCH_KIND_CONSUMER,
+    BENCH_KIND_NKRO, // BLE only, the host in report protocol mode
+
+    BENCH_KIND_COUNT
+} bench_kind_t;
+
+#define BENCH_MIN_DURATION_MS 100
+#define BENCH_MAX_DURATION_MS 60000
+// Reports in flight at once, BLE only (TinyUSB has one transfer per endpoint)
+#define BENCH_MAX_WINDOW 8
+// A report not completed within this delay is counted as dropped
+#define BENCH_COMPLETION_TIMEOUT_MS 200
+
+typedef struct {
+    bool running;
+    uint8_t transport;   // bench_transport_t
+    uint8_t kind;        // bench_kind_t
+    uint8_t window;
+    uint32_t durationUs; // actual run time
+    uint32_t submitted;  // reports accepted by the transport
+    uint32_t completed;
+    uint32_t dropped;    // refused by the transport or never completed
+    uint32_t latMinUs;   // submit -> completion
+    uint32_t latAvgUs;
+    uint32_t latMaxUs;
+} bench_result_t;
+
+#if CONFIG_KB_BENCH
+
+/// Start a run, ESP_ERR_INVALID_STATE if one is active, ESP_ERR_NOT_FOUND if the transport is down.
+esp_err_t bench_start(uint8_t transport, uint8_t kind, uint16_t durationMs, uint8_t window);
+
+/// True while a run owns the HID reports, the scanner stays idle.
+bool bench_active(void);
+
+/// Last (or current) run.
+void bench_result(bench_result_t *result);
+
+/// Completion hooks, from the TinyUSB and BT callbacks.
+void bench_usb_report_complete(uint8_t instance);
+void bench_ble_report_sent(bool ok);
+
+void start_bench_task(void);
+
+#else
+
+// Built without the benchmark (CONFIG_KB_BENCH): runs are refused
+static inline esp_err_t bench_start(uint8_t transport, uint8_t kind, uint16_t durationMs, uint8_t window)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+static inline bool bench_active(void) { return false; }
+static inline void bench_result(bench_result_t *result) { memset(result, 0, sizeof(*result)); }
+static inline void bench_usb_report_complete(uint8_t instance) {}
+static inline void bench_ble_report_sent(bool ok) {}
+static inline void start_bench_task(void) {}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BENCH_H__ */
@@ -0,0 +1,435 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_gap_ble_api.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "kb_config.h"
+#include "ble_adv.h"
+
+static const char *TAG = "BLE_ADV";
+
+#define BLE_ADV_NVS_NAMESPACE "ble_adv"
+#define BLE_ADV_NVS_SLOTS "slots"
+#define BLE_ADV_NVS_ACTIVE "active"
+#define BLE_ADV_MAX_BONDS 8
+
+static const char *const phaseNames[] = {"off", "directed", "whitelist", "general", "stopped"};
+
+typedef struct {
+    uint16_t minInterval; // 0.625 ms units
+    uint16_t maxInterval;
+    uint16_t untilS;      // since undirected advertising started
+} ble_adv_step_t;
+
+// Fast for a reconnection, then intervals hosts are known to scan well (Apple accessory guidelines)
+static const ble_adv_step_t steps[] = {
+    {BLE_ADV_FAST_INT_MIN, BLE_ADV_FAST_INT_MAX, BLE_ADV_FAST_S},
+    {BLE_ADV_SLOW_INT_MIN, BLE_ADV_SLOW_INT_MAX, BLE_ADV_SLOW_S},
+    {BLE_ADV_IDLE_INT_MIN, BLE_ADV_IDLE_INT_MAX, BLE_ADV_SCHEDULE_S},
+};
+#define STEP_COUNT (sizeof(steps) / sizeof(steps[0]))
+
+typedef struct {
+    esp_bd_addr_t bda;
+    uint8_t addrType; // esp_ble_addr_type_t
+    uint8_t used;
+} ble_adv_host_t;
+
+static esp_ble_adv_params_t generalParams = {
+    .adv_int_min = BLE_ADV_FAST_INT_MIN,
+    .adv_int_max = BLE_ADV_FAST_INT_MAX,
+    .adv_type = ADV_TYPE_IND,
+    .own_addr_type = BLE_ADDR_TYPE_PUBLIC,
+    //.peer_addr            =
+    //.peer_addr_type       =
+    .channel_map = ADV_CHNL_ALL,
+    .adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
+};
+
+static StaticSemaphore_t lockBuffer;
+static SemaphoreHandle_t lock = nullptr;
+static esp_timer_handle_t timer = nullptr;
+
+static ble_adv_host_t slots[BLE_ADV_HOST_SLOTS];
+static volatile uint8_t activeSlot = 0;
+// The whitelist holds the host of the active slot, rewritten before the next advertising
+static bool whitelistDirty = true;
+
+static volatile ble_adv_phase_t phase = BLE_ADV_OFF;
+// Interval step of the undirected phases
+static volatile uint8_t step = 0;
+// Waiting for the stop of the previous phase before starting the next one
+static bool stopping = false;
+// Disconnection, or boot
+static int64_t startUs = 0;
+// Advertising time accounted up to there, 0 when not advertising
+static int64_t advUs = 0;
+static bool connected = false;
+static esp_bd_addr_t connectedBda;
+// Slot change not completed yet, 0 otherwise
+static int64_t switchUs = 0;
+// Host of another slot last disconnected, and its rejections in a row
+static esp_bd_addr_t rejectedBda;
+static uint8_t rejections = 0;
+// Advertising held back after a rejection, the timer starts it
+static bool backingOff = false;
+
+static esp_ble_wl_addr_type_t wl_type(uint8_t addrType)
+{
+    return addrType == BLE_ADDR_TYPE_PUBLIC ? BLE_WL_ADDR_TYPE_PUBLIC : BLE_WL_ADDR_TYPE_RANDOM;
+}
+
+static int find_slot(const esp_bd_addr_t bda)
+{
+    for (int i = 0; i < BLE_ADV_HOST_SLOTS; i++)
+        if (slots[i].used && memcmp(slots[i].bda, bda, sizeof(esp_bd_addr_t)) == 0)
+            return i;
+    return -1;
+}
+
+// Lock held
+static void save()
+{
+    nvs_handle_t nvs;
+    if (nvs_open(BLE_ADV_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+        return;
+    if (nvs_set_blob(nvs, BLE_ADV_NVS_SLOTS, slots, sizeof(slots)) == ESP_OK &&
+        nvs_set_u8(nvs, BLE_ADV_NVS_ACTIVE, activeSlot) == ESP_OK)
+        nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+// Lock held
+static void account()
+{
+    if (advUs == 0)
+        return;
+    uint32_t ms = (uint32_t)((esp_timer_get_time() - advUs) / 1000);
+    advUs += (int64_t)ms * 1000;
+    kb_counter_add(KB_COUNTER_BLE_ADV_MS, ms);
+}
+
+// Lock held
+static ble_adv_phase_t first_phase()
+{
+    return slots[activeSlot].used ? BLE_ADV_DIRECTED : BLE_ADV_GENERAL;
+}
+
+// Lock held. A rejected host scans for us as well, fast advertising would only bring it back sooner.
+static uint8_t first_step()
+{
+    return rejections > 0 && phase == BLE_ADV_GENERAL ? 1 : 0;
+}
+
+// Lock held, advertising stopped
+static void start_phase()
+{
+    const ble_adv_host_t *host = &slots[activeSlot];
+    esp_ble_adv_params_t params = generalParams;
+
+    if (whitelistDirty)
+    {
+        esp_ble_gap_clear_whitelist();
+        if (host->used)
+            esp_ble_gap_update_whitelist(true, (uint8_t *)host->bda, wl_type(host->addrType));
+        whitelistDirty = false;
+    }
+
+    uint32_t ms = BLE_ADV_DIRECTED_MS;
+    if (phase == BLE_ADV_DIRECTED)
+    {
+        params.adv_type = ADV_TYPE_DIRECT_IND_HIGH;
+        memcpy(params.peer_addr, host->bda, sizeof(esp_bd_addr_t));
+        params.peer_addr_type = (esp_ble_addr_type_t)host->addrType;
+    }
+    else
+    {
+        params.adv_int_min = steps[step].minInterval;
+        params.adv_int_max = steps[step].maxInterval;
+        if (phase == BLE_ADV_WHITELIST)
+            params.adv_filter_policy = ADV_FILTER_ALLOW_SCAN_WLST_CON_WLST;
+        ms = (steps[step].untilS - (step > 0 ? steps[step - 1].untilS : 0)) * 1000;
+    }
+
+    ESP_LOGI(TAG, "slot %u: %s advertising, %u-%u x 0.625 ms", activeSlot + 1, phaseNames[phase],
+             params.adv_int_min, params.adv_int_max);
+    esp_ble_gap_start_advertising(&params);
+    if (advUs == 0)
+        advUs = esp_timer_get_time();
+    esp_timer_start_once(timer, (uint64_t)ms * 1000);
+}
+
+// Lock held, not connected: back to the first phase
+static void restart()
+{
+    ble_adv_phase_t previous = phase;
+    esp_timer_stop(timer);
+    phase = first_phase();
+    step = first_step();
+    if (previous == BLE_ADV_STOPPED || backingOff)
+    {
+        backingOff = false;
+        start_phase();
+    }
+    else if (!stopping)
+    {
+        // a stop already under way starts the new phase as well
+        stopping = true;
+        esp_ble_gap_stop_advertising();
+    }
+}
+
+// Lock held: moves away from the current host, advertising restarts for the active slot
+static void leave()
+{
+    if (connected)
+    {
+        // ble_adv_start() follows the disconnection
+        esp_ble_gap_disconnect(connectedBda);
+    }
+    else if (phase != BLE_ADV_OFF)
+        restart();
+}
+
+// Runs on the esp_timer task: the directed phase or an interval step timed out without a connection
+static void timer_cb(void *arg)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (backingOff)
+    {
+        backingOff = false;
+        start_phase();
+    }
+    else if (phase == BLE_ADV_DIRECTED)
+    {
+        phase = BLE_ADV_WHITELIST;
+        stopping = true;
+        // high duty directed advertising may already be over, the stop event comes anyway
+        esp_ble_gap_stop_advertising();
+    }
+    else if (phase == BLE_ADV_WHITELIST || phase == BLE_ADV_GENERAL)
+    {
+        account();
+        if (step + 1 < (int)STEP_COUNT)
+        {
+            step = step + 1;
+            stopping = true;
+        }
+        else
+        {
+            ESP_LOGI(TAG, "no connection after %d s, advertising stopped", BLE_ADV_SCHEDULE_S);
+            phase = BLE_ADV_STOPPED;
+            advUs = 0;
+            kb_counter_add(KB_COUNTER_BLE_ADV_TIMEOUTS, 1);
+        }
+        esp_ble_gap_stop_advertising();
+    }
+    xSemaphoreGive(lock);
+}
+
+void ble_adv_start()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_timer_stop(timer);
+    connected = false;
+    stopping = false;
+    startUs = esp_timer_get_time();
+    phase = first_phase();
+    step = first_step();
+    if (rejections > 0 && phase == BLE_ADV_GENERAL)
+    {
+        uint8_t shift = rejections - 1;
+        if (shift > BLE_ADV_REJECT_BACKOFF_MAX_SHIFT)
+            shift = BLE_ADV_REJECT_BACKOFF_MAX_SHIFT;
+        uint32_t ms = BLE_ADV_REJECT_BACKOFF_MS << shift;
+        ESP_LOGI(TAG, "host of another slot rejected, advertising in %lu ms", (unsigned long)ms);
+        backingOff = true;
+        esp_timer_start_once(timer, (uint64_t)ms * 1000);
+    }
+    else
+        start_phase();
+    xSemaphoreGive(lock);
+}
+
+void ble_adv_stopped()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (stopping)
+    {
+        stopping = false;
+        start_phase();
+    }
+    xSemaphoreGive(lock);
+}
+
+void ble_adv_connected(const esp_bd_addr_t bda)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_timer_stop(timer);
+    account();
+    advUs = 0;
+    if (phase != BLE_ADV_OFF)
+    {
+        uint32_t ms = (uint32_t)((esp_timer_get_time() - startUs) / 1000);
+        kb_counter_set(KB_COUNTER_BLE_RECONNECT_MS, ms);
+        ESP_LOGI(TAG, "connected during %s advertising, %lu ms after start", phaseNames[phase], (unsigned long)ms);
+    }
+    phase = BLE_ADV_OFF;
+    step = 0;
+    stopping = false;
+    backingOff = false;
+    connected = true;
+    memcpy(connectedBda, bda, sizeof(esp_bd_addr_t));
+    xSemaphoreGive(lock);
+}
+
+void ble_adv_bonded(const esp_bd_addr_t bda, esp_ble_addr_type_t addrType)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int slot = find_slot(bda);
+    if (slot >= 0 && slot != activeSlot)
+    {
+        // only possible while the active slot is empty and anyone may connect
+        ESP_LOGI(TAG, "host of slot %d connected, slot %u is active", slot + 1, activeSlot + 1);
+        if (memcmp(rejectedBda, bda, sizeof(esp_bd_addr_t)) != 0)
+            rejections = 0;
+        memcpy(rejectedBda, bda, sizeof(esp_bd_addr_t));
+        if (rejections < UINT8_MAX)
+            rejections++;
+        kb_counter_add(KB_COUNTER_BLE_HOST_REJECTS, 1);
+        esp_ble_gap_disconnect((uint8_t *)bda);
+    }
+    else if (slot < 0)
+    {
+        rejections = 0;
+        ble_adv_host_t *host = &slots[activeSlot];
+        memcpy(host->bda, bda, sizeof(esp_bd_addr_t));
+        host->addrType = addrType;
+        host->used = 1;
+        whitelistDirty = true;
+        ESP_LOGI(TAG, "new host in slot %u", activeSlot + 1);
+        save();
+    }
+    xSemaphoreGive(lock);
+}
+
+void ble_adv_host_ready()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (switchUs != 0)
+    {
+        uint32_t us = (uint32_t)(esp_timer_get_time() - switchUs);
+        kb_counter_set(KB_COUNTER_BLE_HOST_SWITCH_US, us);
+        ESP_LOGI(TAG, "slot %u ready %lu ms after the switch", activeSlot + 1, (unsigned long)(us / 1000));
+        switchUs = 0;
+    }
+    xSemaphoreGive(lock);
+}
+
+void ble_adv_activity()
+{
+    // connected, directed or still fast: nothing to do, and no lock taken on the scan task
+    if (phase != BLE_ADV_STOPPED && step == 0)
+        return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!connected && !backingOff && (phase == BLE_ADV_STOPPED || (phase != BLE_ADV_OFF && step > 0)))
+    {
+        ESP_LOGI(TAG, "keypress, fast advertising again");
+        kb_counter_add(KB_COUNTER_BLE_ADV_WAKES, 1);
+        restart();
+    }
+    xSemaphoreGive(lock);
+}
+
+void ble_adv_select_slot(uint8_t slot)
+{
+    // BLE still starting in the background
+    if (slot >= BLE_ADV_HOST_SLOTS || slot == activeSlot || lock == nullptr)
+        return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    ESP_LOGI(TAG, "slot %u -> %u", activeSlot + 1, slot + 1);
+    activeSlot = slot;
+    whitelistDirty = true;
+    rejections = 0;
+    switchUs = esp_timer_get_time();
+    kb_counter_add(KB_COUNTER_BLE_HOST_SWITCHES, 1);
+    kb_counter_set(KB_COUNTER_BLE_HOST_SLOT, slot);
+    save();
+    leave();
+    xSemaphoreGive(lock);
+}
+
+void ble_adv_clear_slot()
+{
+    if (lock == nullptr)
+        return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    ble_adv_host_t *host = &slots[activeSlot];
+    if (host->used)
+    {
+        ESP_LOGI(TAG, "slot %u cleared", activeSlot + 1);
+        host->used = 0;
+        // the same host may sit in another slot, its bond stays then
+        if (find_slot(host->bda) < 0)
+            esp_ble_remove_bond_device(host->bda);
+        whitelistDirty = true;
+        rejections = 0;
+        switchUs = esp_timer_get_time();
+        save();
+        leave();
+    }
+    xSemaphoreGive(lock);
+}
+
+ble_adv_phase_t ble_adv_phase()
+{
+    return phase;
+}
+
+uint8_t ble_adv_slot()
+{
+    return activeSlot;
+}
+
+void ble_adv_init()
+{
+    static esp_ble_bond_dev_t bonds[BLE_ADV_MAX_BONDS];
+
+    lock = xSemaphoreCreateMutexStatic(&lockBuffer);
+    esp_timer_create_args_t args = {};
+    args.callback = timer_cb;
+    args.name = "ble_adv";
+    ESP_ERROR_CHECK(esp_timer_create(&args, &timer));
+
+    nvs_handle_t nvs;
+    size_t len = sizeof(slots);
+    uint8_t active = 0;
+    if (nvs_open(BLE_ADV_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK)
+    {
+        if (nvs_get_blob(nvs, BLE_ADV_NVS_SLOTS, slots, &len) != ESP_OK || len != sizeof(slots))
+            memset(slots, 0, sizeof(slots));
+        nvs_get_u8(nvs, BLE_ADV_NVS_ACTIVE, &active);
+        nvs_close(nvs);
+    }
+    activeSlot = active < BLE_ADV_HOST_SLOTS ? active : 0;
+
+    // a host whose bond is gone has to pair again, through an empty slot
+    int count = BLE_ADV_MAX_BONDS;
+    if (esp_ble_get_bond_device_list(&count, bonds) != ESP_OK)
+        count = 0;
+    for (int i = 0; i < BLE_ADV_HOST_SLOTS; i++)
+    {
+        bool bonded = false;
+        for (int b = 0; b < count && slots[i].used && !bonded; b++)
+            bonded = memcmp(bonds[b].bd_addr, slots[i].bda, sizeof(esp_bd_addr_t)) == 0;
+        slots[i].used = bonded;
+    }
+    kb_counter_set(KB_COUNTER_BLE_HOST_SLOT, activeSlot);
+    ESP_LOGI(TAG, "%d bonded host(s), slot %u %s", count, activeSlot + 1,
+             slots[activeSlot].used ? "paired" : "empty");
+}
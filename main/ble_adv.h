@@ -0,0 +1,117 @@
+/*
+ * BLE advertising policy and host slots. Bluedroid keeps the bond keys in
+ * NVS, the host of each slot is remembered here so a reconnection can skip
+ * discovery and Fn+1..3 can move the keyboard between hosts without
+ * pairing again:
+ *
+ * 1. high duty directed advertising to the slot host (1.28 s, controller limit)
+ * 2. undirected, only the slot host may connect (whitelist)
+ *
+ * An empty slot uses undirected advertising anyone may connect to, the
+ * host bonding then fills the slot. Fn+0 empties the active slot. A host
+ * bonded to another slot is disconnected once identified; as it reconnects
+ * by itself, advertising then waits BLE_ADV_REJECT_BACKOFF_MS, doubled for
+ * each new rejection of the same host, and skips the fast step.
+ *
+ * Undirected advertising starts fast for a quick reconnection, then slows
+ * down in steps and stops after BLE_ADV_SCHEDULE_S. A keypress while not
+ * connected restarts the schedule from the first phase.
+ *
+ * The NimBLE profile has no host slots: it keeps the undirected steps, the
+ * stop and the keypress restart, with ble_adv_activity() and ble_adv_phase().
+ */
+
+#ifndef BLE_ADV_H__
+#define BLE_ADV_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble_host_defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    BLE_ADV_OFF = 0,
+    BLE_ADV_DIRECTED,
+    BLE_ADV_WHITELIST,
+    BLE_ADV_GENERAL,
+    BLE_ADV_STOPPED, // schedule over, until a keypress
+} ble_adv_phase_t;
+
+// High duty directed advertising stops after 1.28 s, the margin covers the HCI round trip
+#define BLE_ADV_DIRECTED_MS 1400
+#define BLE_ADV_HOST_SLOTS 3
+// Undirected advertising: 20-30 ms for 30 s, 152.5-211.25 ms up to 2 min, 1022.5-1285 ms up to 15 min
+#define BLE_ADV_FAST_S 30
+#define BLE_ADV_SLOW_S 120
+#define BLE_ADV_SCHEDULE_S 900
+// Interval bounds of the steps, 0.625 ms units, shared with the NimBLE profile
+#define BLE_ADV_FAST_INT_MIN 0x20
+#define BLE_ADV_FAST_INT_MAX 0x30
+#define BLE_ADV_SLOW_INT_MIN 244
+#define BLE_ADV_SLOW_INT_MAX 338
+#define BLE_ADV_IDLE_INT_MIN 1636
+#define BLE_ADV_IDLE_INT_MAX 2056
+// Wait before advertising again after disconnecting a host of another slot: 2 s, doubled up to 32 s
+#define BLE_ADV_REJECT_BACKOFF_MS 2000
+#define BLE_ADV_REJECT_BACKOFF_MAX_SHIFT 4
+
+#if CONFIG_KB_BLE && CONFIG_BT_BLUEDROID_ENABLED
+
+/// After the BLE stack is enabled: loads the slots, fills the whitelist with the active host.
+void ble_adv_init(void);
+
+/// (Re)start advertising from the first phase, once the advertising data is set and after a disconnection.
+void ble_adv_start(void);
+
+/// From the GAP callbacks.
+void ble_adv_stopped(void);
+void ble_adv_connected(const esp_bd_addr_t bda);
+void ble_adv_bonded(const esp_bd_addr_t bda, esp_ble_addr_type_t addrType);
+
+/// From the transport: the active host can receive keypresses, ends a switch measurement.
+void ble_adv_host_ready(void);
+
+/// From the scan task, on a new keypress: back to the first phase if advertising slowed down or stopped.
+void ble_adv_activity(void);
+
+/// From the scan task (Fn keys). Leaves the current host, if any, for the one of the slot.
+/// Both are ignored until ble_adv_init(), BLE starts in the background.
+void ble_adv_select_slot(uint8_t slot);
+/// Forgets the host of the active slot and advertises for a new one.
+void ble_adv_clear_slot(void);
+
+ble_adv_phase_t ble_adv_phase(void);
+uint8_t ble_adv_slot(void);
+
+#else
+
+// The NimBLE profile advertises by itself to anyone, a single host slot; nothing without BLE
+static inline void ble_adv_init(void) {}
+static inline void ble_adv_start(void) {}
+static inline void ble_adv_stopped(void) {}
+static inline void ble_adv_connected(const esp_bd_addr_t bda) {}
+static inline void ble_adv_bonded(const esp_bd_addr_t bda, esp_ble_addr_type_t addrType) {}
+static inline void ble_adv_host_ready(void) {}
+static inline void ble_adv_select_slot(uint8_t slot) {}
+static inline void ble_adv_clear_slot(void) {}
+static inline uint8_t ble_adv_slot(void) { return 0; }
+
+#if CONFIG_KB_BLE && CONFIG_BT_NIMBLE_ENABLED
+// The NimBLE profile follows the same undirected steps (general phase only) and stop
+void ble_adv_activity(void);
+ble_adv_phase_t ble_adv_phase(void);
+#else
+static inline void ble_adv_activity(void) {}
+static inline ble_adv_phase_t ble_adv_phase(void) { return BLE_ADV_OFF; }
+#endif
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLE_ADV_H__ */
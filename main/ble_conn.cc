@@ -0,0 +1,448 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_bt.h"
+#if CONFIG_BT_NIMBLE_ENABLED
+#include "host/ble_gap.h"
+#include "esp_hidd_prf_api.h"
+#else
+#include "esp_gap_ble_api.h"
+#endif
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "kb_config.h"
+#include "ble_conn.h"
+
+static const char *TAG = "BLE_CONN";
+
+#define TICK_MS 1000
+
+typedef struct {
+    uint16_t minInterval; // 1.25 ms units
+    uint16_t maxInterval;
+} ble_conn_range_t;
+
+// Fastest first: 7.5 ms, then up to 15 ms, then 15 ms (the Apple minimum), then up to 30 ms
+static const ble_conn_range_t fastRanges[] = {
+    {6, 6},
+    {6, 12},
+    {12, 12},
+    {12, 24},
+};
+#define FAST_RANGE_COUNT (sizeof(fastRanges) / sizeof(fastRanges[0]))
+
+typedef enum {
+    CONN_IDLE = 0, // not connected
+    CONN_WAIT,     // next request armed on the timer
+    CONN_PENDING,  // request sent, waiting for the update event
+    CONN_DONE,     // accepted, or given up
+} conn_state_t;
+
+static StaticSemaphore_t lockBuffer;
+static SemaphoreHandle_t lock = nullptr;
+static esp_timer_handle_t timer = nullptr;
+static esp_timer_handle_t tickTimer = nullptr;
+
+static conn_state_t state = CONN_IDLE;
+static esp_bd_addr_t remote;
+static uint8_t range = 0;
+static uint8_t attempts = 0;
+static uint32_t retryMs = BLE_CONN_RETRY_MIN_MS;
+static volatile uint16_t interval = 0;
+static uint16_t latency = 0;
+// Link layer, defaults until the central agrees to more
+static volatile uint16_t txOctets = 27;
+static volatile uint8_t phy = 1;
+
+// TX power below the default level, in dB
+static volatile uint8_t attenDb = 0;
+static esp_power_level_t defaultLevel = ESP_PWR_LVL_P9;
+// Connection RSSI, averaged over the ticks
+static int8_t rssiAvg = 0;
+static bool rssiValid = false;
+// Ticks spent above BLE_CONN_RSSI_HIGH since the last change
+static uint8_t holdS = 0;
+
+// Parameters asked for: fast (latency 0) or idle
+static volatile bool idleTarget = false;
+// Scan task, esp_timer_get_time() in ms, wraps after 49 days
+static volatile uint32_t lastActivityMs = 0;
+// Time in mode accounted up to there
+static int64_t accountedUs = 0;
+
+// Lock held. Time since the last call goes to the mode the link is actually in.
+static void account()
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t ms = (uint32_t)((now - accountedUs) / 1000);
+    accountedUs += (int64_t)ms * 1000;
+    kb_counter_add(latency > 0 ? KB_COUNTER_BLE_IDLE_MS : KB_COUNTER_BLE_FAST_MS, ms);
+}
+
+// Lock held
+static void record(uint16_t newInterval, uint16_t newLatency)
+{
+    if (state != CONN_IDLE)
+        account();
+    interval = newInterval;
+    latency = newLatency;
+    kb_counter_set(KB_COUNTER_BLE_CONN_INTERVAL_US, (uint32_t)newInterval * 1250);
+    kb_counter_set(KB_COUNTER_BLE_CONN_LATENCY, newLatency);
+}
+
+// Lock held
+static void record_link(uint16_t newTxOctets, uint8_t newPhy)
+{
+    txOctets = newTxOctets;
+    phy = newPhy;
+    kb_counter_set(KB_COUNTER_BLE_TX_OCTETS, newTxOctets);
+    kb_counter_set(KB_COUNTER_BLE_PHY, newPhy);
+}
+
+// Lock held
+static esp_ble_power_type_t power_type()
+{
+#if CONFIG_BT_NIMBLE_ENABLED
+    uint16_t connHandle;
+    if (esp_hidd_get_conn_id(&connHandle) && connHandle <= ESP_BLE_PWR_TYPE_CONN_HDL8 - ESP_BLE_PWR_TYPE_CONN_HDL0)
+        return (esp_ble_power_type_t)(ESP_BLE_PWR_TYPE_CONN_HDL0 + connHandle);
+#endif
+    // Bluedroid does not expose the HCI handle, the only link gets the first one
+    return ESP_BLE_PWR_TYPE_CONN_HDL0;
+}
+
+// Lock held
+static void set_atten(uint8_t db)
+{
+    int level = (int)defaultLevel - db / BLE_CONN_TX_STEP_DB;
+    attenDb = db;
+    esp_ble_tx_power_set(power_type(), (esp_power_level_t)(level > 0 ? level : 0));
+    kb_counter_set(KB_COUNTER_BLE_TX_ATTEN_DB, db);
+    holdS = 0;
+}
+
+// Lock held, once per tick
+static void rssi_sample(int8_t rssi)
+{
+    rssiAvg = rssiValid ? (int8_t)((3 * rssiAvg + rssi) / 4) : rssi;
+    rssiValid = true;
+    kb_counter_set(KB_COUNTER_BLE_RSSI_NEG, (uint32_t)-rssiAvg);
+
+    // what the host is estimated to receive
+    int margin = rssiAvg - attenDb;
+    if (margin < BLE_CONN_RSSI_LOW && attenDb > 0)
+    {
+        // up two levels at a time, down only one
+        uint8_t db = attenDb > 2 * BLE_CONN_TX_STEP_DB ? attenDb - 2 * BLE_CONN_TX_STEP_DB : 0;
+        ESP_LOGI(TAG, "RSSI %d dBm, TX power -%u dB", rssiAvg, db);
+        set_atten(db);
+        kb_counter_add(KB_COUNTER_BLE_TX_POWER_UPS, 1);
+    }
+    else if (margin > BLE_CONN_RSSI_HIGH && attenDb < BLE_CONN_TX_MAX_ATTEN_DB)
+    {
+        if (++holdS >= BLE_CONN_TX_HOLD_S)
+        {
+            ESP_LOGI(TAG, "RSSI %d dBm, TX power -%u dB", rssiAvg, attenDb + BLE_CONN_TX_STEP_DB);
+            set_atten(attenDb + BLE_CONN_TX_STEP_DB);
+            kb_counter_add(KB_COUNTER_BLE_TX_POWER_DOWNS, 1);
+        }
+    }
+    else
+        holdS = 0;
+}
+
+// Lock held
+static void arm(conn_state_t next, uint32_t delayMs)
+{
+    state = next;
+    esp_timer_stop(timer);
+    esp_timer_start_once(timer, (uint64_t)delayMs * 1000);
+}
+
+// Lock held
+static void rejected()
+{
+    kb_counter_add(KB_COUNTER_BLE_CONN_REJECTS, 1);
+    if (++attempts >= BLE_CONN_MAX_ATTEMPTS)
+    {
+        ESP_LOGW(TAG, "central keeps %lu us latency %u, giving up", (unsigned long)interval * 1250, latency);
+        state = CONN_DONE;
+        return;
+    }
+    if (!idleTarget && range + 1 < FAST_RANGE_COUNT)
+        range++;
+    arm(CONN_WAIT, retryMs);
+    retryMs = retryMs * 2 > BLE_CONN_RETRY_MAX_MS ? BLE_CONN_RETRY_MAX_MS : retryMs * 2;
+}
+
+// Lock held. The answer comes as a connection parameters update event.
+static bool send_update(uint16_t minInterval, uint16_t maxInterval, uint16_t newLatency)
+{
+#if CONFIG_BT_NIMBLE_ENABLED
+    uint16_t connHandle;
+    struct ble_gap_upd_params params = {};
+    params.itvl_min = minInterval;
+    params.itvl_max = maxInterval;
+    params.latency = newLatency;
+    params.supervision_timeout = BLE_CONN_SUPERVISION_TIMEOUT;
+    return esp_hidd_get_conn_id(&connHandle) && ble_gap_update_params(connHandle, &params) == 0;
+#else
+    esp_ble_conn_update_params_t params = {};
+    memcpy(params.bda, remote, sizeof(esp_bd_addr_t));
+    params.min_int = minInterval;
+    params.max_int = maxInterval;
+    params.latency = newLatency;
+    params.timeout = BLE_CONN_SUPERVISION_TIMEOUT;
+    return esp_ble_gap_update_conn_params(&params) == ESP_OK;
+#endif
+}
+
+// Lock held. Longest data length and, on NimBLE, the 2M PHY; the answers come as events.
+static void request_link()
+{
+#if CONFIG_BT_NIMBLE_ENABLED
+    uint16_t connHandle;
+    if (!esp_hidd_get_conn_id(&connHandle))
+        return;
+    ble_gap_set_data_len(connHandle, BLE_CONN_TX_OCTETS, BLE_CONN_TX_TIME_US);
+#if CONFIG_BT_NIMBLE_LL_CFG_FEAT_LE_2M_PHY
+    ble_gap_set_prefered_le_phy(connHandle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_CODED_ANY);
+#endif
+#else
+    // Bluedroid only has the PHY API with the BLE 5.0 features, which move advertising to the
+    // extended commands ble_adv.cc does not use: the link stays on 1M
+    esp_ble_gap_set_pkt_data_len(remote, BLE_CONN_TX_OCTETS);
+#endif
+}
+
+// Lock held
+static void request()
+{
+    uint16_t minInterval = idleTarget ? BLE_CONN_IDLE_MIN_INTERVAL : fastRanges[range].minInterval;
+    uint16_t maxInterval = idleTarget ? BLE_CONN_IDLE_MAX_INTERVAL : fastRanges[range].maxInterval;
+    uint16_t newLatency = idleTarget ? BLE_CONN_IDLE_LATENCY : 0;
+    ESP_LOGI(TAG, "requesting %u-%u x 1.25 ms, latency %u", minInterval, maxInterval, newLatency);
+    if (send_update(minInterval, maxInterval, newLatency))
+        arm(CONN_PENDING, BLE_CONN_RESPONSE_TIMEOUT_MS);
+    else
+        rejected();
+}
+
+// Lock held
+static void set_target(bool idle)
+{
+    idleTarget = idle;
+    attempts = 0;
+    retryMs = BLE_CONN_RETRY_MIN_MS;
+    esp_timer_stop(timer);
+    request();
+}
+
+// Runs on the esp_timer task
+static void timer_cb(void *arg)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (state == CONN_WAIT)
+        request();
+    else if (state == CONN_PENDING)
+    {
+        ESP_LOGW(TAG, "no answer from the central");
+        rejected();
+    }
+    xSemaphoreGive(lock);
+}
+
+// Runs on the esp_timer task, while connected
+static void tick_cb(void *arg)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (state != CONN_IDLE)
+    {
+        account();
+        uint32_t idleS = kbParams[KB_PARAM_BLE_IDLE_S];
+        uint32_t quietMs = (uint32_t)(esp_timer_get_time() / 1000) - lastActivityMs;
+        if (!idleTarget && idleS != 0 && quietMs >= idleS * 1000)
+        {
+            ESP_LOGI(TAG, "idle for %lu s", (unsigned long)(quietMs / 1000));
+            kb_counter_add(KB_COUNTER_BLE_IDLE_ENTRIES, 1);
+            set_target(true);
+        }
+
+        // average attenuation: this over the connected seconds
+        kb_counter_add(KB_COUNTER_BLE_TX_ATTEN_DB_S, attenDb);
+#if CONFIG_BT_NIMBLE_ENABLED
+        int8_t rssi;
+        uint16_t connHandle;
+        if (esp_hidd_get_conn_id(&connHandle) && ble_gap_conn_rssi(connHandle, &rssi) == 0 && rssi != 127)
+            rssi_sample(rssi);
+#else
+        // answered through ble_conn_rssi()
+        esp_ble_gap_read_rssi(remote);
+#endif
+    }
+    xSemaphoreGive(lock);
+}
+
+void ble_conn_rssi(bool ok, int8_t rssi)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    // 127: not available
+    if (state != CONN_IDLE && ok && rssi != 127)
+        rssi_sample(rssi);
+    xSemaphoreGive(lock);
+}
+
+void ble_conn_link_loss()
+{
+    if (attenDb == 0)
+        return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (state != CONN_IDLE && attenDb > 0)
+    {
+        ESP_LOGI(TAG, "link loss, full TX power");
+        set_atten(0);
+        kb_counter_add(KB_COUNTER_BLE_TX_POWER_UPS, 1);
+    }
+    xSemaphoreGive(lock);
+}
+
+void ble_conn_activity()
+{
+    lastActivityMs = (uint32_t)(esp_timer_get_time() / 1000);
+    if (!idleTarget)
+        return;
+
+    // The report itself is not held back: with peripheral latency the
+    // keyboard may still transmit on any connection event, it goes out
+    // on the next one while the fast parameters are negotiated
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (idleTarget && state != CONN_IDLE)
+        set_target(false);
+    xSemaphoreGive(lock);
+}
+
+void ble_conn_connected(const esp_bd_addr_t remoteBda, uint16_t newInterval, uint16_t newLatency, uint16_t timeout)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    memcpy(remote, remoteBda, sizeof(esp_bd_addr_t));
+    record(newInterval, newLatency);
+    accountedUs = esp_timer_get_time();
+    lastActivityMs = (uint32_t)(accountedUs / 1000);
+    idleTarget = false;
+    range = 0;
+    attempts = 0;
+    retryMs = BLE_CONN_RETRY_MIN_MS;
+    ESP_LOGI(TAG, "connected, interval %lu us, latency %u, timeout %u ms", (unsigned long)newInterval * 1250,
+             newLatency, timeout * 10);
+    record_link(27, 1);
+    request_link();
+    defaultLevel = esp_ble_tx_power_get(ESP_BLE_PWR_TYPE_DEFAULT);
+    rssiValid = false;
+    set_atten(0);
+    if (newInterval <= fastRanges[0].maxInterval && newLatency == 0)
+        state = CONN_DONE;
+    else
+        arm(CONN_WAIT, BLE_CONN_FIRST_REQUEST_MS);
+    esp_timer_stop(tickTimer);
+    esp_timer_start_periodic(tickTimer, TICK_MS * 1000);
+    xSemaphoreGive(lock);
+}
+
+void ble_conn_disconnected()
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_timer_stop(timer);
+    esp_timer_stop(tickTimer);
+    record(0, 0);
+    record_link(0, 0);
+    attenDb = 0;
+    kb_counter_set(KB_COUNTER_BLE_TX_ATTEN_DB, 0);
+    state = CONN_IDLE;
+    idleTarget = false;
+    xSemaphoreGive(lock);
+}
+
+void ble_conn_params_updated(bool ok, uint16_t newInterval, uint16_t newLatency, uint16_t timeout)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (state == CONN_IDLE)
+    {
+        xSemaphoreGive(lock);
+        return;
+    }
+    if (ok)
+    {
+        record(newInterval, newLatency);
+        kb_counter_add(KB_COUNTER_BLE_CONN_UPDATES, 1);
+        ESP_LOGI(TAG, "interval %lu us, latency %u, timeout %u ms", (unsigned long)newInterval * 1250, newLatency,
+                 timeout * 10);
+    }
+    // updates the central starts on its own are only recorded
+    if (state == CONN_PENDING)
+    {
+        esp_timer_stop(timer);
+        bool accepted = idleTarget ? newLatency > 0 || newInterval >= BLE_CONN_IDLE_MIN_INTERVAL
+                                   : newLatency == 0 && newInterval <= fastRanges[range].maxInterval;
+        if (ok && accepted)
+            state = CONN_DONE;
+        else
+            rejected();
+    }
+    xSemaphoreGive(lock);
+}
+
+void ble_conn_data_len_updated(bool ok, uint16_t newTxOctets)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (state != CONN_IDLE && ok)
+    {
+        ESP_LOGI(TAG, "data length %u bytes", newTxOctets);
+        record_link(newTxOctets, phy);
+    }
+    else if (state != CONN_IDLE)
+        ESP_LOGI(TAG, "data length refused, %u bytes", txOctets);
+    xSemaphoreGive(lock);
+}
+
+void ble_conn_phy_updated(bool ok, uint8_t txPhy)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (state != CONN_IDLE && ok)
+    {
+        ESP_LOGI(TAG, "PHY %u", txPhy);
+        record_link(txOctets, txPhy);
+    }
+    xSemaphoreGive(lock);
+}
+
+uint32_t ble_conn_interval_us()
+{
+    return (uint32_t)interval * 1250;
+}
+
+uint32_t ble_conn_airtime_us(uint16_t valueLen)
+{
+    // L2CAP header, ATT opcode and handle in front of the value
+    uint32_t payload = 4 + 3 + valueLen;
+    uint16_t octets = txOctets != 0 ? txOctets : 27;
+    uint32_t packets = (payload + octets - 1) / octets;
+    // per packet: preamble (2 bytes on 2M), access address, header, MIC, CRC
+    uint32_t overhead = (phy == 2 ? 2 : 1) + 4 + 2 + 4 + 3;
+    uint32_t bytes = payload + packets * overhead;
+    // 8 us per byte on 1M, 4 on 2M; coded PHY not asked for, counted as 1M
+    return bytes * (phy == 2 ? 4 : 8);
+}
+
+void ble_conn_init()
+{
+    lock = xSemaphoreCreateMutexStatic(&lockBuffer);
+    esp_timer_create_args_t args = {};
+    args.callback = timer_cb;
+    args.name = "ble_conn";
+    ESP_ERROR_CHECK(esp_timer_create(&args, &timer));
+    args.callback = tick_cb;
+    args.name = "ble_conn_tick";
+    ESP_ERROR_CHECK(esp_timer_create(&args, &tickTimer));
+}
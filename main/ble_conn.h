@@ -0,0 +1,110 @@
+/*
+ * BLE connection parameters: once connected the keyboard asks the central
+ * for the shortest connection interval it accepts, instead of leaving the
+ * keypress latency to whatever the host picked.
+ *
+ * Requests go from the fastest to the most conservative parameters, a
+ * rejected one is retried with the next set after a growing delay.
+ *
+ * After KB_PARAM_BLE_IDLE_S without a report the link moves to a longer
+ * interval with peripheral latency, so the radio sleeps through most
+ * connection events; the next report brings the fast parameters back.
+ *
+ * The link also asks for the longest data length and, on NimBLE
+ * (sdkconfig.nimble), for the 2M PHY. The default Bluedroid build has no
+ * BLE 5.0 features and stays on 1M. A central that refuses either keeps
+ * the 27 byte / 1M defaults, nothing else depends on them.
+ *
+ * TX power follows the link margin. The host is assumed to hear the
+ * keyboard as well as the keyboard hears it, less the attenuation applied:
+ * while that estimate stays above BLE_CONN_RSSI_HIGH the power steps down,
+ * below BLE_CONN_RSSI_LOW or on a lost notification it comes back up at
+ * once. The band between the two is wider than a step, so it settles.
+ */
+
+#ifndef BLE_CONN_H__
+#define BLE_CONN_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble_host_defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Let pairing and service discovery finish first, centrals often reject earlier requests
+#define BLE_CONN_FIRST_REQUEST_MS 1000
+// Retry delay after a rejection, doubled each time
+#define BLE_CONN_RETRY_MIN_MS 500
+#define BLE_CONN_RETRY_MAX_MS 16000
+// A request not answered within this delay counts as rejected
+#define BLE_CONN_RESPONSE_TIMEOUT_MS 5000
+#define BLE_CONN_MAX_ATTEMPTS 8
+// Supervision timeout, in 10 ms units
+#define BLE_CONN_SUPERVISION_TIMEOUT 400
+// Idle: 60-75 ms, 4 events may be skipped, a wake up every 375 ms at most
+#define BLE_CONN_IDLE_MIN_INTERVAL 48
+#define BLE_CONN_IDLE_MAX_INTERVAL 60
+#define BLE_CONN_IDLE_LATENCY 4
+// Link layer payload asked for, the default is 27 bytes
+#define BLE_CONN_TX_OCTETS 251
+// Its transmit time on the 1M PHY, NimBLE asks for both
+#define BLE_CONN_TX_TIME_US 2120
+// TX power: estimated host RSSI bounds, in dBm
+#define BLE_CONN_RSSI_HIGH -55
+#define BLE_CONN_RSSI_LOW -70
+// Seconds above BLE_CONN_RSSI_HIGH before each step down
+#define BLE_CONN_TX_HOLD_S 5
+// One controller power level, at most 7 of them below the default
+#define BLE_CONN_TX_STEP_DB 3
+#define BLE_CONN_TX_MAX_ATTEN_DB 21
+
+#if CONFIG_KB_BLE
+
+void ble_conn_init(void);
+
+/// From the BLE callbacks. Intervals are in 1.25 ms units, timeouts in 10 ms units.
+void ble_conn_connected(const esp_bd_addr_t remoteBda, uint16_t interval, uint16_t latency, uint16_t timeout);
+void ble_conn_disconnected(void);
+void ble_conn_params_updated(bool ok, uint16_t interval, uint16_t latency, uint16_t timeout);
+void ble_conn_data_len_updated(bool ok, uint16_t txOctets);
+/// txPhy: 1 for 1M, 2 for 2M, 3 for coded
+void ble_conn_phy_updated(bool ok, uint8_t txPhy);
+
+/// Connection RSSI, from the Bluedroid GAP callback; NimBLE builds read it in place.
+void ble_conn_rssi(bool ok, int8_t rssi);
+/// From the transport: an input report notification failed, full TX power back.
+void ble_conn_link_loss(void);
+
+/// A report is going out, from the scan task. Leaves the idle parameters.
+void ble_conn_activity(void);
+
+/// Current connection interval, 0 when not connected.
+uint32_t ble_conn_interval_us(void);
+
+/// On-air time of the notification of an attribute value of this length, with the current PHY and data length.
+uint32_t ble_conn_airtime_us(uint16_t valueLen);
+
+#else
+
+// Built without BLE (CONFIG_KB_BLE): never connected
+static inline void ble_conn_init(void) {}
+static inline void ble_conn_connected(const esp_bd_addr_t remoteBda, uint16_t interval, uint16_t latency, uint16_t timeout) {}
+static inline void ble_conn_disconnected(void) {}
+static inline void ble_conn_params_updated(bool ok, uint16_t interval, uint16_t latency, uint16_t timeout) {}
+static inline void ble_conn_data_len_updated(bool ok, uint16_t txOctets) {}
+static inline void ble_conn_phy_updated(bool ok, uint8_t txPhy) {}
+static inline void ble_conn_rssi(bool ok, int8_t rssi) {}
+static inline void ble_conn_link_loss(void) {}
+static inline void ble_conn_activity(void) {}
+static inline uint32_t ble_conn_interval_us(void) { return 0; }
+static inline uint32_t ble_conn_airtime_us(uint16_t valueLen) { return 0; }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLE_CONN_H__ */
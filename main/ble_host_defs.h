@@ -0,0 +1,56 @@
+/*
+ * Address and GATT types of the HID profile API, the transport and the
+ * connection code. Bluedroid defines them in its API headers; with another
+ * host (CONFIG_BT_NIMBLE_ENABLED), or none at all, the same names are
+ * defined here, so the code above the profile builds unchanged on either
+ * stack and in a USB only image.
+ */
+
+#ifndef BLE_HOST_DEFS_H__
+#define BLE_HOST_DEFS_H__
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#if CONFIG_BT_BLUEDROID_ENABLED
+#include "esp_bt_defs.h"
+#include "esp_gatt_defs.h"
+#else
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ESP_BD_ADDR_LEN 6
+/// Most significant byte first, as printed
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
+
+typedef enum {
+    BLE_ADDR_TYPE_PUBLIC = 0x00,
+    BLE_ADDR_TYPE_RANDOM = 0x01,
+    BLE_ADDR_TYPE_RPA_PUBLIC = 0x02,
+    BLE_ADDR_TYPE_RPA_RANDOM = 0x03,
+} esp_ble_addr_type_t;
+
+/// Unused outside Bluedroid
+typedef uint8_t esp_gatt_if_t;
+
+typedef enum {
+    ESP_GATT_OK = 0x00,
+    ESP_GATT_ERROR = 0x85,
+} esp_gatt_status_t;
+
+/// Intervals in 1.25 ms units, timeout in 10 ms units
+typedef struct {
+    uint16_t interval;
+    uint16_t latency;
+    uint16_t timeout;
+} esp_gatt_conn_params_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONFIG_BT_BLUEDROID_ENABLED */
+
+#endif /* BLE_HOST_DEFS_H__ */
@@ -7,9 +7,11 @@
 #include "esp_hidd_prf_api.h"
 #include "hidd_le_prf_int.h"
 #include "hid_dev.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "esp_log.h"
+#include "nvs.h"
 
 // HID keyboard input report length
 #define HID_KEYBOARD_IN_RPT_LEN     8
@@ -17,11 +19,13 @@
 // HID LED output report length
 #define HID_LED_OUT_RPT_LEN         1
 
+#if (SUPPORT_REPORT_MOUSE == true)
 // HID mouse input report length
 #define HID_MOUSE_IN_RPT_LEN        5
+#endif
 
-// HID consumer control input report length
-#define HID_CC_IN_RPT_LEN           2
+// Attribute table hash last seen by each bonded host, keyed by address
+#define HIDD_DB_NVS_NAMESPACE       "hidd_db"
 
 esp_err_t esp_hidd_register_callbacks(esp_hidd_event_cb_t callbacks)
 {
@@ -84,26 +88,92 @@ uint16_t esp_hidd_get_version(void)
 	return HIDD_VERSION;
 }
 
-void esp_hidd_send_consumer_value(uint16_t conn_id, uint8_t key_cmd, bool key_pressed)
+bool esp_hidd_get_conn_id(uint16_t *conn_id)
+{
+    for (int i = 0; i < HID_MAX_APPS; i++) {
+        if (hidd_le_env.hidd_clcb[i].in_use && hidd_le_env.hidd_clcb[i].connected) {
+            *conn_id = hidd_le_env.hidd_clcb[i].conn_id;
+            return true;
+        }
+    }
+    return false;
+}
+
+esp_err_t esp_hidd_check_db_cache(esp_bd_addr_t bda)
+{
+    nvs_handle_t nvs;
+    char key[13];
+    uint32_t seen = 0;
+    esp_err_t ret;
+
+    if (hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_SVC] == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    snprintf(key, sizeof(key), "%02x%02x%02x%02x%02x%02x", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+    if ((ret = nvs_open(HIDD_DB_NVS_NAMESPACE, NVS_READWRITE, &nvs)) != ESP_OK) {
+        return ret;
+    }
+    if (nvs_get_u32(nvs, key, &seen) == ESP_OK && seen == hidd_le_env.db_hash) {
+        nvs_close(nvs);
+        return ESP_OK;
+    }
+
+    // unknown host or another table: whatever it cached is invalid
+    ESP_LOGI(HID_LE_PRF_TAG, "attribute table %08lx, host saw %08lx, indicating service changed",
+             (unsigned long)hidd_le_env.db_hash, (unsigned long)seen);
+    ret = esp_ble_gatts_send_service_change_indication(hidd_le_env.gatt_if, bda);
+    if (ret == ESP_OK && nvs_set_u32(nvs, key, hidd_le_env.db_hash) == ESP_OK) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return ret;
+}
+
+esp_err_t esp_hidd_forget_host(esp_bd_addr_t bda)
+{
+    nvs_handle_t nvs;
+    char key[13];
+    esp_err_t ret;
+
+    snprintf(key, sizeof(key), "%02x%02x%02x%02x%02x%02x", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+    if ((ret = nvs_open(HIDD_DB_NVS_NAMESPACE, NVS_READWRITE, &nvs)) != ESP_OK) {
+        return ret == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : ret;
+    }
+    ret = nvs_erase_key(nvs, key);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs);
+    } else if (ret == ESP_ERR_NVS_NOT_FOUND) {
+        ret = ESP_OK;
+    }
+    nvs_close(nvs);
+    return ret;
+}
+
+esp_err_t esp_hidd_set_battery_level(uint8_t level)
+{
+    if (level > 100) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return hidd_le_set_battery_level(level);
+}
+
+esp_err_t esp_hidd_send_consumer_value(uint16_t conn_id, uint16_t key_cmd, bool key_pressed)
 {
     uint8_t buffer[HID_CC_IN_RPT_LEN] = {0, 0};
     if (key_pressed) {
-        printf("LOL KEY %d PRESSED\n", key_cmd);
         ESP_LOGD(HID_LE_PRF_TAG, "hid_consumer_build_report");
         hid_consumer_build_report(buffer, key_cmd);
     }
     ESP_LOGD(HID_LE_PRF_TAG, "buffer[0] = %x, buffer[1] = %x", buffer[0], buffer[1]);
-    printf("buffer[0] = %x, buffer[1] = %x\nSending report...\n", buffer[0], buffer[1]);
-    hid_dev_send_report(hidd_le_env.gatt_if, conn_id,
-                        HID_RPT_ID_CC_IN, HID_REPORT_TYPE_INPUT, HID_CC_IN_RPT_LEN, buffer);
-    return;
+    return hid_dev_send_report(hidd_le_env.gatt_if, conn_id,
+                               HID_RPT_ID_CC_IN, HID_REPORT_TYPE_INPUT, HID_CC_IN_RPT_LEN, buffer);
 }
 
-void esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask, uint8_t *keyboard_cmd, uint8_t num_key)
+esp_err_t esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask, uint8_t *keyboard_cmd, uint8_t num_key)
 {
     if (num_key > HID_KEYBOARD_IN_RPT_LEN - 2) {
         ESP_LOGE(HID_LE_PRF_TAG, "%s(), the number key should not be more than %d", __func__, HID_KEYBOARD_IN_RPT_LEN);
-        return;
+        return ESP_ERR_INVALID_ARG;
     }
 
     uint8_t buffer[HID_KEYBOARD_IN_RPT_LEN] = {0};
@@ -116,11 +186,20 @@ void esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask,
 
     // printf("the key vaule = %d,%d, %d,%d,%d,%d,%d,%d\n", buffer[0], buffer[1], buffer[2], buffer[3], buffer[4], buffer[5], buffer[6], buffer[7]);
     ESP_LOGD(HID_LE_PRF_TAG, "the key vaule = %d,%d,%d, %d, %d, %d,%d, %d", buffer[0], buffer[1], buffer[2], buffer[3], buffer[4], buffer[5], buffer[6], buffer[7]);
-    hid_dev_send_report(hidd_le_env.gatt_if, conn_id,
-                        HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT, HID_KEYBOARD_IN_RPT_LEN, buffer);
-    return;
+    return hid_dev_send_report(hidd_le_env.gatt_if, conn_id,
+                               HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT, HID_KEYBOARD_IN_RPT_LEN, buffer);
+}
+
+esp_err_t esp_hidd_send_keyboard_bitmap(uint16_t conn_id, key_mask_t special_key_mask, const uint8_t *bitmap, uint8_t len)
+{
+    uint8_t buffer[HID_NKRO_IN_RPT_LEN];
+
+    hid_nkro_build_report(buffer, special_key_mask, bitmap, len);
+    return hid_dev_send_report(hidd_le_env.gatt_if, conn_id,
+                               HID_RPT_ID_NKRO_IN, HID_REPORT_TYPE_INPUT, HID_NKRO_IN_RPT_LEN, buffer);
 }
 
+#if (SUPPORT_REPORT_MOUSE == true)
 void esp_hidd_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, int8_t mickeys_x, int8_t mickeys_y)
 {
     uint8_t buffer[HID_MOUSE_IN_RPT_LEN];
@@ -135,3 +214,4 @@ void esp_hidd_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, int8_t mi
                         HID_RPT_ID_MOUSE_IN, HID_REPORT_TYPE_INPUT, HID_MOUSE_IN_RPT_LEN, buffer);
     return;
 }
+#endif
@@ -18,9 +18,9 @@
 #ifndef __ESP_HIDD_API_H__
 #define __ESP_HIDD_API_H__
 
-#include "esp_bt_defs.h"
-#include "esp_gatt_defs.h"
+#include <stdbool.h>
 #include "esp_err.h"
+#include "ble_host_defs.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,6 +34,15 @@ typedef enum {
     ESP_HIDD_EVENT_BLE_DISCONNECT,
     ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT,
     ESP_HIDD_EVENT_BLE_LED_REPORT_WRITE_EVT,
+    ESP_HIDD_EVENT_BLE_REPORT_SENT_EVT,
+    ESP_HIDD_EVENT_BLE_CONGEST_EVT,
+    ESP_HIDD_EVENT_BLE_CCCD_WRITE_EVT,
+    // NimBLE profile only, Bluedroid reports these through the GAP callback
+    ESP_HIDD_EVENT_BLE_ADV_START_EVT,
+    ESP_HIDD_EVENT_BLE_AUTH_CMPL_EVT,
+    ESP_HIDD_EVENT_BLE_CONN_UPDATE_EVT,
+    ESP_HIDD_EVENT_BLE_DATA_LEN_EVT,
+    ESP_HIDD_EVENT_BLE_PHY_UPDATE_EVT,
 } esp_hidd_cb_event_t;
 
 /// HID config status
@@ -89,6 +98,7 @@ typedef union {
     struct hidd_connect_evt_param {
         uint16_t conn_id;
         esp_bd_addr_t remote_bda;                   /*!< HID Remote bluetooth connection index */
+        esp_gatt_conn_params_t conn_params;         /*!< Parameters the central connected with */
     } connect;									    /*!< HID callback param of ESP_HIDD_EVENT_CONNECT */
 
     /**
@@ -117,6 +127,73 @@ typedef union {
         uint8_t length;
         uint8_t *data;
     } led_write;
+
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_REPORT_SENT_EVT, a report notification left the stack
+     */
+    struct hidd_report_sent_evt_param {
+        uint16_t conn_id;
+        uint16_t handle;                            /*!< Report characteristic value handle */
+        esp_gatt_status_t status;
+    } report_sent;
+
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_CONGEST_EVT, notifications sent while congested are lost
+     */
+    struct hidd_congest_evt_param {
+        uint16_t conn_id;
+        bool congested;
+    } congest;
+
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_CCCD_WRITE_EVT, the host turned notifications of an input report on or off
+     */
+    struct hidd_cccd_write_evt_param {
+        uint16_t conn_id;
+        uint8_t report_id;
+        uint8_t mode;                               /*!< Protocol mode of the report (boot or report) */
+        bool notify;
+    } cccd_write;
+
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_ADV_START_EVT
+     */
+    struct hidd_adv_start_evt_param {
+        bool ok;
+    } adv_start;
+
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_AUTH_CMPL_EVT, the link is encrypted, or pairing failed
+     */
+    struct hidd_auth_cmpl_evt_param {
+        esp_bd_addr_t remote_bda;                   /*!< Identity address of the host */
+        esp_ble_addr_type_t addr_type;
+        bool success;
+    } auth_cmpl;
+
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_CONN_UPDATE_EVT
+     */
+    struct hidd_conn_update_evt_param {
+        bool ok;
+        esp_gatt_conn_params_t conn_params;
+    } conn_update;
+
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_DATA_LEN_EVT
+     */
+    struct hidd_data_len_evt_param {
+        bool ok;
+        uint16_t tx_octets;
+    } data_len;
+
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_PHY_UPDATE_EVT
+     */
+    struct hidd_phy_update_evt_param {
+        bool ok;
+        uint8_t tx_phy;                             /*!< 1 for 1M, 2 for 2M, 3 for coded */
+    } phy_update;
 } esp_hidd_cb_param_t;
 
 
@@ -167,10 +244,82 @@ esp_err_t esp_hidd_profile_deinit(void);
  */
 uint16_t esp_hidd_get_version(void);
 
-void esp_hidd_send_consumer_value(uint16_t conn_id, uint8_t key_cmd, bool key_pressed);
+/**
+ *
+ * @brief           Send a consumer control report: `key_cmd` (a 16-bit Consumer
+ *                  page usage) when pressed, an empty usage when released
+ *
+ */
+/**
+ *
+ * @brief           Get the connection of the HID host, if any
+ *
+ * @return          true when a host is connected, its conn_id in *conn_id
+ *
+ */
+bool esp_hidd_get_conn_id(uint16_t *conn_id);
+
+/**
+ *
+ * @brief           Once a bonded link is encrypted: indicates Service Changed to the
+ *                  host only if the attribute table differs from the one it saw last,
+ *                  so an up to date host keeps its cached HID database
+ *
+ * @return          ESP_OK - host up to date or indication sent, other - failed
+ *
+ */
+esp_err_t esp_hidd_check_db_cache(esp_bd_addr_t bda);
+
+/**
+ *
+ * @brief           Once the bond of a host is removed: drops the attribute table
+ *                  hash kept for it by esp_hidd_check_db_cache()
+ *
+ * @return          ESP_OK - nothing left for the host, other - NVS error
+ *
+ */
+esp_err_t esp_hidd_forget_host(esp_bd_addr_t bda);
 
-void esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask, uint8_t *keyboard_cmd, uint8_t num_key);
+/**
+ *
+ * @brief           Sets the Battery Level characteristic, in percent. A host that
+ *                  turned its notifications on is notified, only when the level changed.
+ *
+ * @return          ESP_OK - success, other - failed
+ *
+ */
+esp_err_t esp_hidd_set_battery_level(uint8_t level);
+
+esp_err_t esp_hidd_send_consumer_value(uint16_t conn_id, uint16_t key_cmd, bool key_pressed);
+
+esp_err_t esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask, uint8_t *keyboard_cmd, uint8_t num_key);
+
+/**
+ *
+ * @brief           Send the NKRO keyboard report, report protocol mode only: every key
+ *                  held, `bitmap` holding one bit per usage (bit n of byte n / 8). Usages
+ *                  above HID_NKRO_USAGE_MAX are left out. One notification per call.
+ *
+ * @return          ESP_OK - success, ESP_ERR_NOT_FOUND - the host is in boot protocol mode
+ *
+ */
+esp_err_t esp_hidd_send_keyboard_bitmap(uint16_t conn_id, key_mask_t special_key_mask, const uint8_t *bitmap, uint8_t len);
+
+#if CONFIG_BT_NIMBLE_ENABLED
+/**
+ *
+ * @brief           NimBLE profile only: sets the device name and starts undirected
+ *                  advertising, restarted after each disconnection. It slows down and
+ *                  stops in the steps of ble_adv.h, ble_adv_activity() brings it back.
+ *                  Bluedroid builds advertise through ble_adv once the advertising data is set.
+ *
+ * @return          ESP_OK - success, other - failed
+ *
+ */
+esp_err_t esp_hidd_start_advertising(const char *name);
+#endif
 
+// only built with SUPPORT_REPORT_MOUSE
 void esp_hidd_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, int8_t mickeys_x, int8_t mickeys_y);
 
 #ifdef __cplusplus
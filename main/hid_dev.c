@@ -9,46 +9,93 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "esp_log.h"
-
-static hid_report_map_t *hid_dev_rpt_tbl;
-static uint8_t hid_dev_rpt_tbl_Len;
+#if CONFIG_KB_BLE && CONFIG_BT_NIMBLE_ENABLED
+#include "host/ble_gatt.h"
+#include "host/ble_hs_mbuf.h"
+#endif
+
+#if CONFIG_KB_BLE
+// Report map entries indexed by report ID, type (input, output, feature)
+// and protocol mode (boot, report), filled once the attribute table exists
+static hid_report_map_t *hid_dev_rpt_idx[HID_DEV_RPT_ID_MAX + 1][HID_TYPE_FEATURE][HID_PROTOCOL_MODE_REPORT + 1];
+// The registered entries themselves, for the lookups by handle
+static hid_report_map_t *hid_dev_rpts = NULL;
+static uint8_t hid_dev_num_rpts = 0;
 
 static hid_report_map_t *hid_dev_rpt_by_id(uint8_t id, uint8_t type)
 {
-    hid_report_map_t *rpt = hid_dev_rpt_tbl;
-
-    for (uint8_t i = hid_dev_rpt_tbl_Len; i > 0; i--, rpt++) {
-        if (rpt->id == id && rpt->type == type && rpt->mode == hidProtocolMode) {
-            return rpt;
-        }
+    if (id > HID_DEV_RPT_ID_MAX || type < HID_TYPE_INPUT || type > HID_TYPE_FEATURE ||
+        hidProtocolMode > HID_PROTOCOL_MODE_REPORT) {
+        return NULL;
     }
-
-    return NULL;
+    return hid_dev_rpt_idx[id][type - 1][hidProtocolMode];
 }
 
 void hid_dev_register_reports(uint8_t num_reports, hid_report_map_t *p_report)
 {
-    hid_dev_rpt_tbl = p_report;
-    hid_dev_rpt_tbl_Len = num_reports;
+    memset(hid_dev_rpt_idx, 0, sizeof(hid_dev_rpt_idx));
+    hid_dev_rpts = p_report;
+    hid_dev_num_rpts = num_reports;
+    for (uint8_t i = 0; i < num_reports; i++, p_report++) {
+        if (p_report->type < HID_TYPE_INPUT || p_report->type > HID_TYPE_FEATURE) {
+            continue; // unused entry
+        }
+        if (p_report->id > HID_DEV_RPT_ID_MAX || p_report->mode > HID_PROTOCOL_MODE_REPORT) {
+            ESP_LOGE(HID_LE_PRF_TAG, "%s(), report id %d mode %d out of the index", __func__, p_report->id, p_report->mode);
+            abort();
+        }
+        if (p_report->handle == 0) {
+            ESP_LOGE(HID_LE_PRF_TAG, "%s(), report id %d type %d has no attribute", __func__, p_report->id, p_report->type);
+            continue;
+        }
+        // first entry wins, as with the former linear search
+        hid_report_map_t **slot = &hid_dev_rpt_idx[p_report->id][p_report->type - 1][p_report->mode];
+        if (*slot == NULL) {
+            *slot = p_report;
+        }
+    }
     return;
 }
 
-void hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id,
+esp_err_t hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id,
                                     uint8_t id, uint8_t type, uint8_t length, uint8_t *data)
 {
     hid_report_map_t *p_rpt;
 
     // get att handle for report
-    if ((p_rpt = hid_dev_rpt_by_id(id, type)) != NULL) {
-        // if notifications are enabled
-        ESP_LOGD(HID_LE_PRF_TAG, "%s(), send the report, handle = %d", __func__, p_rpt->handle);
-        esp_ble_gatts_send_indicate(gatts_if, conn_id, p_rpt->handle, length, data, false);
+    if ((p_rpt = hid_dev_rpt_by_id(id, type)) == NULL) {
+        // no such report in the current protocol mode
+        ESP_LOGE(HID_LE_PRF_TAG, "%s(), no report id %d type %d in mode %d", __func__, id, type, hidProtocolMode);
+        return ESP_ERR_NOT_FOUND;
     }
 
-    return;
+    ESP_LOGD(HID_LE_PRF_TAG, "%s(), send the report, handle = %d", __func__, p_rpt->handle);
+#if CONFIG_BT_NIMBLE_ENABLED
+    // gatts_if unused, conn_id is the NimBLE connection handle
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(data, length);
+    if (om == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    // the mbuf is consumed, even on failure
+    return ble_gatts_notify_custom(conn_id, p_rpt->handle, om) == 0 ? ESP_OK : ESP_FAIL;
+#else
+    return esp_ble_gatts_send_indicate(gatts_if, conn_id, p_rpt->handle, length, data, false);
+#endif
 }
 
+bool hid_dev_is_input_report(uint16_t handle)
+{
+    for (uint8_t i = 0; i < hid_dev_num_rpts; i++) {
+        if (hid_dev_rpts[i].handle == handle && hid_dev_rpts[i].type == HID_TYPE_INPUT) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif /* CONFIG_KB_BLE */
+
 void hid_consumer_build_report(uint8_t *buffer, consumer_cmd_t cmd)
 {
     if (!buffer) {
@@ -56,74 +103,19 @@ void hid_consumer_build_report(uint8_t *buffer, consumer_cmd_t cmd)
         return;
     }
 
-    switch (cmd) {
-        case HID_CONSUMER_CHANNEL_UP:
-            HID_CC_RPT_SET_CHANNEL(buffer, HID_CC_RPT_CHANNEL_UP);
-            break;
-
-        case HID_CONSUMER_CHANNEL_DOWN:
-            HID_CC_RPT_SET_CHANNEL(buffer, HID_CC_RPT_CHANNEL_DOWN);
-            break;
-
-        case HID_CONSUMER_VOLUME_UP:
-            HID_CC_RPT_SET_VOLUME_UP(buffer);
-            break;
-
-        case HID_CONSUMER_VOLUME_DOWN:
-            HID_CC_RPT_SET_VOLUME_DOWN(buffer);
-            break;
-
-        case HID_CONSUMER_MUTE:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_MUTE);
-            break;
-
-        case HID_CONSUMER_POWER:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_POWER);
-            break;
-
-        case HID_CONSUMER_RECALL_LAST:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_LAST);
-            break;
-
-        case HID_CONSUMER_ASSIGN_SEL:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_ASSIGN_SEL);
-            break;
-
-        case HID_CONSUMER_PLAY:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_PLAY);
-            break;
-
-        case HID_CONSUMER_PAUSE:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_PAUSE);
-            break;
-
-        case HID_CONSUMER_RECORD:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_RECORD);
-            break;
-
-        case HID_CONSUMER_FAST_FORWARD:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_FAST_FWD);
-            break;
-
-        case HID_CONSUMER_REWIND:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_REWIND);
-            break;
-
-        case HID_CONSUMER_SCAN_NEXT_TRK:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_SCAN_NEXT_TRK);
-            break;
-
-        case HID_CONSUMER_SCAN_PREV_TRK:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_SCAN_PREV_TRK);
-            break;
-
-        case HID_CONSUMER_STOP:
-            HID_CC_RPT_SET_BUTTON(buffer, HID_CC_RPT_STOP);
-            break;
+    buffer[0] = cmd & 0xFF;
+    buffer[1] = cmd >> 8;
+    return;
+}
 
-        default:
-            break;
+void hid_nkro_build_report(uint8_t *buffer, uint8_t modifiers, const uint8_t *bitmap, uint8_t len)
+{
+    if (!buffer || !bitmap) {
+        ESP_LOGE(HID_LE_PRF_TAG, "%s(), the buffer is NULL, hid build report failed.", __func__);
+        return;
     }
 
-    return;
+    buffer[0] = modifiers;
+    memset(&buffer[1], 0, HID_NKRO_BITMAP_LEN);
+    memcpy(&buffer[1], bitmap, len < HID_NKRO_BITMAP_LEN ? len : HID_NKRO_BITMAP_LEN);
 }
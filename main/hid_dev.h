@@ -173,47 +173,20 @@ typedef uint8_t mouse_cmd_t;
 #define HID_CONSUMER_BASS           227 // Bass
 #define HID_CONSUMER_VOLUME_UP      233 // Volume Increment
 #define HID_CONSUMER_VOLUME_DOWN    234 // Volume Decrement
-typedef uint8_t consumer_cmd_t;
-
-#define HID_CC_RPT_MUTE                 1
-#define HID_CC_RPT_POWER                2
-#define HID_CC_RPT_LAST                 3
-#define HID_CC_RPT_ASSIGN_SEL           4
-#define HID_CC_RPT_PLAY                 5
-#define HID_CC_RPT_PAUSE                6
-#define HID_CC_RPT_RECORD               7
-#define HID_CC_RPT_FAST_FWD             8
-#define HID_CC_RPT_REWIND               9
-#define HID_CC_RPT_SCAN_NEXT_TRK        10
-#define HID_CC_RPT_SCAN_PREV_TRK        11
-#define HID_CC_RPT_STOP                 12
-
-#define HID_CC_RPT_CHANNEL_UP           0x01
-#define HID_CC_RPT_CHANNEL_DOWN         0x03
-#define HID_CC_RPT_VOLUME_UP            0x40
-#define HID_CC_RPT_VOLUME_DOWN          0x80
-
-// HID Consumer Control report bitmasks
-#define HID_CC_RPT_NUMERIC_BITS         0xF0
-#define HID_CC_RPT_CHANNEL_BITS         0xCF
-#define HID_CC_RPT_VOLUME_BITS          0x3F
-#define HID_CC_RPT_BUTTON_BITS          0xF0
-#define HID_CC_RPT_SELECTION_BITS       0xCF
-
-
-// Macros for the HID Consumer Control 2-byte report
-#define HID_CC_RPT_SET_NUMERIC(s, x)    (s)[0] &= HID_CC_RPT_NUMERIC_BITS;   \
-                                        (s)[0] = (x)
-#define HID_CC_RPT_SET_CHANNEL(s, x)    (s)[0] &= HID_CC_RPT_CHANNEL_BITS;   \
-                                        (s)[0] |= ((x) & 0x03) << 4
-#define HID_CC_RPT_SET_VOLUME_UP(s)     (s)[0] &= HID_CC_RPT_VOLUME_BITS;    \
-                                        (s)[0] |= 0x40
-#define HID_CC_RPT_SET_VOLUME_DOWN(s)   (s)[0] &= HID_CC_RPT_VOLUME_BITS;    \
-                                        (s)[0] |= 0x80
-#define HID_CC_RPT_SET_BUTTON(s, x)     (s)[1] &= HID_CC_RPT_BUTTON_BITS;    \
-                                        (s)[1] |= (x)
-#define HID_CC_RPT_SET_SELECTION(s, x)  (s)[1] &= HID_CC_RPT_SELECTION_BITS; \
-                                        (s)[1] |= ((x) & 0x03) << 4
+typedef uint16_t consumer_cmd_t;
+
+// HID Consumer Control input report: one 16-bit usage, 0 when released.
+// Same layout as the USB consumer report, any usage up to HID_CC_USAGE_MAX.
+#define HID_CC_IN_RPT_LEN               2
+#define HID_CC_USAGE_MAX                0x03FF
+
+// HID NKRO keyboard input report, report protocol mode only: the modifier
+// byte, then one bit per key usage up to HID_NKRO_USAGE_MAX (LANG8), bit n
+// of byte n / 8. 20 bytes, one notification in the default 23 byte ATT MTU
+// and one 27 byte link layer packet, no MTU exchange or data length needed.
+#define HID_NKRO_USAGE_MAX              0x97
+#define HID_NKRO_BITMAP_LEN             ((HID_NKRO_USAGE_MAX + 1) / 8)
+#define HID_NKRO_IN_RPT_LEN             (1 + HID_NKRO_BITMAP_LEN)
 
 
 // HID report mapping table
@@ -234,13 +207,23 @@ typedef struct
 
 } hid_dev_cfg_t;
 
+// Highest report ID the lookup index holds
+#define HID_DEV_RPT_ID_MAX          7
+
+/// Build the (id, type, mode) lookup index, aborts on an entry it cannot hold.
 void hid_dev_register_reports(uint8_t num_reports, hid_report_map_t *p_report);
 
-void hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id,
+esp_err_t hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id,
                                     uint8_t id, uint8_t type, uint8_t length, uint8_t *data);
 
+/// True when handle is the value of a registered input report, in either protocol mode.
+bool hid_dev_is_input_report(uint16_t handle);
+
 void hid_consumer_build_report(uint8_t *buffer, consumer_cmd_t cmd);
 
+/// NKRO report from a key bitmap of len bytes, usages above HID_NKRO_USAGE_MAX are left out.
+void hid_nkro_build_report(uint8_t *buffer, uint8_t modifiers, const uint8_t *bitmap, uint8_t len);
+
 void hid_keyboard_build_report(uint8_t *buffer, keyboard_cmd_t cmd);
 
 void hid_mouse_build_report(uint8_t *buffer, mouse_cmd_t cmd);
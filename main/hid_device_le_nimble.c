@@ -0,0 +1,771 @@
+/*
+ * HID over GATT on the NimBLE host: the esp_hidd_* API of esp_hidd_prf_api.c,
+ * built in its place when the sdkconfig selects NimBLE (sdkconfig.nimble).
+ * Same services, reports and events as the Bluedroid profile; NimBLE assigns
+ * the handles when the services are registered and keeps the bonds in its
+ * NVS store. The host runs its own task, the callbacks run on it.
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nimble/nimble_port.h"
+#include "nimble/nimble_port_freertos.h"
+#include "host/ble_hs.h"
+#include "host/util/util.h"
+#include "services/gap/ble_svc_gap.h"
+#include "services/gatt/ble_svc_gatt.h"
+#include "esp_hidd_prf_api.h"
+#include "hidd_le_prf_int.h"
+#include "hid_dev.h"
+#include "hid_report_map.h"
+#include "ble_adv.h"
+#include "kb_config.h"
+
+#if (SUPPORT_REPORT_MOUSE == true) || (SUPPORT_REPORT_FEATURE == true) || (SUPPORT_REPORT_VENDOR == true)
+#error "the NimBLE profile only has the keyboard, LED and consumer control reports"
+#endif
+
+// HID keyboard input report length
+#define HID_KEYBOARD_IN_RPT_LEN     8
+
+// HID LED output report length
+#define HID_LED_OUT_RPT_LEN         1
+
+#define HI_UINT16(a) (((a) >> 8) & 0xFF)
+#define LO_UINT16(a) ((a) & 0xFF)
+
+// Characteristic and descriptor UUIDs, Bluedroid names them in esp_gatt_defs.h
+#define HIDD_UUID_BATTERY_LEVEL          0x2A19
+#define HIDD_UUID_HID_INFORMATION        0x2A4A
+#define HIDD_UUID_HID_REPORT_MAP         0x2A4B
+#define HIDD_UUID_HID_CONTROL_POINT      0x2A4C
+#define HIDD_UUID_HID_REPORT             0x2A4D
+#define HIDD_UUID_HID_PROTO_MODE         0x2A4E
+#define HIDD_UUID_HID_BOOT_KB_INPUT      0x2A22
+#define HIDD_UUID_HID_BOOT_KB_OUTPUT     0x2A32
+#define HIDD_UUID_EXT_RPT_REF_DESCR      0x2907
+#define HIDD_UUID_RPT_REF_DESCR          0x2908
+
+// Same as the Bluedroid advertising: HID generic appearance, the steps of ble_adv.h
+#define HIDD_APPEARANCE             0x03c0
+
+/* The NimBLE store, no public header declares it */
+void ble_store_config_init(void);
+
+/// Characteristics, passed to the access callback as its argument
+enum {
+    HIDD_CHR_BATTERY_LEVEL,
+    HIDD_CHR_INFO,
+    HIDD_CHR_REPORT_MAP,
+    HIDD_CHR_CONTROL_POINT,
+    HIDD_CHR_PROTO_MODE,
+    HIDD_CHR_KEY_IN,
+    HIDD_CHR_LED_OUT,
+    HIDD_CHR_CC_IN,
+    HIDD_CHR_NKRO_IN,
+    HIDD_CHR_BOOT_KB_IN,
+    HIDD_CHR_BOOT_KB_OUT,
+};
+
+uint8_t hidProtocolMode = HID_PROTOCOL_MODE_REPORT;
+
+static esp_hidd_event_cb_t hidd_cb = NULL;
+static bool hidd_enabled = false;
+static uint8_t own_addr_type;
+static volatile uint16_t hidd_conn_handle = BLE_HS_CONN_HANDLE_NONE;
+static bool hidd_advertising = false;
+
+/// Undirected advertising steps, as ble_adv.cc: fast, slow, then idle until BLE_ADV_SCHEDULE_S
+static const struct {
+    uint16_t itvl_min;
+    uint16_t itvl_max;
+    uint16_t until_s;
+} hidd_adv_steps[] = {
+    {BLE_ADV_FAST_INT_MIN, BLE_ADV_FAST_INT_MAX, BLE_ADV_FAST_S},
+    {BLE_ADV_SLOW_INT_MIN, BLE_ADV_SLOW_INT_MAX, BLE_ADV_SLOW_S},
+    {BLE_ADV_IDLE_INT_MIN, BLE_ADV_IDLE_INT_MAX, BLE_ADV_SCHEDULE_S},
+};
+#define HIDD_ADV_STEPS (sizeof(hidd_adv_steps) / sizeof(hidd_adv_steps[0]))
+
+// Written on the host task, read without lock by ble_adv_activity() on the scan task
+static volatile ble_adv_phase_t hidd_adv_phase = BLE_ADV_OFF;
+static volatile uint8_t hidd_adv_step = 0;
+// Advertising time accounted up to there, 0 when not advertising
+static int64_t hidd_adv_us = 0;
+// A keypress restarts advertising on the host task, as the GAP events
+static struct ble_npl_event hidd_wake_ev;
+
+static hid_report_map_t hid_rpt_map[HID_NUM_REPORTS];
+static uint8_t hid_rpt_num = 0;
+
+static uint16_t battery_level_handle;
+static uint16_t key_in_handle;
+static uint16_t led_out_handle;
+static uint16_t cc_in_handle;
+static uint16_t nkro_in_handle;
+static uint16_t boot_kb_in_handle;
+static uint16_t boot_kb_out_handle;
+
+static uint8_t battery_level = 50;
+static uint8_t led_value = 0;
+
+// HID Information characteristic value
+static const uint8_t hidInfo[HID_INFORMATION_LEN] = {
+    LO_UINT16(0x0111), HI_UINT16(0x0111),             // bcdHID (USB HID version)
+    0x00,                                             // bCountryCode
+    HID_KBD_FLAGS                                     // Flags
+};
+
+// HID External Report Reference Descriptor
+static const uint8_t hidExtReportRefDesc[2] = {LO_UINT16(HIDD_UUID_BATTERY_LEVEL), HI_UINT16(HIDD_UUID_BATTERY_LEVEL)};
+
+// HID Report Reference characteristic descriptors
+static const uint8_t hidReportRefKeyIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT};
+static const uint8_t hidReportRefLedOut[HID_REPORT_REF_LEN] = {HID_RPT_ID_LED_OUT, HID_REPORT_TYPE_OUTPUT};
+static const uint8_t hidReportRefCCIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_CC_IN, HID_REPORT_TYPE_INPUT};
+static const uint8_t hidReportRefNkroIn[HID_REPORT_REF_LEN] = {HID_RPT_ID_NKRO_IN, HID_REPORT_TYPE_INPUT};
+
+// Preferred connection interval in the advertising data, 7.5-20 ms
+static const uint8_t hidd_slave_itvl_range[4] = {0x06, 0x00, 0x10, 0x00};
+
+static int hidd_chr_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int hidd_dsc_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int hidd_gap_event(struct ble_gap_event *event, void *arg);
+
+#define HIDD_REPORT_REF(ref) \
+    (struct ble_gatt_dsc_def[]) { \
+        { .uuid = BLE_UUID16_DECLARE(HIDD_UUID_RPT_REF_DESCR), .att_flags = BLE_ATT_F_READ, \
+          .access_cb = hidd_dsc_access, .arg = (void *)(ref) }, \
+        { 0 }, \
+    }
+
+// Battery service first, then the HID service: same order, so same handles, at every boot
+static const struct ble_gatt_svc_def hidd_gatt_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = BLE_UUID16_DECLARE(BATTRAY_APP_ID),
+        .characteristics = (struct ble_gatt_chr_def[]) {
+            {
+                .uuid = BLE_UUID16_DECLARE(HIDD_UUID_BATTERY_LEVEL),
+                .access_cb = hidd_chr_access,
+                .arg = (void *)HIDD_CHR_BATTERY_LEVEL,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &battery_level_handle,
+            },
+            { 0 },
+        },
+    },
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = BLE_UUID16_DECLARE(ATT_SVC_HID),
+        .characteristics = (struct ble_gatt_chr_def[]) {
+            {
+                .uuid = BLE_UUID16_DECLARE(HIDD_UUID_HID_INFORMATION),
+                .access_cb = hidd_chr_access,
+                .arg = (void *)HIDD_CHR_INFO,
+                .flags = BLE_GATT_CHR_F_READ,
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(HIDD_UUID_HID_CONTROL_POINT),
+                .access_cb = hidd_chr_access,
+                .arg = (void *)HIDD_CHR_CONTROL_POINT,
+                .flags = BLE_GATT_CHR_F_WRITE_NO_RSP,
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(HIDD_UUID_HID_REPORT_MAP),
+                .access_cb = hidd_chr_access,
+                .arg = (void *)HIDD_CHR_REPORT_MAP,
+                .flags = BLE_GATT_CHR_F_READ,
+                .descriptors = (struct ble_gatt_dsc_def[]) {
+                    { .uuid = BLE_UUID16_DECLARE(HIDD_UUID_EXT_RPT_REF_DESCR), .att_flags = BLE_ATT_F_READ,
+                      .access_cb = hidd_dsc_access, .arg = (void *)hidExtReportRefDesc },
+                    { 0 },
+                },
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(HIDD_UUID_HID_PROTO_MODE),
+                .access_cb = hidd_chr_access,
+                .arg = (void *)HIDD_CHR_PROTO_MODE,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE_NO_RSP,
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(HIDD_UUID_HID_REPORT),
+                .access_cb = hidd_chr_access,
+                .arg = (void *)HIDD_CHR_KEY_IN,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_READ_ENC | BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &key_in_handle,
+                .descriptors = HIDD_REPORT_REF(hidReportRefKeyIn),
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(HIDD_UUID_HID_REPORT),
+                .access_cb = hidd_chr_access,
+                .arg = (void *)HIDD_CHR_LED_OUT,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP |
+                         BLE_GATT_CHR_F_READ_ENC | BLE_GATT_CHR_F_WRITE_ENC,
+                .val_handle = &led_out_handle,
+                .descriptors = HIDD_REPORT_REF(hidReportRefLedOut),
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(HIDD_UUID_HID_REPORT),
+                .access_cb = hidd_chr_access,
+                .arg = (void *)HIDD_CHR_CC_IN,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_READ_ENC | BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &cc_in_handle,
+                .descriptors = HIDD_REPORT_REF(hidReportRefCCIn),
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(HIDD_UUID_HID_REPORT),
+                .access_cb = hidd_chr_access,
+                .arg = (void *)HIDD_CHR_NKRO_IN,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_READ_ENC | BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &nkro_in_handle,
+                .descriptors = HIDD_REPORT_REF(hidReportRefNkroIn),
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(HIDD_UUID_HID_BOOT_KB_INPUT),
+                .access_cb = hidd_chr_access,
+                .arg = (void *)HIDD_CHR_BOOT_KB_IN,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &boot_kb_in_handle,
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(HIDD_UUID_HID_BOOT_KB_OUTPUT),
+                .access_cb = hidd_chr_access,
+                .arg = (void *)HIDD_CHR_BOOT_KB_OUT,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP,
+                .val_handle = &boot_kb_out_handle,
+            },
+            { 0 },
+        },
+    },
+    { 0 },
+};
+
+static void hidd_event(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *param)
+{
+    if (hidd_cb != NULL) {
+        hidd_cb(event, param);
+    }
+}
+
+// NimBLE keeps the address least significant byte first, Bluedroid the other way round
+static void hidd_bda(esp_bd_addr_t bda, const ble_addr_t *addr)
+{
+    for (int i = 0; i < ESP_BD_ADDR_LEN; i++) {
+        bda[i] = addr->val[ESP_BD_ADDR_LEN - 1 - i];
+    }
+}
+
+static int hidd_chr_write(uint16_t conn_handle, int chr, struct os_mbuf *om)
+{
+    esp_hidd_cb_param_t cb_param = {0};
+    uint8_t value;
+    uint16_t len;
+
+    // protocol mode, control point and LED reports are all one byte
+    if (OS_MBUF_PKTLEN(om) != 1 || ble_hs_mbuf_to_flat(om, &value, sizeof(value), &len) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    switch (chr) {
+    case HIDD_CHR_PROTO_MODE:
+        if (value > HID_PROTOCOL_MODE_REPORT) {
+            return BLE_ATT_ERR_UNLIKELY;
+        }
+        ESP_LOGI(HID_LE_PRF_TAG, "protocol mode %d", value);
+        hidProtocolMode = value;
+        break;
+    case HIDD_CHR_LED_OUT:
+    case HIDD_CHR_BOOT_KB_OUT:
+        led_value = value;
+        cb_param.led_write.conn_id = conn_handle;
+        cb_param.led_write.report_id = HID_RPT_ID_LED_OUT;
+        cb_param.led_write.length = HID_LED_OUT_RPT_LEN;
+        cb_param.led_write.data = &led_value;
+        hidd_event(ESP_HIDD_EVENT_BLE_LED_REPORT_WRITE_EVT, &cb_param);
+        break;
+    case HIDD_CHR_CONTROL_POINT:
+        // suspend and exit suspend, the keyboard does not change its behaviour
+        break;
+    default:
+        return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+    }
+    return 0;
+}
+
+static int hidd_chr_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    // input reports go out as notifications, a read gets the released state
+    static const uint8_t empty_report[HID_NKRO_IN_RPT_LEN] = {0};
+    int chr = (int)(intptr_t)arg;
+    const void *value;
+    uint16_t len;
+
+    if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR) {
+        return hidd_chr_write(conn_handle, chr, ctxt->om);
+    }
+
+    switch (chr) {
+    case HIDD_CHR_BATTERY_LEVEL:
+        value = &battery_level;
+        len = sizeof(battery_level);
+        break;
+    case HIDD_CHR_INFO:
+        value = hidInfo;
+        len = sizeof(hidInfo);
+        break;
+    case HIDD_CHR_REPORT_MAP:
+        // NimBLE serves the long reads from the offset
+        value = hidReportMap;
+        len = sizeof(hidReportMap);
+        break;
+    case HIDD_CHR_PROTO_MODE:
+        value = &hidProtocolMode;
+        len = sizeof(hidProtocolMode);
+        break;
+    case HIDD_CHR_KEY_IN:
+    case HIDD_CHR_BOOT_KB_IN:
+        value = empty_report;
+        len = HID_KEYBOARD_IN_RPT_LEN;
+        break;
+    case HIDD_CHR_CC_IN:
+        value = empty_report;
+        len = HID_CC_IN_RPT_LEN;
+        break;
+    case HIDD_CHR_NKRO_IN:
+        value = empty_report;
+        len = HID_NKRO_IN_RPT_LEN;
+        break;
+    case HIDD_CHR_LED_OUT:
+    case HIDD_CHR_BOOT_KB_OUT:
+        value = &led_value;
+        len = sizeof(led_value);
+        break;
+    default:
+        return BLE_ATT_ERR_READ_NOT_PERMITTED;
+    }
+    return os_mbuf_append(ctxt->om, value, len) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static int hidd_dsc_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    // report references and the external report reference, 2 bytes each
+    return os_mbuf_append(ctxt->om, arg, HID_REPORT_REF_LEN) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static uint8_t hid_add_rpt(uint8_t n, const uint8_t *ref, uint16_t handle, uint16_t cccdHandle, uint8_t mode)
+{
+    hid_rpt_map[n].id = ref[0];
+    hid_rpt_map[n].type = ref[1];
+    hid_rpt_map[n].handle = handle;
+    hid_rpt_map[n].cccdHandle = cccdHandle;
+    hid_rpt_map[n].mode = mode;
+    return n + 1;
+}
+
+static void hid_add_id_tbl(void)
+{
+    uint8_t n = 0;
+
+    // NimBLE adds the CCCD of a notifying characteristic right after its value
+    n = hid_add_rpt(n, hidReportRefKeyIn, key_in_handle, key_in_handle + 1, HID_PROTOCOL_MODE_REPORT);
+    n = hid_add_rpt(n, hidReportRefCCIn, cc_in_handle, cc_in_handle + 1, HID_PROTOCOL_MODE_REPORT);
+    n = hid_add_rpt(n, hidReportRefNkroIn, nkro_in_handle, nkro_in_handle + 1, HID_PROTOCOL_MODE_REPORT);
+    n = hid_add_rpt(n, hidReportRefLedOut, led_out_handle, 0, HID_PROTOCOL_MODE_REPORT);
+    // Boot reports use the same ID and type as the report mode ones
+    n = hid_add_rpt(n, hidReportRefKeyIn, boot_kb_in_handle, boot_kb_in_handle + 1, HID_PROTOCOL_MODE_BOOT);
+    n = hid_add_rpt(n, hidReportRefLedOut, boot_kb_out_handle, 0, HID_PROTOCOL_MODE_BOOT);
+    hid_rpt_num = n;
+
+    ESP_LOGI(HID_LE_PRF_TAG, "%d reports, report map %d bytes", n, (int)sizeof(hidReportMap));
+    hid_dev_register_reports(n, hid_rpt_map);
+}
+
+// Host task: accounts the advertising time (KB_COUNTER_BLE_ADV_MS)
+static void hidd_adv_account(bool stopped)
+{
+    if (hidd_adv_us == 0) {
+        return;
+    }
+    uint32_t ms = (uint32_t)((esp_timer_get_time() - hidd_adv_us) / 1000);
+    hidd_adv_us = stopped ? 0 : hidd_adv_us + (int64_t)ms * 1000;
+    kb_counter_add(KB_COUNTER_BLE_ADV_MS, ms);
+}
+
+// Host task: advertises at the interval of the step, until the step times out (BLE_GAP_EVENT_ADV_COMPLETE)
+static void hidd_advertise(uint8_t step)
+{
+    esp_hidd_cb_param_t cb_param = {0};
+    struct ble_gap_adv_params params = {0};
+    int32_t duration_ms = (hidd_adv_steps[step].until_s - (step > 0 ? hidd_adv_steps[step - 1].until_s : 0)) * 1000;
+    int rc;
+
+    params.conn_mode = BLE_GAP_CONN_MODE_UND;
+    params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+    params.itvl_min = hidd_adv_steps[step].itvl_min;
+    params.itvl_max = hidd_adv_steps[step].itvl_max;
+    hidd_adv_step = step;
+    rc = ble_gap_adv_start(own_addr_type, NULL, duration_ms, &params, hidd_gap_event, NULL);
+    if (rc != 0) {
+        ESP_LOGE(HID_LE_PRF_TAG, "%s(), advertising start failed, rc = %d", __func__, rc);
+        hidd_adv_phase = BLE_ADV_OFF;
+    } else {
+        ESP_LOGI(HID_LE_PRF_TAG, "general advertising, %u-%u x 0.625 ms", params.itvl_min, params.itvl_max);
+        hidd_adv_phase = BLE_ADV_GENERAL;
+        if (hidd_adv_us == 0) {
+            hidd_adv_us = esp_timer_get_time();
+        }
+    }
+    cb_param.adv_start.ok = rc == 0;
+    hidd_event(ESP_HIDD_EVENT_BLE_ADV_START_EVT, &cb_param);
+}
+
+// Host task: the step ran out without a connection, next one or stop
+static void hidd_adv_timeout(void)
+{
+    hidd_adv_account(false);
+    if (hidd_adv_step + 1 < (int)HIDD_ADV_STEPS) {
+        hidd_advertise(hidd_adv_step + 1);
+        return;
+    }
+    ESP_LOGI(HID_LE_PRF_TAG, "no connection after %d s, advertising stopped", BLE_ADV_SCHEDULE_S);
+    hidd_adv_account(true);
+    hidd_adv_phase = BLE_ADV_STOPPED;
+    kb_counter_add(KB_COUNTER_BLE_ADV_TIMEOUTS, 1);
+}
+
+// Host task, posted by ble_adv_activity()
+static void hidd_wake(struct ble_npl_event *ev)
+{
+    if (!hidd_advertising || hidd_conn_handle != BLE_HS_CONN_HANDLE_NONE ||
+        (hidd_adv_phase != BLE_ADV_STOPPED && (hidd_adv_phase == BLE_ADV_OFF || hidd_adv_step == 0))) {
+        return;
+    }
+    ESP_LOGI(HID_LE_PRF_TAG, "keypress, fast advertising again");
+    kb_counter_add(KB_COUNTER_BLE_ADV_WAKES, 1);
+    if (hidd_adv_phase == BLE_ADV_GENERAL) {
+        ble_gap_adv_stop();
+        hidd_adv_account(false);
+    }
+    hidd_advertise(0);
+}
+
+void ble_adv_activity(void)
+{
+    // connected or still fast: nothing to do, and nothing queued from the scan task
+    if (hidd_adv_phase != BLE_ADV_STOPPED && hidd_adv_step == 0) {
+        return;
+    }
+    // an event already queued is not queued twice
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &hidd_wake_ev);
+}
+
+ble_adv_phase_t ble_adv_phase(void)
+{
+    return hidd_adv_phase;
+}
+
+static int hidd_gap_event(struct ble_gap_event *event, void *arg)
+{
+    esp_hidd_cb_param_t cb_param = {0};
+    struct ble_gap_conn_desc desc;
+
+    switch (event->type) {
+    case BLE_GAP_EVENT_CONNECT:
+        if (event->connect.status != 0 || ble_gap_conn_find(event->connect.conn_handle, &desc) != 0) {
+            ESP_LOGW(HID_LE_PRF_TAG, "connection failed, status = %d", event->connect.status);
+            hidd_adv_account(false);
+            hidd_advertise(0);
+            break;
+        }
+        hidd_adv_account(true);
+        hidd_adv_phase = BLE_ADV_OFF;
+        hidd_adv_step = 0;
+        hidd_conn_handle = event->connect.conn_handle;
+        // HOGP: every connection starts in report protocol mode
+        hidProtocolMode = HID_PROTOCOL_MODE_REPORT;
+        cb_param.connect.conn_id = event->connect.conn_handle;
+        hidd_bda(cb_param.connect.remote_bda, &desc.peer_id_addr);
+        cb_param.connect.conn_params.interval = desc.conn_itvl;
+        cb_param.connect.conn_params.latency = desc.conn_latency;
+        cb_param.connect.conn_params.timeout = desc.supervision_timeout;
+        // as the Bluedroid profile: encryption right away, a bonded host resumes it without pairing
+        ble_gap_security_initiate(event->connect.conn_handle);
+        hidd_event(ESP_HIDD_EVENT_BLE_CONNECT, &cb_param);
+        break;
+    case BLE_GAP_EVENT_DISCONNECT:
+        hidd_conn_handle = BLE_HS_CONN_HANDLE_NONE;
+        hidProtocolMode = HID_PROTOCOL_MODE_REPORT;
+        hidd_bda(cb_param.disconnect.remote_bda, &event->disconnect.conn.peer_id_addr);
+        hidd_event(ESP_HIDD_EVENT_BLE_DISCONNECT, &cb_param);
+        if (hidd_advertising) {
+            hidd_advertise(0);
+        }
+        break;
+    case BLE_GAP_EVENT_ADV_COMPLETE:
+        // a connection or ble_gap_adv_stop() is handled where it happens
+        if (event->adv_complete.reason == BLE_HS_ETIMEOUT) {
+            hidd_adv_timeout();
+        }
+        break;
+    case BLE_GAP_EVENT_ENC_CHANGE:
+        if (ble_gap_conn_find(event->enc_change.conn_handle, &desc) != 0) {
+            break;
+        }
+        cb_param.auth_cmpl.success = event->enc_change.status == 0;
+        hidd_bda(cb_param.auth_cmpl.remote_bda, &desc.peer_id_addr);
+        cb_param.auth_cmpl.addr_type = (esp_ble_addr_type_t)desc.peer_id_addr.type;
+        hidd_event(ESP_HIDD_EVENT_BLE_AUTH_CMPL_EVT, &cb_param);
+        break;
+    case BLE_GAP_EVENT_REPEAT_PAIRING:
+        // the host lost its keys: forget ours, it pairs again
+        if (ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc) == 0) {
+            ble_store_util_delete_peer(&desc.peer_id_addr);
+        }
+        return BLE_GAP_REPEAT_PAIRING_RETRY;
+    case BLE_GAP_EVENT_CONN_UPDATE:
+        cb_param.conn_update.ok = event->conn_update.status == 0 &&
+                                  ble_gap_conn_find(event->conn_update.conn_handle, &desc) == 0;
+        if (cb_param.conn_update.ok) {
+            cb_param.conn_update.conn_params.interval = desc.conn_itvl;
+            cb_param.conn_update.conn_params.latency = desc.conn_latency;
+            cb_param.conn_update.conn_params.timeout = desc.supervision_timeout;
+        }
+        hidd_event(ESP_HIDD_EVENT_BLE_CONN_UPDATE_EVT, &cb_param);
+        break;
+    case BLE_GAP_EVENT_SUBSCRIBE:
+        // client characteristic configuration of an input report
+        for (int i = 0; i < hid_rpt_num; i++) {
+            if (hid_rpt_map[i].handle != event->subscribe.attr_handle || hid_rpt_map[i].type != HID_REPORT_TYPE_INPUT) {
+                continue;
+            }
+            cb_param.cccd_write.conn_id = event->subscribe.conn_handle;
+            cb_param.cccd_write.report_id = hid_rpt_map[i].id;
+            cb_param.cccd_write.mode = hid_rpt_map[i].mode;
+            cb_param.cccd_write.notify = event->subscribe.cur_notify;
+            hidd_event(ESP_HIDD_EVENT_BLE_CCCD_WRITE_EVT, &cb_param);
+            break;
+        }
+        break;
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        // raised once the notification is handed to the controller, as ESP_GATTS_CONF_EVT
+        if (event->notify_tx.indication) {
+            break;
+        }
+        cb_param.report_sent.conn_id = event->notify_tx.conn_handle;
+        cb_param.report_sent.handle = event->notify_tx.attr_handle;
+        cb_param.report_sent.status = event->notify_tx.status == 0 ? ESP_GATT_OK : ESP_GATT_ERROR;
+        hidd_event(ESP_HIDD_EVENT_BLE_REPORT_SENT_EVT, &cb_param);
+        break;
+    case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+        cb_param.phy_update.ok = event->phy_updated.status == 0;
+        cb_param.phy_update.tx_phy = event->phy_updated.tx_phy;
+        hidd_event(ESP_HIDD_EVENT_BLE_PHY_UPDATE_EVT, &cb_param);
+        break;
+#ifdef BLE_GAP_EVENT_DATA_LEN_CHG
+    case BLE_GAP_EVENT_DATA_LEN_CHG:
+        cb_param.data_len.ok = true;
+        cb_param.data_len.tx_octets = event->data_len_chg.max_tx_octets;
+        hidd_event(ESP_HIDD_EVENT_BLE_DATA_LEN_EVT, &cb_param);
+        break;
+#endif
+    case BLE_GAP_EVENT_MTU:
+        ESP_LOGI(HID_LE_PRF_TAG, "MTU %d", event->mtu.value);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+static void hidd_on_sync(void)
+{
+    esp_hidd_cb_param_t cb_param = {0};
+
+    ble_hs_util_ensure_addr(0);
+    ble_hs_id_infer_auto(0, &own_addr_type);
+    // the services are registered by now, their handles are known
+    hid_add_id_tbl();
+    cb_param.init_finish.state = ESP_HIDD_INIT_OK;
+    hidd_event(ESP_HIDD_EVENT_REG_FINISH, &cb_param);
+}
+
+static void hidd_on_reset(int reason)
+{
+    ESP_LOGE(HID_LE_PRF_TAG, "host reset, reason = %d", reason);
+}
+
+static void hidd_host_task(void *param)
+{
+    nimble_port_run();
+    nimble_port_freertos_deinit();
+}
+
+esp_err_t esp_hidd_register_callbacks(esp_hidd_event_cb_t callbacks)
+{
+    if (callbacks == NULL || !hidd_enabled) {
+        return ESP_FAIL;
+    }
+    hidd_cb = callbacks;
+    // ESP_HIDD_EVENT_REG_FINISH follows, once the host and the controller are in sync
+    nimble_port_freertos_init(hidd_host_task);
+    return ESP_OK;
+}
+
+esp_err_t esp_hidd_profile_init(void)
+{
+    int rc;
+
+    if (hidd_enabled) {
+        ESP_LOGE(HID_LE_PRF_TAG, "HID device profile already initialized");
+        return ESP_FAIL;
+    }
+
+    ble_hs_cfg.sync_cb = hidd_on_sync;
+    ble_hs_cfg.reset_cb = hidd_on_reset;
+    ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+    // same pairing as the Bluedroid build: bonding, no IO, encryption and identity keys both ways
+    ble_hs_cfg.sm_io_cap = BLE_SM_IO_CAP_NO_IO;
+    ble_hs_cfg.sm_bonding = 1;
+    ble_hs_cfg.sm_mitm = 0;
+    ble_hs_cfg.sm_sc = 0;
+    ble_hs_cfg.sm_our_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+    ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+
+    ble_svc_gap_init();
+    ble_svc_gatt_init();
+    ble_svc_gap_device_appearance_set(HIDD_APPEARANCE);
+    if ((rc = ble_gatts_count_cfg(hidd_gatt_svcs)) != 0 || (rc = ble_gatts_add_svcs(hidd_gatt_svcs)) != 0) {
+        ESP_LOGE(HID_LE_PRF_TAG, "%s(), adding the services failed, rc = %d", __func__, rc);
+        return ESP_FAIL;
+    }
+    ble_store_config_init();
+    ble_npl_event_init(&hidd_wake_ev, hidd_wake, NULL);
+    hidd_enabled = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_hidd_profile_deinit(void)
+{
+    if (!hidd_enabled) {
+        return ESP_OK;
+    }
+    if (nimble_port_stop() != 0) {
+        return ESP_FAIL;
+    }
+    nimble_port_deinit();
+    // ble_adv_activity() posts nothing more
+    hidd_adv_phase = BLE_ADV_OFF;
+    hidd_adv_step = 0;
+    hidd_enabled = false;
+    return ESP_OK;
+}
+
+uint16_t esp_hidd_get_version(void)
+{
+    return HIDD_VERSION;
+}
+
+bool esp_hidd_get_conn_id(uint16_t *conn_id)
+{
+    uint16_t handle = hidd_conn_handle;
+    if (handle == BLE_HS_CONN_HANDLE_NONE) {
+        return false;
+    }
+    *conn_id = handle;
+    return true;
+}
+
+esp_err_t esp_hidd_check_db_cache(esp_bd_addr_t bda)
+{
+    // Service Changed on a table change is only implemented by the Bluedroid profile: a NimBLE
+    // host that cached an older table has to be paired again
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_hidd_forget_host(esp_bd_addr_t bda)
+{
+    // no table hash kept per host
+    return ESP_OK;
+}
+
+esp_err_t esp_hidd_set_battery_level(uint8_t level)
+{
+    if (level > 100) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (level == battery_level) {
+        return ESP_OK;
+    }
+    battery_level = level;
+    // notifies the subscribed hosts, the read callback returns the new value
+    if (battery_level_handle != 0) {
+        ble_gatts_chr_updated(battery_level_handle);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_hidd_start_advertising(const char *name)
+{
+    struct ble_hs_adv_fields fields = {0};
+    struct ble_hs_adv_fields rsp = {0};
+    int rc;
+
+    ble_svc_gap_device_name_set(name);
+
+    fields.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+    fields.tx_pwr_lvl_is_present = 1;
+    fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
+    fields.appearance = HIDD_APPEARANCE;
+    fields.appearance_is_present = 1;
+    fields.uuids16 = (ble_uuid16_t[]) { BLE_UUID16_INIT(ATT_SVC_HID) };
+    fields.num_uuids16 = 1;
+    fields.uuids16_is_complete = 1;
+    fields.slave_itvl_range = hidd_slave_itvl_range;
+    // the full name does not fit next to the rest, it goes in the scan response
+    rsp.name = (const uint8_t *)name;
+    rsp.name_len = strlen(name);
+    rsp.name_is_complete = 1;
+
+    if ((rc = ble_gap_adv_set_fields(&fields)) != 0 || (rc = ble_gap_adv_rsp_set_fields(&rsp)) != 0) {
+        ESP_LOGE(HID_LE_PRF_TAG, "%s(), advertising data rejected, rc = %d", __func__, rc);
+        return ESP_FAIL;
+    }
+    hidd_advertising = true;
+    hidd_advertise(0);
+    return ESP_OK;
+}
+
+esp_err_t esp_hidd_send_consumer_value(uint16_t conn_id, uint16_t key_cmd, bool key_pressed)
+{
+    uint8_t buffer[HID_CC_IN_RPT_LEN] = {0, 0};
+    if (key_pressed) {
+        hid_consumer_build_report(buffer, key_cmd);
+    }
+    return hid_dev_send_report(0, conn_id, HID_RPT_ID_CC_IN, HID_REPORT_TYPE_INPUT, HID_CC_IN_RPT_LEN, buffer);
+}
+
+esp_err_t esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask, uint8_t *keyboard_cmd, uint8_t num_key)
+{
+    if (num_key > HID_KEYBOARD_IN_RPT_LEN - 2) {
+        ESP_LOGE(HID_LE_PRF_TAG, "%s(), the number key should not be more than %d", __func__, HID_KEYBOARD_IN_RPT_LEN);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint8_t buffer[HID_KEYBOARD_IN_RPT_LEN] = {0};
+
+    buffer[0] = special_key_mask;
+    for (int i = 0; i < num_key; i++) {
+        buffer[i + 2] = keyboard_cmd[i];
+    }
+    return hid_dev_send_report(0, conn_id, HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT, HID_KEYBOARD_IN_RPT_LEN, buffer);
+}
+
+esp_err_t esp_hidd_send_keyboard_bitmap(uint16_t conn_id, key_mask_t special_key_mask, const uint8_t *bitmap, uint8_t len)
+{
+    uint8_t buffer[HID_NKRO_IN_RPT_LEN];
+
+    hid_nkro_build_report(buffer, special_key_mask, bitmap, len);
+    return hid_dev_send_report(0, conn_id, HID_RPT_ID_NKRO_IN, HID_REPORT_TYPE_INPUT, HID_NKRO_IN_RPT_LEN, buffer);
+}
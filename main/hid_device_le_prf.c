@@ -5,6 +5,7 @@
  */
 
 #include "hidd_le_prf_int.h"
+#include "hid_report_map.h"
 #include <string.h>
 #include "esp_log.h"
 
@@ -26,157 +27,6 @@ struct prf_char_pres_fmt
 // HID report mapping table
 static hid_report_map_t hid_rpt_map[HID_NUM_REPORTS];
 
-// HID Report Map characteristic value
-// Keyboard report descriptor (using format for Boot interface descriptor)
-static const uint8_t hidReportMap[] = {
-    0x05, 0x01,  // Usage Page (Generic Desktop)
-    0x09, 0x02,  // Usage (Mouse)
-    0xA1, 0x01,  // Collection (Application)
-    0x85, 0x01,  // Report Id (1)
-    0x09, 0x01,  //   Usage (Pointer)
-    0xA1, 0x00,  //   Collection (Physical)
-    0x05, 0x09,  //     Usage Page (Buttons)
-    0x19, 0x01,  //     Usage Minimum (01) - Button 1
-    0x29, 0x03,  //     Usage Maximum (03) - Button 3
-    0x15, 0x00,  //     Logical Minimum (0)
-    0x25, 0x01,  //     Logical Maximum (1)
-    0x75, 0x01,  //     Report Size (1)
-    0x95, 0x03,  //     Report Count (3)
-    0x81, 0x02,  //     Input (Data, Variable, Absolute) - Button states
-    0x75, 0x05,  //     Report Size (5)
-    0x95, 0x01,  //     Report Count (1)
-    0x81, 0x01,  //     Input (Constant) - Padding or Reserved bits
-    0x05, 0x01,  //     Usage Page (Generic Desktop)
-    0x09, 0x30,  //     Usage (X)
-    0x09, 0x31,  //     Usage (Y)
-    0x09, 0x38,  //     Usage (Wheel)
-    0x15, 0x81,  //     Logical Minimum (-127)
-    0x25, 0x7F,  //     Logical Maximum (127)
-    0x75, 0x08,  //     Report Size (8)
-    0x95, 0x03,  //     Report Count (3)
-    0x81, 0x06,  //     Input (Data, Variable, Relative) - X & Y coordinate
-    0xC0,        //   End Collection
-    0xC0,        // End Collection
-
-    0x05, 0x01,  // Usage Pg (Generic Desktop)
-    0x09, 0x06,  // Usage (Keyboard)
-    0xA1, 0x01,  // Collection: (Application)
-    0x85, 0x02,  // Report Id (2)
-    //
-    0x05, 0x07,  //   Usage Pg (Key Codes)
-    0x19, 0xE0,  //   Usage Min (224)
-    0x29, 0xE7,  //   Usage Max (231)
-    0x15, 0x00,  //   Log Min (0)
-    0x25, 0x01,  //   Log Max (1)
-    //
-    //   Modifier byte
-    0x75, 0x01,  //   Report Size (1)
-    0x95, 0x08,  //   Report Count (8)
-    0x81, 0x02,  //   Input: (Data, Variable, Absolute)
-    //
-    //   Reserved byte
-    0x95, 0x01,  //   Report Count (1)
-    0x75, 0x08,  //   Report Size (8)
-    0x81, 0x01,  //   Input: (Constant)
-    //
-    //   LED report
-    0x05, 0x08,  //   Usage Pg (LEDs)
-    0x19, 0x01,  //   Usage Min (1)
-    0x29, 0x05,  //   Usage Max (5)
-    0x95, 0x05,  //   Report Count (5)
-    0x75, 0x01,  //   Report Size (1)
-    0x91, 0x02,  //   Output: (Data, Variable, Absolute)
-    //
-    //   LED report padding
-    0x95, 0x01,  //   Report Count (1)
-    0x75, 0x03,  //   Report Size (3)
-    0x91, 0x01,  //   Output: (Constant)
-    //
-    //   Key arrays (6 bytes)
-    0x95, 0x06,  //   Report Count (6)
-    0x75, 0x08,  //   Report Size (8)
-    0x15, 0x00,  //   Log Min (0)
-    0x25, 0x65,  //   Log Max (101)
-    0x05, 0x07,  //   Usage Pg (Key Codes)
-    0x19, 0x00,  //   Usage Min (0)
-    0x29, 0x65,  //   Usage Max (101)
-    0x81, 0x00,  //   Input: (Data, Array)
-    //
-    0xC0,        // End Collection
-    //
-    0x05, 0x0C,   // Usage Pg (Consumer Devices)
-    0x09, 0x01,   // Usage (Consumer Control)
-    0xA1, 0x01,   // Collection (Application)
-    0x85, 0x03,   // Report Id (3)
-    0x09, 0x02,   //   Usage (Numeric Key Pad)
-    0xA1, 0x02,   //   Collection (Logical)
-    0x05, 0x09,   //     Usage Pg (Button)
-    0x19, 0x01,   //     Usage Min (Button 1)
-    0x29, 0x0A,   //     Usage Max (Button 10)
-    0x15, 0x01,   //     Logical Min (1)
-    0x25, 0x0A,   //     Logical Max (10)
-    0x75, 0x04,   //     Report Size (4)
-    0x95, 0x01,   //     Report Count (1)
-    0x81, 0x00,   //     Input (Data, Ary, Abs)
-    0xC0,         //   End Collection
-    0x05, 0x0C,   //   Usage Pg (Consumer Devices)
-    0x09, 0x86,   //   Usage (Channel)
-    0x15, 0xFF,   //   Logical Min (-1)
-    0x25, 0x01,   //   Logical Max (1)
-    0x75, 0x02,   //   Report Size (2)
-    0x95, 0x01,   //   Report Count (1)
-    0x81, 0x46,   //   Input (Data, Var, Rel, Null)
-    0x09, 0xE9,   //   Usage (Volume Up)
-    0x09, 0xEA,   //   Usage (Volume Down)
-    0x15, 0x00,   //   Logical Min (0)
-    0x75, 0x01,   //   Report Size (1)
-    0x95, 0x02,   //   Report Count (2)
-    0x81, 0x02,   //   Input (Data, Var, Abs)
-    0x09, 0xE2,   //   Usage (Mute)
-    0x09, 0x30,   //   Usage (Power)
-    0x09, 0x83,   //   Usage (Recall Last)
-    0x09, 0x81,   //   Usage (Assign Selection)
-    0x09, 0xB0,   //   Usage (Play)
-    0x09, 0xB1,   //   Usage (Pause)
-    0x09, 0xB2,   //   Usage (Record)
-    0x09, 0xB3,   //   Usage (Fast Forward)
-    0x09, 0xB4,   //   Usage (Rewind)
-    0x09, 0xB5,   //   Usage (Scan Next)
-    0x09, 0xB6,   //   Usage (Scan Prev)
-    0x09, 0xB7,   //   Usage (Stop)
-    0x15, 0x01,   //   Logical Min (1)
-    0x25, 0x0C,   //   Logical Max (12)
-    0x75, 0x04,   //   Report Size (4)
-    0x95, 0x01,   //   Report Count (1)
-    0x81, 0x00,   //   Input (Data, Ary, Abs)
-    0x09, 0x80,   //   Usage (Selection)
-    0xA1, 0x02,   //   Collection (Logical)
-    0x05, 0x09,   //     Usage Pg (Button)
-    0x19, 0x01,   //     Usage Min (Button 1)
-    0x29, 0x03,   //     Usage Max (Button 3)
-    0x15, 0x01,   //     Logical Min (1)
-    0x25, 0x03,   //     Logical Max (3)
-    0x75, 0x02,   //     Report Size (2)
-    0x81, 0x00,   //     Input (Data, Ary, Abs)
-    0xC0,           //   End Collection
-    0x81, 0x03,   //   Input (Const, Var, Abs)
-    0xC0,            // End Collectionq
-
-#if (SUPPORT_REPORT_VENDOR == true)
-    0x06, 0xFF, 0xFF, // Usage Page(Vendor defined)
-    0x09, 0xA5,       // Usage(Vendor Defined)
-    0xA1, 0x01,       // Collection(Application)
-    0x85, 0x04,   // Report Id (4)
-    0x09, 0xA6,   // Usage(Vendor defined)
-    0x09, 0xA9,   // Usage(Vendor defined)
-    0x75, 0x08,   // Report Size
-    0x95, 0x7F,   // Report Count = 127 Btyes
-    0x91, 0x02,   // Output(Data, Variable, Absolute)
-    0xC0,         // End Collection
-#endif
-
-};
-
 /// Battery Service Attributes Indexes
 enum
 {
@@ -222,9 +72,11 @@ static const uint8_t hidInfo[HID_INFORMATION_LEN] = {
 // HID External Report Reference Descriptor
 static uint16_t hidExtReportRefDesc = ESP_GATT_UUID_BATTERY_LEVEL;
 
+#if (SUPPORT_REPORT_MOUSE == true)
 // HID Report Reference characteristic descriptor, mouse input
 static uint8_t hidReportRefMouseIn[HID_REPORT_REF_LEN] =
              { HID_RPT_ID_MOUSE_IN, HID_REPORT_TYPE_INPUT };
+#endif
 
 
 // HID Report Reference characteristic descriptor, key input
@@ -241,14 +93,20 @@ static uint8_t hidReportRefVendorOut[HID_REPORT_REF_LEN] =
              {HID_RPT_ID_VENDOR_OUT, HID_REPORT_TYPE_OUTPUT};
 #endif
 
+#if (SUPPORT_REPORT_FEATURE == true)
 // HID Report Reference characteristic descriptor, Feature
 static uint8_t hidReportRefFeature[HID_REPORT_REF_LEN] =
              { HID_RPT_ID_FEATURE, HID_REPORT_TYPE_FEATURE };
+#endif
 
 // HID Report Reference characteristic descriptor, consumer control input
 static uint8_t hidReportRefCCIn[HID_REPORT_REF_LEN] =
              { HID_RPT_ID_CC_IN, HID_REPORT_TYPE_INPUT };
 
+// HID Report Reference characteristic descriptor, NKRO keyboard input
+static uint8_t hidReportRefNkroIn[HID_REPORT_REF_LEN] =
+             { HID_RPT_ID_NKRO_IN, HID_REPORT_TYPE_INPUT };
+
 
 /*
  *  Heart Rate PROFILE ATTRIBUTES
@@ -273,7 +131,9 @@ static const uint16_t hid_report_uuid = ESP_GATT_UUID_HID_REPORT;
 static const uint16_t hid_proto_mode_uuid = ESP_GATT_UUID_HID_PROTO_MODE;
 static const uint16_t hid_kb_input_uuid = ESP_GATT_UUID_HID_BT_KB_INPUT;
 static const uint16_t hid_kb_output_uuid = ESP_GATT_UUID_HID_BT_KB_OUTPUT;
+#if (SUPPORT_REPORT_MOUSE == true)
 static const uint16_t hid_mouse_input_uuid = ESP_GATT_UUID_HID_BT_MOUSE_INPUT;
+#endif
 static const uint16_t hid_repot_map_ext_desc_uuid = ESP_GATT_UUID_EXT_RPT_REF_DESCR;
 static const uint16_t hid_report_ref_descr_uuid = ESP_GATT_UUID_RPT_REF_DESCR;
 ///the propoty definition
@@ -293,6 +153,8 @@ static const uint8_t   bat_lev_ccc[2] ={ 0x00, 0x00};
 static const uint16_t char_format_uuid = ESP_GATT_UUID_CHAR_PRESENT_FORMAT;
 
 static uint8_t battary_lev = 50;
+// Battery service handles, from the attribute table creation
+static uint16_t bas_handle_tbl[BAS_IDX_NB];
 /// Full HRS Database Description - Used to add attributes into the database
 static const esp_gatts_attr_db_t bas_att_db[BAS_IDX_NB] =
 {
@@ -382,6 +244,7 @@ static esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB] =
                                                                         sizeof(uint8_t), sizeof(hidProtocolMode),
                                                                         (uint8_t *)&hidProtocolMode}},
 
+#if (SUPPORT_REPORT_MOUSE == true)
     [HIDD_LE_IDX_REPORT_MOUSE_IN_CHAR]       = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid,
                                                                          ESP_GATT_PERM_READ,
                                                                          CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
@@ -401,6 +264,7 @@ static esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB] =
                                                                        ESP_GATT_PERM_READ,
                                                                        sizeof(hidReportRefMouseIn), sizeof(hidReportRefMouseIn),
                                                                        hidReportRefMouseIn}},
+#endif
     // Report Characteristic Declaration
     [HIDD_LE_IDX_REPORT_KEY_IN_CHAR]         = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid,
                                                                          ESP_GATT_PERM_READ,
@@ -472,6 +336,27 @@ static esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB] =
                                                                        sizeof(hidReportRefCCIn), sizeof(hidReportRefCCIn),
                                                                        hidReportRefCCIn}},
 
+    // Report Characteristic Declaration
+    [HIDD_LE_IDX_REPORT_NKRO_IN_CHAR]         = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid,
+                                                                         ESP_GATT_PERM_READ,
+                                                                         CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
+                                                                         (uint8_t *)&char_prop_read_notify}},
+    // Report Characteristic Value
+    [HIDD_LE_IDX_REPORT_NKRO_IN_VAL]            = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&hid_report_uuid,
+                                                                       ESP_GATT_PERM_READ,
+                                                                       HIDD_LE_REPORT_MAX_LEN, 0,
+                                                                       NULL}},
+    // Report NKRO INPUT Characteristic - Client Characteristic Configuration Descriptor
+    [HIDD_LE_IDX_REPORT_NKRO_IN_CCC]              = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid,
+                                                                      (ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE_ENCRYPTED),
+                                                                      sizeof(uint16_t), 0,
+                                                                      NULL}},
+     // Report Characteristic - Report Reference Descriptor
+    [HIDD_LE_IDX_REPORT_NKRO_IN_REP_REF]       = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&hid_report_ref_descr_uuid,
+                                                                       ESP_GATT_PERM_READ,
+                                                                       sizeof(hidReportRefNkroIn), sizeof(hidReportRefNkroIn),
+                                                                       hidReportRefNkroIn}},
+
     // Boot Keyboard Input Report Characteristic Declaration
     [HIDD_LE_IDX_BOOT_KB_IN_REPORT_CHAR] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid,
                                                                         ESP_GATT_PERM_READ,
@@ -499,6 +384,7 @@ static esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB] =
                                                                               HIDD_LE_BOOT_REPORT_MAX_LEN, 0,
                                                                               NULL}},
 
+#if (SUPPORT_REPORT_MOUSE == true)
     // Boot Mouse Input Report Characteristic Declaration
     [HIDD_LE_IDX_BOOT_MOUSE_IN_REPORT_CHAR] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid,
                                                                               ESP_GATT_PERM_READ,
@@ -514,7 +400,9 @@ static esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB] =
                                                                                       (ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE),
                                                                                       sizeof(uint16_t), 0,
                                                                                       NULL}},
+#endif
 
+#if (SUPPORT_REPORT_FEATURE == true)
     // Report Characteristic Declaration
     [HIDD_LE_IDX_REPORT_CHAR]                    = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid,
                                                                          ESP_GATT_PERM_READ,
@@ -530,10 +418,47 @@ static esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB] =
                                                                        ESP_GATT_PERM_READ,
                                                                        sizeof(hidReportRefFeature), sizeof(hidReportRefFeature),
                                                                        hidReportRefFeature}},
+#endif
 };
 
 static void hid_add_id_tbl(void);
 
+// FNV-1a, over everything a host caches: handles, types, permissions and static values
+static uint32_t hidd_db_hash_add(uint32_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hidd_db_hash_table(uint32_t hash, const esp_gatts_attr_db_t *db, const uint16_t *handles, int num)
+{
+    for (int i = 0; i < num; i++) {
+        const esp_attr_desc_t *desc = &db[i].att_desc;
+        hash = hidd_db_hash_add(hash, &handles[i], sizeof(handles[i]));
+        hash = hidd_db_hash_add(hash, desc->uuid_p, desc->uuid_length);
+        hash = hidd_db_hash_add(hash, &desc->perm, sizeof(desc->perm));
+        hash = hidd_db_hash_add(hash, &desc->max_length, sizeof(desc->max_length));
+        // the battery level is measured, hosts read it again on each connection
+        if (desc->value != NULL && desc->value != &battary_lev) {
+            hash = hidd_db_hash_add(hash, desc->value, desc->length);
+        }
+    }
+    return hash;
+}
+
+// HOGP: every connection starts in report protocol mode
+static void hidd_le_proto_mode_reset(void)
+{
+    hidProtocolMode = HID_PROTOCOL_MODE_REPORT;
+    if (hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_PROTO_MODE_VAL] != 0) {
+        esp_ble_gatts_set_attr_value(hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_PROTO_MODE_VAL],
+                                     sizeof(hidProtocolMode), &hidProtocolMode);
+    }
+}
+
 void esp_hidd_prf_cb_hdl(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
 									esp_ble_gatts_cb_param_t *param)
 {
@@ -560,6 +485,28 @@ void esp_hidd_prf_cb_hdl(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
             break;
         }
         case ESP_GATTS_CONF_EVT: {
+            // also raised for notifications, once handed to the controller
+            esp_hidd_cb_param_t cb_param = {0};
+            cb_param.report_sent.conn_id = param->conf.conn_id;
+            cb_param.report_sent.handle = param->conf.handle;
+            cb_param.report_sent.status = param->conf.status;
+            if(hidd_le_env.hidd_cb != NULL) {
+                (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_REPORT_SENT_EVT, &cb_param);
+            }
+            break;
+        }
+        case ESP_GATTS_CONGEST_EVT: {
+            esp_hidd_cb_param_t cb_param = {0};
+            for (int i = 0; i < HID_MAX_APPS; i++) {
+                if (hidd_le_env.hidd_clcb[i].in_use && hidd_le_env.hidd_clcb[i].conn_id == param->congest.conn_id) {
+                    hidd_le_env.hidd_clcb[i].congest = param->congest.congested;
+                }
+            }
+            cb_param.congest.conn_id = param->congest.conn_id;
+            cb_param.congest.congested = param->congest.congested;
+            if(hidd_le_env.hidd_cb != NULL) {
+                (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_CONGEST_EVT, &cb_param);
+            }
             break;
         }
         case ESP_GATTS_CREATE_EVT:
@@ -569,7 +516,9 @@ void esp_hidd_prf_cb_hdl(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
 			ESP_LOGI(HID_LE_PRF_TAG, "HID connection establish, conn_id = %x",param->connect.conn_id);
 			memcpy(cb_param.connect.remote_bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
             cb_param.connect.conn_id = param->connect.conn_id;
+            cb_param.connect.conn_params = param->connect.conn_params;
             hidd_clcb_alloc(param->connect.conn_id, param->connect.remote_bda);
+            hidd_le_proto_mode_reset();
             esp_ble_set_encryption(param->connect.remote_bda, ESP_BLE_SEC_ENCRYPT_NO_MITM);
             if(hidd_le_env.hidd_cb != NULL) {
                 (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_CONNECT, &cb_param);
@@ -581,12 +530,22 @@ void esp_hidd_prf_cb_hdl(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
                     (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_DISCONNECT, NULL);
              }
             hidd_clcb_dealloc(param->disconnect.conn_id);
+            hidd_le_proto_mode_reset();
             break;
         }
         case ESP_GATTS_CLOSE_EVT:
             break;
         case ESP_GATTS_WRITE_EVT: {
             esp_hidd_cb_param_t cb_param = {0};
+            // auto response: the stack took the value in its own copy, only 0 (boot) or 1 (report) is kept
+            if (param->write.handle == hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_PROTO_MODE_VAL]) {
+                if (param->write.len == 1 && param->write.value[0] <= HID_PROTOCOL_MODE_REPORT) {
+                    ESP_LOGI(HID_LE_PRF_TAG, "protocol mode %d", param->write.value[0]);
+                    hidProtocolMode = param->write.value[0];
+                } else {
+                    esp_ble_gatts_set_attr_value(param->write.handle, sizeof(hidProtocolMode), &hidProtocolMode);
+                }
+            }
             if (param->write.handle == hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_LED_OUT_VAL]) {
                 cb_param.led_write.conn_id = param->write.conn_id;
                 cb_param.led_write.report_id = HID_RPT_ID_LED_OUT;
@@ -604,14 +563,30 @@ void esp_hidd_prf_cb_hdl(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
                 (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT, &cb_param);
             }
 #endif
+            // client characteristic configuration of an input report
+            for (int i = 0; i < HID_NUM_REPORTS; i++) {
+                if (hid_rpt_map[i].cccdHandle == 0 || param->write.handle != hid_rpt_map[i].cccdHandle ||
+                    param->write.len < 2 || hidd_le_env.hidd_cb == NULL) {
+                    continue;
+                }
+                cb_param.cccd_write.conn_id = param->write.conn_id;
+                cb_param.cccd_write.report_id = hid_rpt_map[i].id;
+                cb_param.cccd_write.mode = hid_rpt_map[i].mode;
+                cb_param.cccd_write.notify = param->write.value[0] & 0x01;
+                (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_CCCD_WRITE_EVT, &cb_param);
+                break;
+            }
             break;
         }
         case ESP_GATTS_CREAT_ATTR_TAB_EVT: {
             if (param->add_attr_tab.num_handle == BAS_IDX_NB &&
                 param->add_attr_tab.svc_uuid.uuid.uuid16 == ESP_GATT_UUID_BATTERY_SERVICE_SVC &&
                 param->add_attr_tab.status == ESP_GATT_OK) {
+                memcpy(bas_handle_tbl, param->add_attr_tab.handles, BAS_IDX_NB * sizeof(uint16_t));
                 incl_svc.start_hdl = param->add_attr_tab.handles[BAS_IDX_SVC];
                 incl_svc.end_hdl = incl_svc.start_hdl + BAS_IDX_NB -1;
+                hidd_le_env.db_hash = hidd_db_hash_table(2166136261u, bas_att_db, param->add_attr_tab.handles,
+                                                         BAS_IDX_NB);
                 ESP_LOGI(HID_LE_PRF_TAG, "%s(), start added the hid service to the stack database. incl_handle = %d",
                            __func__, incl_svc.start_hdl);
                 esp_ble_gatts_create_attr_tab(hidd_le_gatt_db, gatts_if, HIDD_LE_IDX_NB, 0);
@@ -621,6 +596,9 @@ void esp_hidd_prf_cb_hdl(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
                 memcpy(hidd_le_env.hidd_inst.att_tbl, param->add_attr_tab.handles,
                             HIDD_LE_IDX_NB*sizeof(uint16_t));
                 ESP_LOGI(HID_LE_PRF_TAG, "hid svc handle = %x",hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_SVC]);
+                hidd_le_env.db_hash = hidd_db_hash_table(hidd_le_env.db_hash, hidd_le_gatt_db,
+                                                         param->add_attr_tab.handles, HIDD_LE_IDX_NB);
+                ESP_LOGI(HID_LE_PRF_TAG, "attribute table hash = %08lx", (unsigned long)hidd_le_env.db_hash);
                 hid_add_id_tbl();
 		        esp_ble_gatts_start_service(hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_SVC]);
             } else {
@@ -637,11 +615,41 @@ void esp_hidd_prf_cb_hdl(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
 void hidd_le_create_service(esp_gatt_if_t gatts_if)
 {
     /* Here should added the battery service first, because the hid service should include the battery service.
-       After finish to added the battery service then can added the hid service. */
+       After finish to added the battery service then can added the hid service.
+       Handles are allocated in creation order: with this fixed order they only move when a table changes,
+       which also changes db_hash. */
     esp_ble_gatts_create_attr_tab(bas_att_db, gatts_if, BAS_IDX_NB, 0);
 
 }
 
+esp_err_t hidd_le_set_battery_level(uint8_t level)
+{
+    uint16_t conn_id;
+    uint16_t len = 0;
+    const uint8_t *ccc = NULL;
+    esp_err_t ret;
+
+    if (level == battary_lev) {
+        return ESP_OK;
+    }
+    battary_lev = level;
+    if (bas_handle_tbl[BAS_IDX_BATT_LVL_VAL] == 0) {
+        // the table is not created yet, it starts with this value
+        return ESP_OK;
+    }
+    if ((ret = esp_ble_gatts_set_attr_value(bas_handle_tbl[BAS_IDX_BATT_LVL_VAL], sizeof(battary_lev), &battary_lev)) != ESP_OK) {
+        return ret;
+    }
+    // notified only to a connected host that turned notifications on, the others read it
+    if (!esp_hidd_get_conn_id(&conn_id) ||
+        esp_ble_gatts_get_attr_value(bas_handle_tbl[BAS_IDX_BATT_LVL_NTF_CFG], &len, &ccc) != ESP_GATT_OK ||
+        len < 2 || !(ccc[0] & 0x01)) {
+        return ESP_OK;
+    }
+    return esp_ble_gatts_send_indicate(hidd_le_env.gatt_if, conn_id, bas_handle_tbl[BAS_IDX_BATT_LVL_VAL],
+                                       sizeof(battary_lev), &battary_lev, false);
+}
+
 void hidd_le_init(void)
 {
 
@@ -727,7 +735,7 @@ void hidd_set_attr_value(uint16_t handle, uint16_t val_len, const uint8_t *value
 {
     hidd_inst_t *hidd_inst = &hidd_le_env.hidd_inst;
     if(hidd_inst->att_tbl[HIDD_LE_IDX_HID_INFO_VAL] <= handle &&
-        hidd_inst->att_tbl[HIDD_LE_IDX_REPORT_REP_REF] >= handle) {
+        hidd_inst->att_tbl[HIDD_LE_IDX_NB - 1] >= handle) {
         esp_ble_gatts_set_attr_value(handle, val_len, value);
     } else {
         ESP_LOGE(HID_LE_PRF_TAG, "%s error:Invalid handle value.",__func__);
@@ -739,7 +747,7 @@ void hidd_get_attr_value(uint16_t handle, uint16_t *length, uint8_t **value)
 {
     hidd_inst_t *hidd_inst = &hidd_le_env.hidd_inst;
     if(hidd_inst->att_tbl[HIDD_LE_IDX_HID_INFO_VAL] <= handle &&
-        hidd_inst->att_tbl[HIDD_LE_IDX_REPORT_REP_REF] >= handle){
+        hidd_inst->att_tbl[HIDD_LE_IDX_NB - 1] >= handle){
         esp_ble_gatts_get_attr_value(handle, length, (const uint8_t **)value);
     } else {
         ESP_LOGE(HID_LE_PRF_TAG, "%s error:Invalid handle value.", __func__);
@@ -748,68 +756,65 @@ void hidd_get_attr_value(uint16_t handle, uint16_t *length, uint8_t **value)
     return;
 }
 
+static uint8_t hid_add_rpt(uint8_t n, const uint8_t *ref, uint16_t handle, uint16_t cccdHandle, uint8_t mode)
+{
+      hid_rpt_map[n].id = ref[0];
+      hid_rpt_map[n].type = ref[1];
+      hid_rpt_map[n].handle = handle;
+      hid_rpt_map[n].cccdHandle = cccdHandle;
+      hid_rpt_map[n].mode = mode;
+      return n + 1;
+}
+
 static void hid_add_id_tbl(void)
 {
-     // Mouse input report
-      hid_rpt_map[0].id = hidReportRefMouseIn[0];
-      hid_rpt_map[0].type = hidReportRefMouseIn[1];
-      hid_rpt_map[0].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_MOUSE_IN_VAL];
-      hid_rpt_map[0].cccdHandle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_MOUSE_IN_VAL];
-      hid_rpt_map[0].mode = HID_PROTOCOL_MODE_REPORT;
+      const uint16_t *att_tbl = hidd_le_env.hidd_inst.att_tbl;
+      uint8_t n = 0;
+
+#if (SUPPORT_REPORT_MOUSE == true)
+      // Mouse input report
+      n = hid_add_rpt(n, hidReportRefMouseIn, att_tbl[HIDD_LE_IDX_REPORT_MOUSE_IN_VAL],
+                      att_tbl[HIDD_LE_IDX_REPORT_MOUSE_IN_CCC], HID_PROTOCOL_MODE_REPORT);
+#endif
 
       // Key input report
-      hid_rpt_map[1].id = hidReportRefKeyIn[0];
-      hid_rpt_map[1].type = hidReportRefKeyIn[1];
-      hid_rpt_map[1].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_KEY_IN_VAL];
-      hid_rpt_map[1].cccdHandle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_KEY_IN_CCC];
-      hid_rpt_map[1].mode = HID_PROTOCOL_MODE_REPORT;
+      n = hid_add_rpt(n, hidReportRefKeyIn, att_tbl[HIDD_LE_IDX_REPORT_KEY_IN_VAL],
+                      att_tbl[HIDD_LE_IDX_REPORT_KEY_IN_CCC], HID_PROTOCOL_MODE_REPORT);
 
       // Consumer Control input report
-      hid_rpt_map[2].id = hidReportRefCCIn[0];
-      hid_rpt_map[2].type = hidReportRefCCIn[1];
-      hid_rpt_map[2].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_CC_IN_VAL];
-      hid_rpt_map[2].cccdHandle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_CC_IN_CCC];
-      hid_rpt_map[2].mode = HID_PROTOCOL_MODE_REPORT;
+      n = hid_add_rpt(n, hidReportRefCCIn, att_tbl[HIDD_LE_IDX_REPORT_CC_IN_VAL],
+                      att_tbl[HIDD_LE_IDX_REPORT_CC_IN_CCC], HID_PROTOCOL_MODE_REPORT);
+
+      // NKRO keyboard input report, no boot counterpart
+      n = hid_add_rpt(n, hidReportRefNkroIn, att_tbl[HIDD_LE_IDX_REPORT_NKRO_IN_VAL],
+                      att_tbl[HIDD_LE_IDX_REPORT_NKRO_IN_CCC], HID_PROTOCOL_MODE_REPORT);
 
       // LED output report
-      hid_rpt_map[3].id = hidReportRefLedOut[0];
-      hid_rpt_map[3].type = hidReportRefLedOut[1];
-      hid_rpt_map[3].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_LED_OUT_VAL];
-      hid_rpt_map[3].cccdHandle = 0;
-      hid_rpt_map[3].mode = HID_PROTOCOL_MODE_REPORT;
+      n = hid_add_rpt(n, hidReportRefLedOut, att_tbl[HIDD_LE_IDX_REPORT_LED_OUT_VAL], 0, HID_PROTOCOL_MODE_REPORT);
 
       // Boot keyboard input report
       // Use same ID and type as key input report
-      hid_rpt_map[4].id = hidReportRefKeyIn[0];
-      hid_rpt_map[4].type = hidReportRefKeyIn[1];
-      hid_rpt_map[4].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_BOOT_KB_IN_REPORT_VAL];
-      hid_rpt_map[4].cccdHandle = 0;
-      hid_rpt_map[4].mode = HID_PROTOCOL_MODE_BOOT;
+      n = hid_add_rpt(n, hidReportRefKeyIn, att_tbl[HIDD_LE_IDX_BOOT_KB_IN_REPORT_VAL],
+                      att_tbl[HIDD_LE_IDX_BOOT_KB_IN_REPORT_NTF_CFG], HID_PROTOCOL_MODE_BOOT);
 
       // Boot keyboard output report
       // Use same ID and type as LED output report
-      hid_rpt_map[5].id = hidReportRefLedOut[0];
-      hid_rpt_map[5].type = hidReportRefLedOut[1];
-      hid_rpt_map[5].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_BOOT_KB_OUT_REPORT_VAL];
-      hid_rpt_map[5].cccdHandle = 0;
-      hid_rpt_map[5].mode = HID_PROTOCOL_MODE_BOOT;
+      n = hid_add_rpt(n, hidReportRefLedOut, att_tbl[HIDD_LE_IDX_BOOT_KB_OUT_REPORT_VAL], 0, HID_PROTOCOL_MODE_BOOT);
 
+#if (SUPPORT_REPORT_MOUSE == true)
       // Boot mouse input report
       // Use same ID and type as mouse input report
-      hid_rpt_map[6].id = hidReportRefMouseIn[0];
-      hid_rpt_map[6].type = hidReportRefMouseIn[1];
-      hid_rpt_map[6].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_BOOT_MOUSE_IN_REPORT_VAL];
-      hid_rpt_map[6].cccdHandle = 0;
-      hid_rpt_map[6].mode = HID_PROTOCOL_MODE_BOOT;
+      n = hid_add_rpt(n, hidReportRefMouseIn, att_tbl[HIDD_LE_IDX_BOOT_MOUSE_IN_REPORT_VAL],
+                      att_tbl[HIDD_LE_IDX_BOOT_MOUSE_IN_REPORT_NTF_CFG], HID_PROTOCOL_MODE_BOOT);
+#endif
 
+#if (SUPPORT_REPORT_FEATURE == true)
       // Feature report
-      hid_rpt_map[7].id = hidReportRefFeature[0];
-      hid_rpt_map[7].type = hidReportRefFeature[1];
-      hid_rpt_map[7].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_VAL];
-      hid_rpt_map[7].cccdHandle = 0;
-      hid_rpt_map[7].mode = HID_PROTOCOL_MODE_REPORT;
-
+      n = hid_add_rpt(n, hidReportRefFeature, att_tbl[HIDD_LE_IDX_REPORT_VAL], 0, HID_PROTOCOL_MODE_REPORT);
+#endif
 
+  ESP_LOGI(HID_LE_PRF_TAG, "%d attributes, %d reports, report map %d bytes", HIDD_LE_IDX_NB, n,
+           (int)sizeof(hidReportMap));
   // Setup report ID map
-  hid_dev_register_reports(HID_NUM_REPORTS, hid_rpt_map);
+  hid_dev_register_reports(n, hid_rpt_map);
 }
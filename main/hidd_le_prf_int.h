@@ -9,13 +9,18 @@
 #ifndef __HID_DEVICE_LE_PRF__
 #define __HID_DEVICE_LE_PRF__
 #include <stdbool.h>
-#include "esp_gatts_api.h"
-#include "esp_gatt_defs.h"
 #include "esp_hidd_prf_api.h"
+#if CONFIG_BT_BLUEDROID_ENABLED
+#include "esp_gatts_api.h"
 #include "esp_gap_ble_api.h"
+#endif
 #include "hid_dev.h"
 
+// Attributes and report map entries beyond the keyboard, LED, consumer and battery ones.
+// The keyboard never drives a mouse nor a feature report: hosts skip discovering and subscribing to them.
 #define SUPPORT_REPORT_VENDOR                 false
+#define SUPPORT_REPORT_MOUSE                  false
+#define SUPPORT_REPORT_FEATURE                false
 //HID BLE profile log tag
 #define HID_LE_PRF_TAG                        "HID_LE_PRF"
 
@@ -40,6 +45,7 @@
 #define HID_RPT_ID_KEY_IN        2   // Keyboard input report ID
 #define HID_RPT_ID_CC_IN         3   //Consumer Control input report ID
 #define HID_RPT_ID_VENDOR_OUT    4   // Vendor output report ID
+#define HID_RPT_ID_NKRO_IN       5   // NKRO keyboard input report ID
 #define HID_RPT_ID_LED_OUT       2  // LED output report ID
 #define HID_RPT_ID_FEATURE       0  // Feature report ID
 
@@ -120,11 +126,13 @@ enum {
     HIDD_LE_IDX_PROTO_MODE_CHAR,
     HIDD_LE_IDX_PROTO_MODE_VAL,
 
+#if (SUPPORT_REPORT_MOUSE == true)
     // Report mouse input
     HIDD_LE_IDX_REPORT_MOUSE_IN_CHAR,
     HIDD_LE_IDX_REPORT_MOUSE_IN_VAL,
     HIDD_LE_IDX_REPORT_MOUSE_IN_CCC,
     HIDD_LE_IDX_REPORT_MOUSE_REP_REF,
+#endif
     //Report Key input
     HIDD_LE_IDX_REPORT_KEY_IN_CHAR,
     HIDD_LE_IDX_REPORT_KEY_IN_VAL,
@@ -146,6 +154,12 @@ enum {
     HIDD_LE_IDX_REPORT_CC_IN_CCC,
     HIDD_LE_IDX_REPORT_CC_IN_REP_REF,
 
+    // Report NKRO keyboard input
+    HIDD_LE_IDX_REPORT_NKRO_IN_CHAR,
+    HIDD_LE_IDX_REPORT_NKRO_IN_VAL,
+    HIDD_LE_IDX_REPORT_NKRO_IN_CCC,
+    HIDD_LE_IDX_REPORT_NKRO_IN_REP_REF,
+
     // Boot Keyboard Input Report
     HIDD_LE_IDX_BOOT_KB_IN_REPORT_CHAR,
     HIDD_LE_IDX_BOOT_KB_IN_REPORT_VAL,
@@ -155,16 +169,20 @@ enum {
     HIDD_LE_IDX_BOOT_KB_OUT_REPORT_CHAR,
     HIDD_LE_IDX_BOOT_KB_OUT_REPORT_VAL,
 
+#if (SUPPORT_REPORT_MOUSE == true)
     // Boot Mouse Input Report
     HIDD_LE_IDX_BOOT_MOUSE_IN_REPORT_CHAR,
     HIDD_LE_IDX_BOOT_MOUSE_IN_REPORT_VAL,
     HIDD_LE_IDX_BOOT_MOUSE_IN_REPORT_NTF_CFG,
+#endif
 
+#if (SUPPORT_REPORT_FEATURE == true)
     // Report
     HIDD_LE_IDX_REPORT_CHAR,
     HIDD_LE_IDX_REPORT_VAL,
     HIDD_LE_IDX_REPORT_REP_REF,
     //HIDD_LE_IDX_REPORT_NTF_CFG,
+#endif
 
     HIDD_LE_IDX_NB,
 };
@@ -313,6 +331,7 @@ typedef struct {
     hidd_inst_t                  hidd_inst;
     esp_hidd_event_cb_t          hidd_cb;
     uint8_t                      inst_id;
+    uint32_t                     db_hash;                          /* attribute tables, final once the HID service is created */
 } hidd_le_env_t;
 
 extern hidd_le_env_t hidd_le_env;
@@ -325,6 +344,9 @@ bool hidd_clcb_dealloc (uint16_t conn_id);
 
 void hidd_le_create_service(esp_gatt_if_t gatts_if);
 
+/// Battery Level value, notified when it changes; 0..100
+esp_err_t hidd_le_set_battery_level(uint8_t level);
+
 void hidd_set_attr_value(uint16_t handle, uint16_t val_len, const uint8_t *value);
 
 void hidd_get_attr_value(uint16_t handle, uint16_t *length, uint8_t **value);
@@ -0,0 +1,166 @@
+/*
+ * Keyboard layout, runtime parameters and counters shared between the
+ * scanner (main.cc) and the configuration/diagnostic interfaces.
+ */
+
+#ifndef KB_CONFIG_H__
+#define KB_CONFIG_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KB_COLS 8
+#define KB_ROWS 17
+
+#define MAX_RAW_KEYS (KB_COLS * KB_ROWS)
+
+// USB HID instances (interface numbers) carrying the key reports
+#define KB_USB_KBD_ITF 0
+#define KB_USB_CC_ITF 1
+#define KB_USB_CC_REPORT_ID 2
+
+// Keymap layers, as addressed by the configuration protocol
+#define KB_LAYER_BASE 0
+#define KB_LAYER_FN 1
+#define KB_LAYER_COUNT 2
+
+// Live keymaps (RAM copies of the default ones, editable at runtime)
+extern uint8_t matrix[KB_COLS][KB_ROWS];
+extern uint8_t fnMatrix[KB_COLS][KB_ROWS];
+
+// Compiled-in keymaps, used at boot and by a keymap reset
+extern const uint8_t defaultMatrix[KB_COLS][KB_ROWS];
+extern const uint8_t defaultFnMatrix[KB_COLS][KB_ROWS];
+
+void kb_keymap_reset(void);
+
+/**
+ * Runtime tunable parameters. IDs are part of the configuration protocol,
+ * append new ones at the end.
+ */
+typedef enum {
+    KB_PARAM_SCAN_INTERVAL_MS = 0, // delay between two matrix scans, at least one FreeRTOS tick
+    KB_PARAM_SETTLE_US,            // delay between column select and row read
+    KB_PARAM_BUZZER_ENABLED,       // key click on press
+    KB_PARAM_TRANSPORT_MODE,       // transport_mode_t, where the reports go
+    KB_PARAM_BLE_IDLE_S,           // BLE idle parameters after this long without a report, 0 = never
+
+    KB_PARAM_COUNT
+} kb_param_id_t;
+
+typedef struct {
+    uint32_t min;
+    uint32_t max;
+    uint32_t def;
+} kb_param_limits_t;
+
+extern uint32_t kbParams[KB_PARAM_COUNT];
+extern const kb_param_limits_t kbParamLimits[KB_PARAM_COUNT];
+
+/**
+ * Diagnostic counters. IDs are part of the configuration protocol,
+ * append new ones at the end.
+ */
+typedef enum {
+    KB_COUNTER_SCANS = 0,       // completed matrix scans
+    KB_COUNTER_SCAN_LAST_US,    // duration of the last scan (gauge)
+    KB_COUNTER_SCAN_MAX_US,     // longest scan seen (gauge)
+    KB_COUNTER_KEY_PRESSES,     // key down edges
+    KB_COUNTER_GHOST_DROPS,     // keys dropped by the deghosting filter
+    KB_COUNTER_ROLLOVER_DROPS,  // key scans left out of the full 6 key report, no NKRO host to carry them
+    KB_COUNTER_USB_KBD_REPORTS, // keyboard reports queued to TinyUSB
+    KB_COUNTER_USB_CC_REPORTS,  // consumer reports queued to TinyUSB
+    KB_COUNTER_BLE_KBD_REPORTS, // keyboard reports handed to the BLE profile
+    KB_COUNTER_BLE_CC_REPORTS,  // consumer reports handed to the BLE profile
+    KB_COUNTER_TELEMETRY_BYTES, // bytes queued on the CDC telemetry port
+    KB_COUNTER_TELEMETRY_DROPS, // telemetry records lost to a full ring
+    KB_COUNTER_OTA_BYTES,       // firmware update: bytes received
+    KB_COUNTER_OTA_TIME_US,     // firmware update: time since begin (gauge)
+    KB_COUNTER_OTA_SCAN_GAP_MAX_US, // firmware update: longest gap between two scans (gauge)
+    KB_COUNTER_USB_DROPS,       // USB reports lost: queue full or refused by TinyUSB
+    KB_COUNTER_BLE_DROPS,       // BLE reports lost to a full queue
+    KB_COUNTER_TRANSPORT_SWITCHES, // changes of the transport(s) reports go to
+    KB_COUNTER_BLE_CONN_INTERVAL_US, // BLE connection interval, 0 when not connected (gauge)
+    KB_COUNTER_BLE_CONN_LATENCY,     // BLE peripheral latency, in connection events (gauge)
+    KB_COUNTER_BLE_CONN_UPDATES,     // BLE connection parameter changes
+    KB_COUNTER_BLE_CONN_REJECTS,     // BLE parameter requests rejected or unanswered
+    KB_COUNTER_BLE_FAST_MS,          // time connected without peripheral latency
+    KB_COUNTER_BLE_IDLE_MS,          // time connected with peripheral latency
+    KB_COUNTER_BLE_IDLE_ENTRIES,     // switches to the idle parameters
+    KB_COUNTER_BLE_NOTIFY_QUEUED,    // reports queued for BLE
+    KB_COUNTER_BLE_NOTIFY_COALESCED, // BLE reports merged into a later one, no transition lost
+    KB_COUNTER_BLE_NOTIFY_FAILED,    // notifications refused by the stack or not sent
+    KB_COUNTER_BLE_CONGESTIONS,      // BLE stack congestion events
+    KB_COUNTER_BLE_READY_US,         // BLE connection to keyboard notifications deliverable, last link (gauge)
+    KB_COUNTER_BLE_BOOT_READY_US,    // application start to the first deliverable BLE keypress (gauge)
+    KB_COUNTER_BLE_HOST_SLOT,        // active BLE host slot, from 0 (gauge)
+    KB_COUNTER_BLE_HOST_SWITCHES,    // BLE host slot changes
+    KB_COUNTER_BLE_HOST_SWITCH_US,   // BLE host switch to the new host able to receive keypresses, last one (gauge)
+    KB_COUNTER_BLE_PHY,              // BLE transmit PHY: 1 (1M) or 2 (2M, NimBLE builds), 0 when not connected (gauge)
+    KB_COUNTER_BLE_TX_OCTETS,        // BLE link layer payload per packet, 0 when not connected (gauge)
+    KB_COUNTER_BLE_NOTIFY_AIRTIME_US, // on-air time of the last BLE notification (gauge)
+    KB_COUNTER_BLE_INIT_US,          // BLE stack init to the first advertising (gauge, once per boot)
+    KB_COUNTER_BLE_INIT_HEAP,        // internal heap taken by the BLE stack by then, in bytes (gauge)
+    KB_COUNTER_BLE_ADV_MS,           // time spent advertising
+    KB_COUNTER_BLE_RECONNECT_MS,     // disconnection (or boot) to the next connection (gauge)
+    KB_COUNTER_BLE_ADV_TIMEOUTS,     // advertising schedules that ran out without a connection
+    KB_COUNTER_BLE_ADV_WAKES,        // keypresses that brought fast advertising back
+    KB_COUNTER_BLE_RSSI_NEG,         // averaged connection RSSI, in -dBm (gauge)
+    KB_COUNTER_BLE_TX_ATTEN_DB,      // BLE TX power below the default level, in dB (gauge)
+    KB_COUNTER_BLE_TX_ATTEN_DB_S,    // TX attenuation integrated over the connected time, in dB.s
+    KB_COUNTER_BLE_TX_POWER_DOWNS,   // TX power steps down, comfortable link margin
+    KB_COUNTER_BLE_TX_POWER_UPS,     // TX power steps up, weak RSSI or lost notifications
+    KB_COUNTER_BATTERY_MV,           // last battery sample, in mV, 0 on ADC error (gauge)
+    KB_COUNTER_BATTERY_PERCENT,      // battery level given to the Battery Service (gauge)
+    KB_COUNTER_BATTERY_LEVEL_UPDATES, // battery level changes, each one notified to a subscribed host
+    // boot milestones: since the esp_timer start in the application startup, bootloader not included
+    KB_COUNTER_BOOT_FIRST_SCAN_US,   // to the end of the first matrix scan (gauge)
+    KB_COUNTER_BOOT_USB_MOUNT_US,    // to the USB configuration by the host (gauge)
+    KB_COUNTER_BOOT_BLE_ADV_US,      // to the first BLE advertising (gauge)
+    KB_COUNTER_BOOT_APP_MAIN_US,     // to app_main(): the rest of the startup code (gauge)
+    KB_COUNTER_BLE_NKRO_REPORTS,     // BLE keyboard reports sent as the NKRO bitmap, among ble_kbd_reports
+    // BLE latency: key edge (matrix read) to notification sent (handed to the controller)
+    KB_COUNTER_BLE_LAT_LT_1MS,       // key edges sent within 1 ms
+    KB_COUNTER_BLE_LAT_LT_2MS,       // 1 to 2 ms
+    KB_COUNTER_BLE_LAT_LT_4MS,       // 2 to 4 ms
+    KB_COUNTER_BLE_LAT_LT_8MS,       // 4 to 8 ms
+    KB_COUNTER_BLE_LAT_LT_16MS,      // 8 to 16 ms
+    KB_COUNTER_BLE_LAT_LT_32MS,      // 16 to 32 ms
+    KB_COUNTER_BLE_LAT_LT_64MS,      // 32 to 64 ms
+    KB_COUNTER_BLE_LAT_GE_64MS,      // 64 ms and more
+    KB_COUNTER_BLE_LAT_LAST_US,      // last key edge to sent (gauge)
+    KB_COUNTER_BLE_LAT_QUEUE_MAX_US, // longest key edge to submission to the stack (gauge)
+    KB_COUNTER_BLE_LAT_STACK_MAX_US, // longest submission to sent (gauge)
+    KB_COUNTER_BLE_LAT_INTERVAL_US,  // connection interval of the last sample (gauge)
+    KB_COUNTER_BLE_HOST_REJECTS,     // bonded hosts of another slot disconnected while the active slot is empty
+
+    KB_COUNTER_COUNT
+} kb_counter_id_t;
+
+extern uint32_t kbCounters[KB_COUNTER_COUNT];
+
+// Counters are bumped from several tasks (scan, TinyUSB, BT), keep it atomic
+static inline void kb_counter_add(kb_counter_id_t id, uint32_t n)
+{
+    __atomic_fetch_add(&kbCounters[id], n, __ATOMIC_RELAXED);
+}
+
+static inline void kb_counter_set(kb_counter_id_t id, uint32_t v)
+{
+    __atomic_store_n(&kbCounters[id], v, __ATOMIC_RELAXED);
+}
+
+static inline void kb_counter_max(kb_counter_id_t id, uint32_t v)
+{
+    if (v > __atomic_load_n(&kbCounters[id], __ATOMIC_RELAXED))
+        __atomic_store_n(&kbCounters[id], v, __ATOMIC_RELAXED);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KB_CONFIG_H__ */
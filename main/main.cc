@@ -7,28 +7,41 @@
 #include "tinyusb.h"
 #include "class/hid/hid_device.h"
 #include "driver/gpio.h"
+#if CONFIG_KB_BUZZER
 #include "driver/ledc.h"
-#include <vector>
-#include <string>
+#endif
 // #include "esp_task_wdt.h"
 // #include <idf_additions.h>
 
+#if CONFIG_KB_BLE
 #include "nvs_flash.h"
 #include "esp_bt.h"
+#if CONFIG_BT_NIMBLE_ENABLED
+#include "nimble/nimble_port.h"
+#else
 #include "esp_bt_main.h"
 #include "esp_bt_device.h"
 #include "esp_gap_ble_api.h"
+#include "esp_gatts_api.h"
+#endif
 #include "esp_hidd_prf_api.h"
+#endif
 #include "hid_dev.h"
 #include <stdio.h>
 #include <string.h>
-#include "freertos/event_groups.h"
 #include "esp_system.h"
-#include "esp_wifi.h"
-#include "esp_event.h"
-#include "esp_bt_defs.h"
-#include "esp_gatts_api.h"
-#include "esp_gatt_defs.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "kb_config.h"
+#include "rawhid.h"
+#include "telemetry.h"
+#include "ota_update.h"
+#include "bench.h"
+#include "transport.h"
+#include "ble_conn.h"
+#include "battery.h"
+#include "ble_adv.h"
 
 #define BUZZER_GPIO 2
 #define BUZZER_CHANNEL LEDC_CHANNEL_0
@@ -38,20 +51,16 @@
 #define NUMBER_OF_SIMULT_KEYS 6
 static const char *TAG = "DBG";
 
-#define print_bits(x)                                    \
-    do                                                   \
-    {                                                    \
-        unsigned long long a__ = (x);                    \
-        size_t bits__ = sizeof(x) * 8;                   \
-        printf(#x ": ");                                 \
-        while (bits__--)                                 \
-            putchar(a__ & (1ULL << bits__) ? '1' : '0'); \
-        putchar('\n');                                   \
-    } while (0)
-
 /************* TinyUSB descriptors ****************/
 
-#define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + CFG_TUD_HID * TUD_HID_DESC_LEN)
+// 2 HID IN-only interfaces (keyboard, consumer) + the raw HID IN/OUT one + CDC telemetry (2 interfaces)
+#if CONFIG_KB_TELEMETRY
+#define TUSB_ITF_COUNT 5
+#define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + 2 * TUD_HID_DESC_LEN + TUD_HID_INOUT_DESC_LEN + TUD_CDC_DESC_LEN)
+#else
+#define TUSB_ITF_COUNT 3
+#define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + 2 * TUD_HID_DESC_LEN + TUD_HID_INOUT_DESC_LEN)
+#endif
 
 static uint8_t const hid_report_descriptor[] = {
     TUD_HID_REPORT_DESC_KEYBOARD(),
@@ -63,22 +72,25 @@ static uint8_t const hid_consumer_report_descriptor[] = {
     //   TUD_HID_REPORT_DESC_KEYBOARD(),
     //   TUD_HID_REPORT_DESC_CONSUMER(HID_REPORT_ID(2))
     // TUD_HID_REPORT_DESC_CONSUMER()
-    TUD_HID_REPORT_DESC_CONSUMER(HID_REPORT_ID(2))
+    TUD_HID_REPORT_DESC_CONSUMER(HID_REPORT_ID(KB_USB_CC_REPORT_ID))
 
 };
 
-#define CONSUMER_REPORT_ID 2
+static uint8_t const hid_rawhid_report_descriptor[] = {
+    TUD_HID_REPORT_DESC_GENERIC_INOUT(RAWHID_REPORT_LEN)};
 
 /**
  * @brief String descriptor
  */
-const char *hid_string_descriptor[5] = {
+const char *hid_string_descriptor[7] = {
     (char[]){4, TUSB_DESC_STRING, 0x0c, 0x04},
     // (char[]){0x0c, 0x04}, // 0: is supported language is French, for English (0x0409)
     "MagicTINTIN",     // 1: Manufacturer
     "ChrisT1 Clavier", // 2: Product
     "123456",          // 3: Serials, should use chip ID
     "CT1 Keyboard",    // 4: HID
+    "CT1 Config",      // 5: raw HID (configuration & telemetry)
+    "CT1 Telemetry",   // 6: CDC binary telemetry
 };
 
 /**
@@ -88,7 +100,7 @@ const char *hid_string_descriptor[5] = {
  */
 static const uint8_t hid_configuration_descriptor[] = {
     // Configuration number, interface count, string index, total length, attribute, power in mA
-    TUD_CONFIG_DESCRIPTOR(1, 2, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
+    TUD_CONFIG_DESCRIPTOR(1, TUSB_ITF_COUNT, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
 
     // Interface number, string index, boot protocol, report descriptor len, EP In address, size & polling interval
     // FIXME: booot protocol ?
@@ -99,6 +111,14 @@ static const uint8_t hid_configuration_descriptor[] = {
     // TUD_HID_DESCRIPTOR(1, 0, false, sizeof(hid_consumer_report_descriptor), 0x82, 16, 10),
     TUD_HID_DESCRIPTOR(1, 4, false, sizeof(hid_consumer_report_descriptor), 0x82, 16, 10),
     // TUD_HID_DESCRIPTOR(1, 0, false, sizeof(hid_consumer_report_descriptor), 0x82, CFG_TUD_HID_EP_BUFSIZE, 10),
+
+    // Interface number, string index, boot protocol, report descriptor len, EP Out & In address, size & polling interval
+    TUD_HID_INOUT_DESCRIPTOR(RAWHID_ITF, 5, false, sizeof(hid_rawhid_report_descriptor), 0x03, 0x83, RAWHID_REPORT_LEN, 1),
+
+#if CONFIG_KB_TELEMETRY
+    // Interface number, string index, EP notification address & size, EP data Out & In address, size
+    TUD_CDC_DESCRIPTOR(TELEMETRY_ITF, 6, 0x84, 8, 0x05, 0x85, 64),
+#endif
 };
 
 /********* TinyUSB HID callbacks ***************/
@@ -122,6 +142,10 @@ uint8_t const *tud_hid_descriptor_report_cb(uint8_t instance)
     {
         return hid_consumer_report_descriptor;
     }
+    else if (instance == RAWHID_ITF)
+    {
+        return hid_rawhid_report_descriptor;
+    }
     else
     {
         return hid_report_descriptor;
@@ -143,6 +167,15 @@ uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_t
     return 0;
 }
 
+// Invoked when a report was delivered to the host
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report, uint16_t len)
+{
+    (void)report;
+    (void)len;
+    transport_usb_report_complete(instance);
+    bench_usb_report_complete(instance);
+}
+
 // Invoked when received SET_REPORT control request or
 // received data on OUT endpoint ( Report ID = 0, Type = 0 )
 // void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const *buffer, uint16_t bufsize)
@@ -151,11 +184,37 @@ uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_t
 
 #define HIDD_DEVICE_NAME "ChrisT1 Clavier"
 #define HID_DEMO_TAG "BNTM" // TODO: remove
+
+#define GPIO_CAPS_LED GPIO_NUM_21
+
+// Milestones count from the esp_timer start, early in the application
+// startup: the ROM and the second stage bootloader are not included.
+static void boot_milestone(kb_counter_id_t id, const char *what)
+{
+    uint32_t us = (uint32_t)esp_timer_get_time();
+    kb_counter_set(id, us);
+    ESP_LOGI(HID_DEMO_TAG, "boot: %s at %lu.%03lu ms", what, (unsigned long)(us / 1000), (unsigned long)(us % 1000));
+}
+
+#if CONFIG_KB_BLE
+#if CONFIG_BT_NIMBLE_ENABLED
+#define BLE_HOST_NAME "NimBLE"
+#else
+#define BLE_HOST_NAME "Bluedroid"
+#endif
 static uint16_t hid_conn_id = 0;
 static bool sec_conn = false;
 
-#define GPIO_CAPS_LED GPIO_NUM_21
+// BLE stack cost, from the start of ble_init() to the first advertising
+static int64_t bleInitStartUs = 0;
+static size_t bleInitFreeHeap = 0;
+
+// BLE comes up in the background once the scanner runs, USB typing does not wait for it
+#define BLE_INIT_STACK_SIZE 4096
+static StaticTask_t bleInitTaskTCB;
+static StackType_t bleInitTaskStack[BLE_INIT_STACK_SIZE];
 
+#if CONFIG_BT_BLUEDROID_ENABLED
 static uint8_t hidd_service_uuid128[] = {
     /* LSB <--------------------------------------------------------------------------------> MSB */
     // first uuid, 16bit, [12],[13] is the value
@@ -192,17 +251,24 @@ static esp_ble_adv_data_t hidd_adv_data = {
     .p_service_uuid = hidd_service_uuid128,
     .flag = 0x6,
 };
+#endif
 
-static esp_ble_adv_params_t hidd_adv_params = {
-    .adv_int_min = 0x20,
-    .adv_int_max = 0x30,
-    .adv_type = ADV_TYPE_IND,
-    .own_addr_type = BLE_ADDR_TYPE_PUBLIC,
-    //.peer_addr            =
-    //.peer_addr_type       =
-    .channel_map = ADV_CHNL_ALL,
-    .adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
-};
+static void ble_advertising_started(bool ok)
+{
+    if (!ok || bleInitStartUs == 0)
+        return;
+
+    // internal heap only: the stacks allocate there, other tasks barely do during init
+    size_t freeHeap = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    uint32_t heap = bleInitFreeHeap > freeHeap ? (uint32_t)(bleInitFreeHeap - freeHeap) : 0;
+    uint32_t us = (uint32_t)(esp_timer_get_time() - bleInitStartUs);
+    bleInitStartUs = 0;
+    kb_counter_set(KB_COUNTER_BLE_INIT_US, us);
+    kb_counter_set(KB_COUNTER_BLE_INIT_HEAP, heap);
+    ESP_LOGI(HID_DEMO_TAG, "%s: advertising %lu ms after init, %lu bytes of internal heap",
+             BLE_HOST_NAME, (unsigned long)(us / 1000), (unsigned long)heap);
+    boot_milestone(KB_COUNTER_BOOT_BLE_ADV_US, "BLE advertising");
+}
 
 static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *param)
 {
@@ -212,9 +278,13 @@ static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *
     {
         if (param->init_finish.state == ESP_HIDD_INIT_OK)
         {
+#if CONFIG_BT_NIMBLE_ENABLED
+            esp_hidd_start_advertising(HIDD_DEVICE_NAME);
+#else
             // esp_bd_addr_t rand_addr = {0x04,0x11,0x11,0x11,0x11,0x05};
             esp_ble_gap_set_device_name(HIDD_DEVICE_NAME);
             esp_ble_gap_config_adv_data(&hidd_adv_data);
+#endif
         }
         break;
     }
@@ -228,13 +298,19 @@ static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *
     {
         ESP_LOGI(HID_DEMO_TAG, "ESP_HIDD_EVENT_BLE_CONNECT");
         hid_conn_id = param->connect.conn_id;
+        transport_ble_link(true, false, hid_conn_id);
+        ble_adv_connected(param->connect.remote_bda);
+        ble_conn_connected(param->connect.remote_bda, param->connect.conn_params.interval,
+                           param->connect.conn_params.latency, param->connect.conn_params.timeout);
         break;
     }
     case ESP_HIDD_EVENT_BLE_DISCONNECT:
     {
         sec_conn = false;
+        transport_ble_link(false, false, 0);
+        ble_conn_disconnected();
         ESP_LOGI(HID_DEMO_TAG, "ESP_HIDD_EVENT_BLE_DISCONNECT");
-        esp_ble_gap_start_advertising(&hidd_adv_params);
+        ble_adv_start();
         break;
     }
     case ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT:
@@ -255,18 +331,66 @@ static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *
         gpio_set_level(GPIO_CAPS_LED, caps_on);
         break;
     }
+    case ESP_HIDD_EVENT_BLE_REPORT_SENT_EVT:
+    {
+        transport_ble_report_sent(param->report_sent.handle, param->report_sent.status == ESP_GATT_OK);
+        bench_ble_report_sent(param->report_sent.status == ESP_GATT_OK);
+        break;
+    }
+    case ESP_HIDD_EVENT_BLE_CONGEST_EVT:
+    {
+        transport_ble_congested(param->congest.congested);
+        break;
+    }
+    case ESP_HIDD_EVENT_BLE_CCCD_WRITE_EVT:
+    {
+        ESP_LOGI(HID_DEMO_TAG, "report %d (mode %d) notifications %s", param->cccd_write.report_id,
+                 param->cccd_write.mode, param->cccd_write.notify ? "on" : "off");
+        transport_ble_cccd(param->cccd_write.report_id, param->cccd_write.mode, param->cccd_write.notify);
+        break;
+    }
+    // From the NimBLE profile, Bluedroid has them in gap_event_handler()
+    case ESP_HIDD_EVENT_BLE_ADV_START_EVT:
+        ble_advertising_started(param->adv_start.ok);
+        break;
+    case ESP_HIDD_EVENT_BLE_AUTH_CMPL_EVT:
+        sec_conn = param->auth_cmpl.success;
+        if (sec_conn)
+            transport_ble_peer(param->auth_cmpl.remote_bda);
+        transport_ble_link(true, sec_conn, hid_conn_id);
+        ESP_LOGI(HID_DEMO_TAG, "pair status = %s", sec_conn ? "success" : "fail");
+        break;
+    case ESP_HIDD_EVENT_BLE_CONN_UPDATE_EVT:
+        ble_conn_params_updated(param->conn_update.ok, param->conn_update.conn_params.interval,
+                                param->conn_update.conn_params.latency, param->conn_update.conn_params.timeout);
+        break;
+    case ESP_HIDD_EVENT_BLE_DATA_LEN_EVT:
+        ble_conn_data_len_updated(param->data_len.ok, param->data_len.tx_octets);
+        break;
+    case ESP_HIDD_EVENT_BLE_PHY_UPDATE_EVT:
+        ble_conn_phy_updated(param->phy_update.ok, param->phy_update.tx_phy);
+        break;
     default:
         break;
     }
     return;
 }
 
+#if CONFIG_BT_BLUEDROID_ENABLED
 static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
 {
     switch (event)
     {
     case ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT:
-        esp_ble_gap_start_advertising(&hidd_adv_params);
+        ble_adv_start();
+        break;
+    case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
+        if (param->adv_start_cmpl.status != ESP_BT_STATUS_SUCCESS)
+            ESP_LOGE(HID_DEMO_TAG, "advertising start failed, status %d", param->adv_start_cmpl.status);
+        ble_advertising_started(param->adv_start_cmpl.status == ESP_BT_STATUS_SUCCESS);
+        break;
+    case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
+        ble_adv_stopped();
         break;
     case ESP_GAP_BLE_SEC_REQ_EVT:
         for (int i = 0; i < ESP_BD_ADDR_LEN; i++)
@@ -276,7 +400,14 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
         esp_ble_gap_security_rsp(param->ble_security.ble_req.bd_addr, true);
         break;
     case ESP_GAP_BLE_AUTH_CMPL_EVT:
-        sec_conn = true;
+        sec_conn = param->ble_security.auth_cmpl.success;
+        if (sec_conn)
+        {
+            transport_ble_peer(param->ble_security.auth_cmpl.bd_addr);
+            ble_adv_bonded(param->ble_security.auth_cmpl.bd_addr, param->ble_security.auth_cmpl.addr_type);
+            esp_hidd_check_db_cache(param->ble_security.auth_cmpl.bd_addr);
+        }
+        transport_ble_link(true, sec_conn, hid_conn_id);
         esp_bd_addr_t bd_addr;
         memcpy(bd_addr, param->ble_security.auth_cmpl.bd_addr, sizeof(esp_bd_addr_t));
         ESP_LOGI(HID_DEMO_TAG, "remote BD_ADDR: %08x%04x",
@@ -289,10 +420,32 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
             ESP_LOGE(HID_DEMO_TAG, "fail reason = 0x%x", param->ble_security.auth_cmpl.fail_reason);
         }
         break;
+    case ESP_GAP_BLE_REMOVE_BOND_DEV_COMPLETE_EVT:
+        // Fn+0 or the stack: what was kept for the host goes with its bond
+        if (param->remove_bond_dev_cmpl.status == ESP_BT_STATUS_SUCCESS)
+        {
+            transport_ble_forget(param->remove_bond_dev_cmpl.bd_addr);
+            esp_hidd_forget_host(param->remove_bond_dev_cmpl.bd_addr);
+        }
+        break;
+    case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+        ble_conn_params_updated(param->update_conn_params.status == ESP_BT_STATUS_SUCCESS,
+                                param->update_conn_params.conn_int, param->update_conn_params.latency,
+                                param->update_conn_params.timeout);
+        break;
+    case ESP_GAP_BLE_READ_RSSI_COMPLETE_EVT:
+        ble_conn_rssi(param->read_rssi_cmpl.status == ESP_BT_STATUS_SUCCESS, param->read_rssi_cmpl.rssi);
+        break;
+    case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
+        ble_conn_data_len_updated(param->pkt_data_length_cmpl.status == ESP_BT_STATUS_SUCCESS,
+                                  param->pkt_data_length_cmpl.params.tx_len);
+        break;
     default:
         break;
     }
 }
+#endif
+#endif // CONFIG_KB_BLE
 
 void tud_hid_set_report_cb(uint8_t instance,
                            uint8_t report_id,
@@ -300,6 +453,12 @@ void tud_hid_set_report_cb(uint8_t instance,
                            const uint8_t *buffer,
                            uint16_t bufsize)
 {
+    if (instance == RAWHID_ITF)
+    {
+        // OUT endpoint data (report id 0, invalid type) or SET_REPORT
+        rawhid_receive(buffer, bufsize);
+        return;
+    }
     if (instance != 0)
         return; // keyboard is interface 0
     if (report_type != HID_REPORT_TYPE_OUTPUT)
@@ -315,6 +474,7 @@ void tud_hid_set_report_cb(uint8_t instance,
     gpio_set_level(GPIO_CAPS_LED, caps_on);
 }
 
+#if CONFIG_KB_BUZZER
 void buzzer_init()
 {
     // ledc_timer_config_t ledc_timer = {
@@ -434,11 +594,19 @@ void buzzer_off()
 {
     buzzer_running = false;
 }
+#else
+static void start_buzzer_task() {}
+static void buzzer_off() {}
+#endif
 /********* Application ***************/
 
 #define M_HID_UNDEF 0x0
 #define M_HIDMKY_FN_LOCK 0x1
 #define M_HIDMK_BACKLIGHT 0x2
+#define M_HIDMKY_BLE_HOST_1 0x3
+#define M_HIDMKY_BLE_HOST_2 0x4
+#define M_HIDMKY_BLE_HOST_3 0x5
+#define M_HIDMKY_BLE_PAIR 0x6
 #define M_HIDMK_MORSE 0x20
 #define M_HIDMK_HEXA 0x21
 #define M_HIDMK_BIN 0x22
@@ -455,22 +623,17 @@ void buzzer_off()
 #define M_HIDKEY_APPLICATION 0x64
 #define M_HIDKEY_SCROLLLOCK 0x65
 
-#define KB_COLS 8
-#define KB_ROWS 17
-
-#define MAX_RAW_KEYS (KB_COLS * KB_ROWS)
-
-const uint8_t fnMatrix[KB_COLS][KB_ROWS] = {
+const uint8_t defaultFnMatrix[KB_COLS][KB_ROWS] = {
     {0, 0, M_HIDUC_SCAN_PREVIOUS, M_HIDMKY_FN_LOCK, 0, 0, 0, 0, 0, 0, 0, 0, M_HIDUC_PLAY_PAUSE, 0, 0, M_HIDUC_SCAN_NEXT, 0},
     {0, 0, M_HIDKEY_VOLUME_UP, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
     {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
     {0, M_HIDKEY_MUTE, M_HIDKEY_VOLUME_DOWN, 0, 0, 0, 0, 0, 0, 0, M_HIDKEY_SCROLLLOCK, 0, M_HIDKEY_FIND, 0, 0, 0, 0},
     {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, M_HIDMK_MORSE, 0, 0, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, M_HIDUC_BRIGHTNESS_INCREMENT, M_HIDUC_BRIGHTNESS_DECREMENT, M_HIDMK_BACKLIGHT, 0, 0, 0, 0},
+    {0, M_HIDMKY_BLE_HOST_2, M_HIDMKY_BLE_HOST_3, M_HIDMKY_BLE_HOST_1, 0, 0, 0, 0, 0, 0, M_HIDUC_BRIGHTNESS_INCREMENT, M_HIDUC_BRIGHTNESS_DECREMENT, M_HIDMK_BACKLIGHT, M_HIDMKY_BLE_PAIR, 0, 0, 0},
     {0, M_HIDMK_HEXA, M_HIDUC_AL_CALCULATOR, 0, 0, 0, 0, M_HIDKEY_APPLICATION, 0, 0, 0, 0, 0, 0, 0, 0, 0},
     {M_HIDMK_BIN, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}};
 
-const uint8_t matrix[KB_COLS][KB_ROWS] = {
+const uint8_t defaultMatrix[KB_COLS][KB_ROWS] = {
     {HID_KEY_G, HID_KEY_EUROPE_2, HID_KEY_F4, HID_KEY_ESCAPE, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_ALT_LEFT, HID_KEY_ARROW_UP, HID_KEY_KEYPAD_1, HID_KEY_KEYPAD_0, HID_KEY_F5, HID_KEY_APOSTROPHE, HID_KEY_NONE, HID_KEY_F6, HID_KEY_H},
     {HID_KEY_T, HID_KEY_CAPS_LOCK, HID_KEY_F3, HID_KEY_TAB, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_SHIFT_LEFT, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_KEYPAD_DECIMAL, HID_KEY_KEYPAD_DIVIDE, HID_KEY_KEYPAD_ADD, HID_KEY_BACKSPACE, HID_KEY_BRACKET_LEFT, HID_KEY_F7, HID_KEY_BRACKET_RIGHT, HID_KEY_Y},
     {HID_KEY_R, HID_KEY_W, HID_KEY_E, HID_KEY_Q, HID_KEY_PAGE_UP, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_NUM_LOCK, HID_KEY_NONE, HID_KEY_KEYPAD_4, HID_KEY_KEYPAD_3, HID_KEY_NONE, HID_KEY_P, HID_KEY_O, HID_KEY_I, HID_KEY_U},
@@ -480,9 +643,35 @@ const uint8_t matrix[KB_COLS][KB_ROWS] = {
     {HID_KEY_V, HID_KEY_X, HID_KEY_C, HID_KEY_Z, HID_KEY_KEYPAD_MULTIPLY, HID_KEY_NONE, HID_KEY_SHIFT_RIGHT, HID_KEY_CONTROL_RIGHT, HID_KEY_NONE, HID_KEY_KEYPAD_SUBTRACT, HID_KEY_KEYPAD_5, HID_KEY_KEYPAD_6, HID_KEY_ENTER, HID_KEY_BACKSLASH, HID_KEY_PERIOD, HID_KEY_COMMA, HID_KEY_M},
     {HID_KEY_B, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_KEYPAD_2, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_ALT_RIGHT, HID_KEY_ARROW_LEFT, HID_KEY_ARROW_RIGHT, HID_KEY_ARROW_DOWN, HID_KEY_SPACE, HID_KEY_SLASH, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_N}};
 
+// Live keymaps, can be rewritten from the raw HID interface
+uint8_t fnMatrix[KB_COLS][KB_ROWS];
+uint8_t matrix[KB_COLS][KB_ROWS];
+
+void kb_keymap_reset()
+{
+    memcpy(matrix, defaultMatrix, sizeof(matrix));
+    memcpy(fnMatrix, defaultFnMatrix, sizeof(fnMatrix));
+}
+
+// {min, max, default}, in kb_param_id_t order
+const kb_param_limits_t kbParamLimits[KB_PARAM_COUNT] = {
+    // below a tick vTaskDelay(0) would spin the scan loop and starve IDLE
+    {portTICK_PERIOD_MS, 100, 10}, // KB_PARAM_SCAN_INTERVAL_MS
+    {1, 500, 10}, // KB_PARAM_SETTLE_US
+    {0, 1, 1},    // KB_PARAM_BUZZER_ENABLED
+    {TRANSPORT_MODE_AUTO, TRANSPORT_MODE_COUNT - 1, TRANSPORT_MODE_AUTO}, // KB_PARAM_TRANSPORT_MODE
+    {0, 3600, 30}, // KB_PARAM_BLE_IDLE_S
+};
+
+uint32_t kbParams[KB_PARAM_COUNT];
+uint32_t kbCounters[KB_COUNTER_COUNT] = {0};
+
 bool fnPressed = false;
 bool fnNewPressed = false;
 bool fnLocked = false;
+// BLE host key held in this scan and in the previous one, acted upon once per press
+uint8_t hostKeyNew = M_HID_UNDEF;
+uint8_t hostKeyHeld = M_HID_UNDEF;
 uint8_t _currentKeysContent[NUMBER_OF_SIMULT_KEYS] = {0};
 uint8_t _newKeysContent[NUMBER_OF_SIMULT_KEYS] = {0};
 uint8_t alreadyPressedKeys[UINT8_MAX + 1] = {0};
@@ -491,58 +680,36 @@ uint8_t currentMod = 0;
 
 uint8_t *currentKeys = _currentKeysContent;
 uint8_t *newKeys = _newKeysContent;
+// Every key held, for the NKRO report: no rollover limit
+uint8_t currentKeyBitmap[TRANSPORT_KEY_BITMAP_LEN] = {0};
+uint8_t newKeyBitmap[TRANSPORT_KEY_BITMAP_LEN] = {0};
 uint8_t newKeysIndex = 0;
 bool alreadyPressedNewKeysFull = false;
 bool noKeyPressedPreviously = true;
 bool noKeyPressed = true;
 
-uint8_t consumerBuffer[2] = {0};
-uint8_t previousConsumerBuffer[2] = {0};
+uint16_t consumerUsage = 0;
+uint16_t sentConsumerUsage = 0;
 bool noConsumerPressed = true;
-bool noConsumerPressedPreviously = true;
-
-void printKeys()
-{
-    printf("Sending\nCurr: [%x|%x|%x|%x|%x|%x]\n", currentKeys[0], currentKeys[1], currentKeys[2], currentKeys[3], currentKeys[4], currentKeys[5]);
-    printf("New: [%x|%x|%x|%x|%x|%x]\n", currentKeys[0], currentKeys[1], currentKeys[2], currentKeys[3], currentKeys[4], currentKeys[5]);
-    print_bits(currentMod);
-    printf("\n");
-}
 
 void sendKeysReport()
 {
     if (!noKeyPressed || !noKeyPressedPreviously)
     {
-        tud_hid_keyboard_report(0, currentMod, currentKeys);
-        esp_hidd_send_keyboard_value(hid_conn_id, currentMod, currentKeys, NUMBER_OF_SIMULT_KEYS);
+        // the router only queues actual changes
+        transport_send_keyboard(currentMod, currentKeys, currentKeyBitmap);
+        telemetry_keyboard_report(currentMod, currentKeys);
     }
     // tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, currentMod, currentKeys);
 
-    if (!noConsumerPressed)
+    // consumer reports only on change: one press, one release (usage 0)
+    uint16_t usage = noConsumerPressed ? 0 : consumerUsage;
+    if (usage != sentConsumerUsage)
     {
-        tud_hid_n_report(1, CONSUMER_REPORT_ID, consumerBuffer, sizeof(consumerBuffer));
-        printf("consumer...\n");
-        if (consumerBuffer[0]) {
-            previousConsumerBuffer[0] = consumerBuffer[0];
-            esp_hidd_send_consumer_value(hid_conn_id, consumerBuffer[0], true);
-        }
-        if (consumerBuffer[1]) {
-            previousConsumerBuffer[1] = consumerBuffer[1];
-            esp_hidd_send_consumer_value(hid_conn_id, consumerBuffer[1], true);
-        }
+        transport_send_consumer(usage);
+        telemetry_consumer_report(usage);
+        sentConsumerUsage = usage;
     }
-    else if (!noConsumerPressedPreviously) {
-        tud_hid_n_report(1, CONSUMER_REPORT_ID, NULL, 0);
-        if (previousConsumerBuffer[0]) {
-            previousConsumerBuffer[0] = 0;
-            esp_hidd_send_consumer_value(hid_conn_id, previousConsumerBuffer[0], false);
-        }
-        if (previousConsumerBuffer[1]) {
-            previousConsumerBuffer[1] = 0;
-            esp_hidd_send_consumer_value(hid_conn_id, previousConsumerBuffer[1], false);
-        }
-    }
-    // printKeys();
 }
 
 void modPressRegistration(uint8_t k)
@@ -568,13 +735,21 @@ void modPressRegistration(uint8_t k)
 
 uint32_t freqs[] = {130, 138, 146, 155, 164, 174, 185, 196, 207, 220, 233, 246, 261, 277, 293, 311, 329, 349, 369, 392, 415, 440, 466, 493, 523, 554, 587, 622, 659, 698, 739, 783, 830, 880, 932, 987, 1046, 1108, 1174, 1244, 1318, 1396, 1479, 1567, 1661, 1760, 1864, 1975, 2093, 2217, 2349, 2489, 2637, 2793, 2959, 3135, 3322, 3520, 3729, 3951, 4186, 4434, 4698, 4978, 5274, 5587, 5919, 6271, 6644, 7040, 7458, 7902};
 
+void keyBitmapRegistration(uint8_t k)
+{
+    if (k != HID_KEY_NONE && k < HID_KEY_CONTROL_LEFT)
+        newKeyBitmap[k / 8] |= 1 << (k % 8);
+}
+
 void normalKeyPressRegistration(uint8_t k)
 {
     noKeyPressed = false;
     bool alreadyPressed = alreadyPressedKeys[k];
+    keyBitmapRegistration(k);
 
     // printf("k=%d;%d -> [(%d;%d),(%d;%d),(%d;%d),(%d;%d),(%d;%d)...]\n", k, alreadyPressedKeys[k], currentKeys[0], alreadyPressedKeys[currentKeys[0]], currentKeys[1], alreadyPressedKeys[currentKeys[1]], currentKeys[2], alreadyPressedKeys[currentKeys[2]], currentKeys[3], alreadyPressedKeys[currentKeys[3]], currentKeys[4], alreadyPressedKeys[currentKeys[4]]);
-    if (!alreadyPressed)
+#if CONFIG_KB_BUZZER
+    if (!alreadyPressed && kbParams[KB_PARAM_BUZZER_ENABLED])
     {
         ledc_set_freq(LEDC_LOW_SPEED_MODE, BUZZER_TIMER, freqs[k % 72]);
         ledc_set_duty(LEDC_LOW_SPEED_MODE, BUZZER_CHANNEL, 512);
@@ -582,6 +757,13 @@ void normalKeyPressRegistration(uint8_t k)
         buzzer_on();
         // esp_hidd_send_consumer_value(hid_conn_id, k, true);
     }
+#endif
+    if (!alreadyPressed)
+    {
+        kb_counter_add(KB_COUNTER_KEY_PRESSES, 1);
+        // no host connected: back to fast advertising
+        ble_adv_activity();
+    }
     // buzzer_quack();
 
     // Already pressed keys are priorised
@@ -592,7 +774,12 @@ void normalKeyPressRegistration(uint8_t k)
     }
 
     if (!alreadyPressed)
+    {
+        // the bitmap, registered above, may still carry it
+        if (!transport_nkro_active())
+            kb_counter_add(KB_COUNTER_ROLLOVER_DROPS, 1);
         return; // buffer already full, and not priorised, ignored
+    }
 
     for (uint8_t i = 0; i < NUMBER_OF_SIMULT_KEYS; i++)
     {
@@ -612,6 +799,12 @@ void myKeysRegistration(uint8_t k)
     case M_HIDMKY_FN_LOCK:
         fnLocked = !fnLocked;
         return;
+    case M_HIDMKY_BLE_HOST_1:
+    case M_HIDMKY_BLE_HOST_2:
+    case M_HIDMKY_BLE_HOST_3:
+    case M_HIDMKY_BLE_PAIR:
+        hostKeyNew = k;
+        return;
     default:
         return;
     }
@@ -623,8 +816,7 @@ void languageKeysRegistration(uint8_t k)
 
 void usageRegistration(uint16_t usage)
 {
-    consumerBuffer[0] = (uint8_t)(usage & 0xFF);
-    consumerBuffer[1] = (uint8_t)(usage >> 8);
+    consumerUsage = usage;
     noConsumerPressed = false;
 }
 
@@ -726,7 +918,13 @@ void keyPressRegistration(uint8_t c, uint8_t r)
     }
 
     if (alreadyPressedNewKeysFull)
+    {
+        // out of the 6 key report only
+        keyBitmapRegistration(k);
+        if (!transport_nkro_active())
+            kb_counter_add(KB_COUNTER_ROLLOVER_DROPS, 1);
         return;
+    }
 
     // printf("%d | %d = ", c, r);
     normalKeyPressRegistration(matrix[c][r]);
@@ -736,7 +934,6 @@ void keyUpdateRegistration()
 {
     // esp_hidd_send_consumer_value(hid_conn_id, HID_CONSUMER_VOLUME_UP, true); // it does work lol
     // printf("up?");
-    fflush(stdout);
     for (uint8_t i = 0; i < NUMBER_OF_SIMULT_KEYS; i++)
     {
         alreadyPressedKeys[currentKeys[i]] = 0;
@@ -753,6 +950,8 @@ void keyUpdateRegistration()
     newKeys = tmp;
     fnPressed = fnNewPressed;
     memset(newKeys, 0, NUMBER_OF_SIMULT_KEYS);
+    memcpy(currentKeyBitmap, newKeyBitmap, sizeof(currentKeyBitmap));
+    memset(newKeyBitmap, 0, sizeof(newKeyBitmap));
 
     //
     sendKeysReport();
@@ -765,7 +964,16 @@ void keyUpdateRegistration()
 
     fnNewPressed = false;
 
-    noConsumerPressedPreviously = noConsumerPressed;
+    if (hostKeyNew != M_HID_UNDEF && hostKeyNew != hostKeyHeld)
+    {
+        if (hostKeyNew == M_HIDMKY_BLE_PAIR)
+            ble_adv_clear_slot();
+        else
+            ble_adv_select_slot(hostKeyNew - M_HIDMKY_BLE_HOST_1);
+    }
+    hostKeyHeld = hostKeyNew;
+    hostKeyNew = M_HID_UNDEF;
+
     noConsumerPressed = true;
 
     alreadyPressedNewKeysFull = false;
@@ -784,6 +992,31 @@ void keyUpdateRegistration()
 uint8_t raw[KB_COLS][KB_ROWS] = {0};
 uint8_t filteredRaw[KB_COLS][KB_ROWS] = {0};
 
+uint8_t previousFilteredRaw[KB_COLS][KB_ROWS] = {0};
+
+// --- Telemetry: key edges and changed-key bitmap of the filtered frame ---
+static void telemetryFrame(uint32_t scanTs, uint32_t scan)
+{
+    uint8_t diff[(MAX_RAW_KEYS + 7) / 8] = {0};
+    bool changed = false;
+
+    for (int c = 0; c < KB_COLS; c++)
+    {
+        for (int r = 0; r < KB_ROWS; r++)
+        {
+            if (filteredRaw[c][r] == previousFilteredRaw[c][r])
+                continue;
+            int bit = c * KB_ROWS + r;
+            diff[bit / 8] |= 1 << (bit % 8);
+            changed = true;
+            telemetry_key_event(scanTs, c, r, matrix[c][r], filteredRaw[c][r], fnPressed);
+            previousFilteredRaw[c][r] = filteredRaw[c][r];
+        }
+    }
+    if (changed)
+        telemetry_frame_diff(scanTs, scan, diff, sizeof(diff));
+}
+
 // --- Deghosting function ---
 static void deghostBlockingAndRegister()
 {
@@ -853,14 +1086,152 @@ static void deghostBlockingAndRegister()
             }
             if (raw[c][r])
             {
+                if (!filteredRaw[c][r])
+                    kb_counter_add(KB_COUNTER_GHOST_DROPS, 1);
                 raw[c][r] = 0;
             }
         }
     }
 }
 
+#if CONFIG_KB_BLE
+static bool ble_init()
+{
+    esp_err_t ret;
+
+    // Initialize NVS.
+    ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
+
+    bleInitFreeHeap = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    bleInitStartUs = esp_timer_get_time();
+
+    ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
+
+#if CONFIG_BT_NIMBLE_ENABLED
+    // the port initializes and enables the controller as well
+    ret = nimble_port_init();
+    if (ret)
+    {
+        ESP_LOGE(HID_DEMO_TAG, "%s init nimble failed", __func__);
+        return false;
+    }
+
+    if ((ret = esp_hidd_profile_init()) != ESP_OK)
+    {
+        ESP_LOGE(HID_DEMO_TAG, "%s init hid profile failed", __func__);
+        return false;
+    }
+
+    ble_conn_init();
+    // starts the host task, pairing parameters are set by the profile
+    esp_hidd_register_callbacks(hidd_event_callback);
+    return true;
+#else
+    esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+    ret = esp_bt_controller_init(&bt_cfg);
+    if (ret)
+    {
+        ESP_LOGE(HID_DEMO_TAG, "%s initialize controller failed", __func__);
+        return false;
+    }
+
+    ret = esp_bt_controller_enable(ESP_BT_MODE_BLE);
+    if (ret)
+    {
+        ESP_LOGE(HID_DEMO_TAG, "%s enable controller failed", __func__);
+        return false;
+    }
+
+    ret = esp_bluedroid_init();
+    if (ret)
+    {
+        ESP_LOGE(HID_DEMO_TAG, "%s init bluedroid failed", __func__);
+        return false;
+    }
+
+    ret = esp_bluedroid_enable();
+    if (ret)
+    {
+        ESP_LOGE(HID_DEMO_TAG, "%s init bluedroid failed", __func__);
+        return false;
+    }
+
+    if ((ret = esp_hidd_profile_init()) != ESP_OK)
+    {
+        ESP_LOGE(HID_DEMO_TAG, "%s init bluedroid failed", __func__);
+        return false;
+    }
+
+    ble_conn_init();
+    ble_adv_init();
+
+    /// register the callback function to the gap module
+    esp_ble_gap_register_callback(gap_event_handler);
+    esp_hidd_register_callbacks(hidd_event_callback);
+
+    /* set the security iocap & auth_req & key size & init key response key parameters to the stack*/
+    esp_ble_auth_req_t auth_req = ESP_LE_AUTH_BOND; // bonding with peer device after authentication
+    esp_ble_io_cap_t iocap = ESP_IO_CAP_NONE;       // set the IO capability to No output No input
+    uint8_t key_size = 16;                          // the key size should be 7~16 bytes
+    uint8_t init_key = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
+    uint8_t rsp_key = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
+    esp_ble_gap_set_security_param(ESP_BLE_SM_AUTHEN_REQ_MODE, &auth_req, sizeof(uint8_t));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_IOCAP_MODE, &iocap, sizeof(uint8_t));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_MAX_KEY_SIZE, &key_size, sizeof(uint8_t));
+    /* If your BLE device act as a Slave, the init_key means you hope which types of key of the master should distribute to you,
+    and the response key means which key you can distribute to the Master;
+    If your BLE device act as a master, the response key means you hope which types of key of the slave should distribute to you,
+    and the init key means which key you can distribute to the slave. */
+    esp_ble_gap_set_security_param(ESP_BLE_SM_SET_INIT_KEY, &init_key, sizeof(uint8_t));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_SET_RSP_KEY, &rsp_key, sizeof(uint8_t));
+    return true;
+#endif
+}
+
+static void ble_init_task(void *param)
+{
+    if (!ble_init())
+        ESP_LOGE(HID_DEMO_TAG, "BLE unavailable, USB only");
+    else
+        ota_update_ble_up();
+    // only the Battery Service uses it
+    battery_init();
+    vTaskDelete(NULL);
+}
+
+static void start_ble_init_task()
+{
+    xTaskCreateStatic(
+        ble_init_task,       // Task function
+        "BleInitTask",       // Name
+        BLE_INIT_STACK_SIZE,
+        NULL,                // Parameter
+        1,                   // Priority, the scanner's: it still scans on time, the stack tasks preempt both
+        bleInitTaskStack,    // Stack array
+        &bleInitTaskTCB      // Task control block
+    );
+}
+#else
+static void start_ble_init_task()
+{
+    ESP_LOGI(HID_DEMO_TAG, "built without BLE, USB only");
+}
+#endif
+
 extern "C" void app_main(void)
 {
+    boot_milestone(KB_COUNTER_BOOT_APP_MAIN_US, "app_main");
+
+    for (int i = 0; i < KB_PARAM_COUNT; i++)
+        kbParams[i] = kbParamLimits[i].def;
+    kb_keymap_reset();
+
     // GPIOs for columns (KSIs, ESP outputs)
     const gpio_num_t cols[] = {
         GPIO_NUM_40, GPIO_NUM_41, GPIO_NUM_42, GPIO_NUM_35,
@@ -875,47 +1246,22 @@ extern "C" void app_main(void)
         GPIO_NUM_37, GPIO_NUM_38};
     const int num_rows = sizeof(rows) / sizeof(rows[0]);
 
-    // --- Configuring rows ---
+    // Rows, columns (driven one at a time by the scan loop) and GPIO3 are
+    // all inputs with pull-ups: a single masked call. No settling delay
+    // here, the scan waits KB_PARAM_SETTLE_US after each column select.
+    uint64_t inputMask = 1ULL << GPIO_NUM_3;
     for (int i = 0; i < num_rows; ++i)
-    {
-        gpio_config_t row_conf = {
-            .pin_bit_mask = 1ULL << rows[i],
-            .mode = GPIO_MODE_INPUT,
-            .pull_up_en = GPIO_PULLUP_ENABLE,
-            .pull_down_en = GPIO_PULLDOWN_DISABLE,
-            .intr_type = GPIO_INTR_DISABLE,
-        };
-        gpio_config(&row_conf);
-    }
-
-    // --- Configuring columns ---
+        inputMask |= 1ULL << rows[i];
     for (int i = 0; i < num_cols; ++i)
-    {
-        vTaskDelay(pdMS_TO_TICKS(20));
-        gpio_config_t col_conf = {
-            .pin_bit_mask = 1ULL << cols[i],
-            .mode = GPIO_MODE_INPUT,
-            .pull_up_en = GPIO_PULLUP_ENABLE,
-            .pull_down_en = GPIO_PULLDOWN_DISABLE,
-            .intr_type = GPIO_INTR_DISABLE,
-        };
-        gpio_config(&col_conf);
-
-        // all columns are HIGH initially
-        // gpio_set_level(cols[i], 1);
-        vTaskDelay(pdMS_TO_TICKS(20));
-    }
-
-    vTaskDelay(pdMS_TO_TICKS(20));
-
-    gpio_config_t back = {
-        .pin_bit_mask = 1ULL << GPIO_NUM_3,
+        inputMask |= 1ULL << cols[i];
+    gpio_config_t inputs = {
+        .pin_bit_mask = inputMask,
         .mode = GPIO_MODE_INPUT,
         .pull_up_en = GPIO_PULLUP_ENABLE,
         .pull_down_en = GPIO_PULLDOWN_DISABLE,
         .intr_type = GPIO_INTR_DISABLE,
     };
-    gpio_config(&back);
+    ESP_ERROR_CHECK(gpio_config(&inputs));
 
     gpio_config_t capsLed = {
         .pin_bit_mask = 1ULL << GPIO_CAPS_LED,
@@ -943,81 +1289,32 @@ extern "C" void app_main(void)
     };
 
     ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
+    start_rawhid_task();
+    telemetry_init();
+    start_bench_task();
+    ota_update_boot_check();
 
-    // BLUETOOTH
-    // esp_err_t ret;
-
-    // Initialize NVS.
-    // ret = nvs_flash_init();
-    // if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
-    // {
-    //     ESP_ERROR_CHECK(nvs_flash_erase());
-    //     ret = nvs_flash_init();
-    // }
-    // ESP_ERROR_CHECK(ret);
-
-    // ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
-
-    // esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
-    // ret = esp_bt_controller_init(&bt_cfg);
-    // if (ret)
-    // {
-    //     ESP_LOGE(HID_DEMO_TAG, "%s initialize controller failed", __func__);
-    //     return;
-    // }
-
-    // ret = esp_bt_controller_enable(ESP_BT_MODE_BLE);
-    // if (ret)
-    // {
-    //     ESP_LOGE(HID_DEMO_TAG, "%s enable controller failed", __func__);
-    //     return;
-    // }
-
-    // ret = esp_bluedroid_init();
-    // if (ret)
-    // {
-    //     ESP_LOGE(HID_DEMO_TAG, "%s init bluedroid failed", __func__);
-    //     return;
-    // }
-
-    // ret = esp_bluedroid_enable();
-    // if (ret)
-    // {
-    //     ESP_LOGE(HID_DEMO_TAG, "%s init bluedroid failed", __func__);
-    //     return;
-    // }
-
-    // if ((ret = esp_hidd_profile_init()) != ESP_OK)
-    // {
-    //     ESP_LOGE(HID_DEMO_TAG, "%s init bluedroid failed", __func__);
-    // }
-
-    // /// register the callback function to the gap module
-    // esp_ble_gap_register_callback(gap_event_handler);
-    // esp_hidd_register_callbacks(hidd_event_callback);
-
-    // /* set the security iocap & auth_req & key size & init key response key parameters to the stack*/
-    // esp_ble_auth_req_t auth_req = ESP_LE_AUTH_BOND; // bonding with peer device after authentication
-    // esp_ble_io_cap_t iocap = ESP_IO_CAP_NONE;       // set the IO capability to No output No input
-    // uint8_t key_size = 16;                          // the key size should be 7~16 bytes
-    // uint8_t init_key = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
-    // uint8_t rsp_key = ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK;
-    // esp_ble_gap_set_security_param(ESP_BLE_SM_AUTHEN_REQ_MODE, &auth_req, sizeof(uint8_t));
-    // esp_ble_gap_set_security_param(ESP_BLE_SM_IOCAP_MODE, &iocap, sizeof(uint8_t));
-    // esp_ble_gap_set_security_param(ESP_BLE_SM_MAX_KEY_SIZE, &key_size, sizeof(uint8_t));
-    // /* If your BLE device act as a Slave, the init_key means you hope which types of key of the master should distribute to you,
-    // and the response key means which key you can distribute to the Master;
-    // If your BLE device act as a master, the response key means you hope which types of key of the slave should distribute to you,
-    // and the init key means which key you can distribute to the slave. */
-    // esp_ble_gap_set_security_param(ESP_BLE_SM_SET_INIT_KEY, &init_key, sizeof(uint8_t));
-    // esp_ble_gap_set_security_param(ESP_BLE_SM_SET_RSP_KEY, &rsp_key, sizeof(uint8_t));
+    transport_init();
 
     // MAIN LOOP
 
+    int64_t lastScanStart = 0;
+    bool scanned = false;
+    bool usbMounted = false;
     while (true)
     {
-        if (tud_mounted())
+        // a benchmark run owns the HID reports
+        if (!bench_active())
         {
+            int64_t scanStart = esp_timer_get_time();
+            // follows USB mount/unmount and BLE connect/disconnect
+            transport_update();
+            // flash erase/write stalls every task running from flash,
+            // this is the typing latency cost of a firmware update
+            if (ota_update_in_progress() && lastScanStart != 0)
+                kb_counter_max(KB_COUNTER_OTA_SCAN_GAP_MAX_US, (uint32_t)(scanStart - lastScanStart));
+            lastScanStart = scanStart;
+            ota_update_scanned();
             for (int col = 0; col < num_cols; ++col)
             {
                 // current to column LOW, rest HIGH
@@ -1043,7 +1340,7 @@ extern "C" void app_main(void)
                 }
 
                 // small delay for signal to settle
-                esp_rom_delay_us(10); // seems sufficient ? check without debug prints
+                esp_rom_delay_us(kbParams[KB_PARAM_SETTLE_US]); // 10 seems sufficient ? check without debug prints
 
                 // read all rows
                 for (int row = 0; row < num_rows; ++row)
@@ -1056,12 +1353,42 @@ extern "C" void app_main(void)
                     }
                 }
             }
+            int64_t readEnd = esp_timer_get_time();
+            transport_scan_time(readEnd);
             deghostBlockingAndRegister();
+            int64_t deghostEnd = esp_timer_get_time();
             keyUpdateRegistration();
+            int64_t scanEnd = esp_timer_get_time();
+
+            uint32_t scanUs = (uint32_t)(scanEnd - scanStart);
+            kb_counter_add(KB_COUNTER_SCANS, 1);
+            kb_counter_set(KB_COUNTER_SCAN_LAST_US, scanUs);
+            kb_counter_max(KB_COUNTER_SCAN_MAX_US, scanUs);
+
+            if (telemetry_active())
+            {
+                telemetryFrame((uint32_t)scanStart, kbCounters[KB_COUNTER_SCANS]);
+                telemetry_stage_times((uint32_t)scanStart, readEnd - scanStart, deghostEnd - readEnd,
+                                      scanEnd - deghostEnd, scanUs);
+            }
+
+            if (!scanned)
+            {
+                scanned = true;
+                boot_milestone(KB_COUNTER_BOOT_FIRST_SCAN_US, "first scan");
+                // without BLE the keyboard still works over USB
+                start_ble_init_task();
+            }
+        }
+
+        if (!usbMounted && tud_mounted())
+        {
+            usbMounted = true;
+            boot_milestone(KB_COUNTER_BOOT_USB_MOUNT_US, "USB mounted");
         }
 
         // delay before next scan
-        vTaskDelay(pdMS_TO_TICKS(10));
+        vTaskDelay(pdMS_TO_TICKS(kbParams[KB_PARAM_SCAN_INTERVAL_MS]));
 
         buzzer_off();
     }
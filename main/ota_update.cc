@@ -0,0 +1,290 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "mbedtls/sha256.h"
+#include "tinyusb.h"
+
+#include "kb_config.h"
+#include "ota_update.h"
+
+static const char *TAG = "OTA";
+
+#define OTA_HEALTH_POLL_MS 500
+
+static ota_state_t otaState = OTA_STATE_IDLE;
+static esp_ota_handle_t otaHandle = 0;
+static const esp_partition_t *otaPartition = nullptr;
+static uint32_t otaImageSize = 0;
+static uint32_t otaReceived = 0;
+static int64_t otaStartUs = 0;
+static uint32_t otaElapsedUs = 0;
+static mbedtls_sha256_context otaSha;
+
+// Incoming chunks are ~60 bytes, flash is written a sector at a time
+static uint8_t otaBlock[OTA_UPDATE_BLOCK_SIZE];
+static uint32_t otaBlockLen = 0;
+
+// Read by the scan task to attribute its stalls to the update
+static volatile bool otaWriting = false;
+
+static esp_timer_handle_t rebootTimer = nullptr;
+static esp_timer_handle_t healthTimer = nullptr;
+static int64_t healthDeadlineUs = 0;
+// Own count, COUNTERS_RESET must not fail the check. Scan task only writes it.
+static volatile bool healthChecking = false;
+static volatile uint32_t healthScans = 0;
+static volatile bool healthBleUp = false;
+
+static void ota_update_fail()
+{
+    if (otaHandle)
+        esp_ota_abort(otaHandle);
+    otaHandle = 0;
+    mbedtls_sha256_free(&otaSha);
+    otaState = OTA_STATE_FAILED;
+    otaWriting = false;
+}
+
+static esp_err_t ota_update_flush()
+{
+    if (otaBlockLen == 0)
+        return ESP_OK;
+
+    // sequential writes erase one sector at a time instead of the whole
+    // partition up front, which would freeze the scanner for seconds
+    esp_err_t err = esp_ota_write(otaHandle, otaBlock, otaBlockLen);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "write at 0x%lx failed: %s", (unsigned long)(otaReceived - otaBlockLen), esp_err_to_name(err));
+        return err;
+    }
+    otaBlockLen = 0;
+    return ESP_OK;
+}
+
+esp_err_t ota_update_begin(uint32_t size)
+{
+    if (otaState == OTA_STATE_RECEIVING)
+        ota_update_abort();
+
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    if (partition == nullptr)
+    {
+        ESP_LOGE(TAG, "no OTA partition, check the partition table");
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (size == 0 || size > partition->size)
+        return ESP_ERR_INVALID_SIZE;
+
+    esp_err_t err = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &otaHandle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "begin failed: %s", esp_err_to_name(err));
+        otaHandle = 0;
+        otaState = OTA_STATE_FAILED;
+        return err;
+    }
+
+    mbedtls_sha256_init(&otaSha);
+    mbedtls_sha256_starts(&otaSha, 0);
+    otaPartition = partition;
+    otaImageSize = size;
+    otaReceived = 0;
+    otaBlockLen = 0;
+    otaStartUs = esp_timer_get_time();
+    otaElapsedUs = 0;
+    otaState = OTA_STATE_RECEIVING;
+    otaWriting = true;
+    kb_counter_set(KB_COUNTER_OTA_BYTES, 0);
+    kb_counter_set(KB_COUNTER_OTA_TIME_US, 0);
+    kb_counter_set(KB_COUNTER_OTA_SCAN_GAP_MAX_US, 0);
+
+    ESP_LOGI(TAG, "receiving %lu bytes into %s at 0x%lx", (unsigned long)size, partition->label,
+             (unsigned long)partition->address);
+    return ESP_OK;
+}
+
+esp_err_t ota_update_write(uint32_t offset, const uint8_t *data, uint8_t len)
+{
+    if (otaState != OTA_STATE_RECEIVING)
+        return ESP_ERR_INVALID_STATE;
+    // the host resumes from the status' received count after a lost chunk
+    if (offset != otaReceived || len == 0)
+        return ESP_ERR_INVALID_ARG;
+    if (otaReceived + len > otaImageSize)
+        return ESP_ERR_INVALID_SIZE;
+
+    mbedtls_sha256_update(&otaSha, data, len);
+    while (len > 0)
+    {
+        uint32_t n = OTA_UPDATE_BLOCK_SIZE - otaBlockLen;
+        if (n > len)
+            n = len;
+        memcpy(&otaBlock[otaBlockLen], data, n);
+        otaBlockLen += n;
+        otaReceived += n;
+        data += n;
+        len -= n;
+        if (otaBlockLen == OTA_UPDATE_BLOCK_SIZE && ota_update_flush() != ESP_OK)
+        {
+            ota_update_fail();
+            return ESP_FAIL;
+        }
+    }
+
+    otaElapsedUs = (uint32_t)(esp_timer_get_time() - otaStartUs);
+    kb_counter_set(KB_COUNTER_OTA_BYTES, otaReceived);
+    kb_counter_set(KB_COUNTER_OTA_TIME_US, otaElapsedUs);
+    return ESP_OK;
+}
+
+esp_err_t ota_update_end(const uint8_t sha256[32])
+{
+    uint8_t digest[32];
+    esp_err_t err;
+
+    if (otaState != OTA_STATE_RECEIVING)
+        return ESP_ERR_INVALID_STATE;
+    if (otaReceived != otaImageSize)
+        return ESP_ERR_INVALID_SIZE;
+
+    if (ota_update_flush() != ESP_OK)
+    {
+        ota_update_fail();
+        return ESP_FAIL;
+    }
+    mbedtls_sha256_finish(&otaSha, digest);
+    if (memcmp(digest, sha256, sizeof(digest)) != 0)
+    {
+        ESP_LOGE(TAG, "SHA-256 mismatch, update discarded");
+        ota_update_fail();
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    // checks the image header, segments and appended hash
+    err = esp_ota_end(otaHandle);
+    otaHandle = 0;
+    if (err == ESP_OK)
+        err = esp_ota_set_boot_partition(otaPartition);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "image rejected: %s", esp_err_to_name(err));
+        ota_update_fail();
+        return err;
+    }
+
+    mbedtls_sha256_free(&otaSha);
+    otaElapsedUs = (uint32_t)(esp_timer_get_time() - otaStartUs);
+    kb_counter_set(KB_COUNTER_OTA_TIME_US, otaElapsedUs);
+    otaState = OTA_STATE_DONE;
+    otaWriting = false;
+    ESP_LOGI(TAG, "%lu bytes in %lu ms, %s is the next boot partition", (unsigned long)otaReceived,
+             (unsigned long)(otaElapsedUs / 1000), otaPartition->label);
+    return ESP_OK;
+}
+
+void ota_update_abort()
+{
+    if (otaState != OTA_STATE_RECEIVING)
+        return;
+    ESP_LOGW(TAG, "update aborted at %lu/%lu bytes", (unsigned long)otaReceived, (unsigned long)otaImageSize);
+    ota_update_fail();
+}
+
+void ota_update_status(ota_update_status_t *status)
+{
+    esp_ota_img_states_t running = ESP_OTA_IMG_UNDEFINED;
+    esp_ota_get_state_partition(esp_ota_get_running_partition(), &running);
+
+    memset(status, 0, sizeof(*status));
+    status->state = otaState;
+    status->imageSize = otaImageSize;
+    status->received = otaReceived;
+    status->elapsedUs = otaState == OTA_STATE_RECEIVING ? (uint32_t)(esp_timer_get_time() - otaStartUs) : otaElapsedUs;
+    status->runningState = (uint8_t)running;
+    if (otaPartition != nullptr)
+        strncpy(status->label, otaPartition->label, sizeof(status->label) - 1);
+}
+
+bool ota_update_in_progress()
+{
+    return otaWriting;
+}
+
+static void reboot_cb(void *arg)
+{
+    esp_restart();
+}
+
+void ota_update_reboot(uint32_t delayMs)
+{
+    if (rebootTimer == nullptr)
+    {
+        esp_timer_create_args_t args = {};
+        args.callback = reboot_cb;
+        args.name = "ota_reboot";
+        if (esp_timer_create(&args, &rebootTimer) != ESP_OK)
+            esp_restart();
+    }
+    esp_timer_start_once(rebootTimer, (uint64_t)delayMs * 1000);
+}
+
+// Runs on the esp_timer task until the new image is either confirmed or rolled back
+static void health_cb(void *arg)
+{
+    uint32_t scans = healthScans;
+
+    if ((tud_mounted() || healthBleUp) && scans >= OTA_HEALTH_MIN_SCANS)
+    {
+        esp_timer_stop(healthTimer);
+        healthChecking = false;
+        esp_ota_mark_app_valid_cancel_rollback();
+        ESP_LOGI(TAG, "new image healthy after %lu scans, rollback cancelled", (unsigned long)scans);
+        return;
+    }
+    if (esp_timer_get_time() >= healthDeadlineUs)
+    {
+        esp_timer_stop(healthTimer);
+        ESP_LOGE(TAG, "health check failed (USB %s, BLE %s, %lu scans), rolling back", tud_mounted() ? "up" : "down",
+                 healthBleUp ? "up" : "down", (unsigned long)scans);
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+}
+
+void ota_update_boot_check()
+{
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_ota_img_states_t state;
+
+    if (esp_ota_get_state_partition(running, &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY)
+        return;
+
+    // a crash or reset before the check passes also rolls back: the
+    // bootloader never starts a pending image twice
+    ESP_LOGW(TAG, "first boot of %s, checking health", running->label);
+    esp_timer_create_args_t args = {};
+    args.callback = health_cb;
+    args.name = "ota_health";
+    if (esp_timer_create(&args, &healthTimer) != ESP_OK)
+    {
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+        return;
+    }
+    healthDeadlineUs = esp_timer_get_time() + (int64_t)OTA_HEALTH_TIMEOUT_MS * 1000;
+    healthChecking = true;
+    esp_timer_start_periodic(healthTimer, OTA_HEALTH_POLL_MS * 1000);
+}
+
+void ota_update_scanned()
+{
+    if (healthChecking)
+        healthScans = healthScans + 1;
+}
+
+void ota_update_ble_up()
+{
+    healthBleUp = true;
+}
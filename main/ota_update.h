@@ -0,0 +1,76 @@
+/*
+ * In-application firmware update over the raw HID interface.
+ *
+ * The image is streamed into the inactive OTA partition while the keyboard
+ * keeps scanning, checked against its SHA-256, then booted. A new image
+ * boots in "pending verify" state and rolls back by itself unless it passes
+ * the health check of ota_update_boot_check().
+ */
+
+#ifndef OTA_UPDATE_H__
+#define OTA_UPDATE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bytes written to flash at once, one sector
+#define OTA_UPDATE_BLOCK_SIZE 4096
+
+// Health check of a freshly updated image: that many scans, and USB mounted or BLE up...
+#define OTA_HEALTH_MIN_SCANS 300
+// ...within that delay after boot, or back to the previous image
+#define OTA_HEALTH_TIMEOUT_MS 20000
+
+typedef enum {
+    OTA_STATE_IDLE = 0,
+    OTA_STATE_RECEIVING,
+    OTA_STATE_DONE,   // verified, boot partition switched, waiting for reboot
+    OTA_STATE_FAILED, // last update aborted or failed verification
+} ota_state_t;
+
+typedef struct {
+    uint8_t state;         // ota_state_t
+    uint32_t imageSize;
+    uint32_t received;
+    uint32_t elapsedUs;    // since begin, frozen at end
+    uint8_t runningState;  // esp_ota_img_states_t of the running image
+    char label[17];        // target partition
+} ota_update_status_t;
+
+/// Start an update of `size` bytes into the next OTA partition.
+esp_err_t ota_update_begin(uint32_t size);
+
+/// Append `len` bytes at `offset`, which must be the number of bytes received so far.
+esp_err_t ota_update_write(uint32_t offset, const uint8_t *data, uint8_t len);
+
+/// Flush, validate the image and its SHA-256, and make it the boot partition.
+esp_err_t ota_update_end(const uint8_t sha256[32]);
+
+void ota_update_abort(void);
+
+void ota_update_status(ota_update_status_t *status);
+
+bool ota_update_in_progress(void);
+
+/// Restart in `delayMs`, leaving time for the last response to go out.
+void ota_update_reboot(uint32_t delayMs);
+
+/// Call once at boot: arms the rollback health check if the image is new.
+void ota_update_boot_check(void);
+
+/// From the scan task, once per matrix scan: counts towards the health check.
+void ota_update_scanned(void);
+
+/// Once the BLE stack is up: a keyboard on battery never mounts USB.
+void ota_update_ble_up(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTA_UPDATE_H__ */
@@ -0,0 +1,482 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "tinyusb.h"
+#include "class/hid/hid_device.h"
+
+#include "kb_config.h"
+#include "rawhid.h"
+#include "ota_update.h"
+#include "bench.h"
+
+static const char *TAG = "RAWHID";
+
+#define RAWHID_QUEUE_LEN 4
+// esp_ota_end() verifies the image on this stack
+#define RAWHID_STACK_SIZE 4096
+// Attempts (1 tick each) to get the IN endpoint before giving up on a report
+#define RAWHID_SEND_RETRIES 20
+// Time for the OTA_REBOOT response to reach the host
+#define RAWHID_REBOOT_DELAY_MS 200
+
+typedef struct
+{
+    uint16_t len;
+    uint8_t data[RAWHID_REPORT_LEN];
+} rawhid_request_t;
+
+static StaticQueue_t rawhidQueueBuffer;
+static uint8_t rawhidQueueStorage[RAWHID_QUEUE_LEN * sizeof(rawhid_request_t)];
+static QueueHandle_t rawhidQueue = nullptr;
+
+StaticTask_t rawhidTaskTCB;
+StackType_t rawhidTaskStack[RAWHID_STACK_SIZE];
+
+static volatile bool streamEnabled = false;
+static volatile uint16_t streamPeriodMs = 100;
+// First counter of the frames, up to RAWHID_STREAM_MAX_COUNTERS from there
+static volatile uint8_t streamFirst = 0;
+static uint8_t streamFrame = 0;
+
+static inline uint16_t get_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = v >> 24;
+}
+
+static uint8_t *keymap_layer(uint8_t layer)
+{
+    switch (layer)
+    {
+    case KB_LAYER_BASE:
+        return &matrix[0][0];
+    case KB_LAYER_FN:
+        return &fnMatrix[0][0];
+    default:
+        return nullptr;
+    }
+}
+
+// Each handler gets the request arguments and fills the response payload,
+// returning the status and the payload length through *outLen.
+
+static rawhid_status_t cmd_get_info(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    out[0] = RAWHID_PROTOCOL_VERSION;
+    out[1] = KB_COLS;
+    out[2] = KB_ROWS;
+    out[3] = KB_LAYER_COUNT;
+    out[4] = KB_PARAM_COUNT;
+    out[5] = KB_COUNTER_COUNT;
+    *outLen = 6;
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_keymap_get(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    uint8_t *layer = keymap_layer(arg[0]);
+    uint16_t index = get_u16(&arg[1]);
+    uint8_t count = arg[3];
+
+    if (layer == nullptr || count > RAWHID_KEYMAP_MAX_COUNT)
+        return RAWHID_ERR_BAD_ARG;
+    if (index + count > MAX_RAW_KEYS)
+        return RAWHID_ERR_OUT_OF_RANGE;
+
+    memcpy(out, arg, 4);
+    memcpy(&out[4], &layer[index], count);
+    *outLen = 4 + count;
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_keymap_set(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    uint8_t *layer = keymap_layer(arg[0]);
+    uint16_t index = get_u16(&arg[1]);
+    uint8_t count = arg[3];
+
+    if (layer == nullptr || count > RAWHID_KEYMAP_MAX_COUNT)
+        return RAWHID_ERR_BAD_ARG;
+    if (index + count > MAX_RAW_KEYS)
+        return RAWHID_ERR_OUT_OF_RANGE;
+
+    // single byte stores, the scanner never sees a torn keycode
+    memcpy(&layer[index], &arg[4], count);
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_keymap_reset(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    kb_keymap_reset();
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_param_get(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    uint8_t id = arg[0];
+    if (id >= KB_PARAM_COUNT)
+        return RAWHID_ERR_BAD_ARG;
+
+    out[0] = id;
+    put_u32(&out[1], kbParams[id]);
+    put_u32(&out[5], kbParamLimits[id].min);
+    put_u32(&out[9], kbParamLimits[id].max);
+    *outLen = 13;
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_param_set(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    uint8_t id = arg[0];
+    uint32_t value = get_u32(&arg[1]);
+    if (id >= KB_PARAM_COUNT)
+        return RAWHID_ERR_BAD_ARG;
+    if (value < kbParamLimits[id].min || value > kbParamLimits[id].max)
+        return RAWHID_ERR_OUT_OF_RANGE;
+
+    kbParams[id] = value;
+    out[0] = id;
+    put_u32(&out[1], value);
+    *outLen = 5;
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_counters_get(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    uint8_t first = arg[0];
+    uint8_t count = arg[1];
+    if (count > RAWHID_COUNTERS_MAX_COUNT)
+        return RAWHID_ERR_BAD_ARG;
+    if (first + count > KB_COUNTER_COUNT)
+        return RAWHID_ERR_OUT_OF_RANGE;
+
+    out[0] = first;
+    out[1] = count;
+    for (uint8_t i = 0; i < count; i++)
+        put_u32(&out[2 + 4 * i], __atomic_load_n(&kbCounters[first + i], __ATOMIC_RELAXED));
+    *outLen = 2 + 4 * count;
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_counters_reset(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    for (int i = 0; i < KB_COUNTER_COUNT; i++)
+        kb_counter_set((kb_counter_id_t)i, 0);
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_stream(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    uint16_t period = get_u16(&arg[1]);
+    // absent in older hosts' requests, zero padded
+    uint8_t first = arg[3];
+    if (arg[0] > 1)
+        return RAWHID_ERR_BAD_ARG;
+    if (arg[0] && (period < RAWHID_STREAM_MIN_PERIOD_MS || first >= KB_COUNTER_COUNT))
+        return RAWHID_ERR_OUT_OF_RANGE;
+
+    if (arg[0])
+    {
+        streamPeriodMs = period;
+        streamFirst = first;
+    }
+    streamEnabled = arg[0];
+    out[0] = streamEnabled;
+    put_u16(&out[1], streamPeriodMs);
+    out[3] = streamFirst;
+    *outLen = 4;
+    return RAWHID_OK;
+}
+
+static rawhid_status_t esp_status(esp_err_t err)
+{
+    switch (err)
+    {
+    case ESP_OK:
+        return RAWHID_OK;
+    case ESP_ERR_INVALID_ARG:
+    case ESP_ERR_NOT_SUPPORTED:
+        return RAWHID_ERR_BAD_ARG;
+    case ESP_ERR_INVALID_SIZE:
+        return RAWHID_ERR_OUT_OF_RANGE;
+    case ESP_ERR_INVALID_STATE:
+        return RAWHID_ERR_BUSY;
+    default:
+        return RAWHID_ERR_FAILED;
+    }
+}
+
+static rawhid_status_t cmd_ota_begin(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    ota_update_status_t st;
+    rawhid_status_t status = esp_status(ota_update_begin(get_u32(arg)));
+    if (status != RAWHID_OK)
+        return status;
+
+    ota_update_status(&st);
+    put_u32(&out[0], st.imageSize);
+    put_u32(&out[4], OTA_UPDATE_BLOCK_SIZE);
+    memcpy(&out[8], st.label, 16);
+    *outLen = 24;
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_ota_data(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    uint32_t offset = get_u32(arg);
+    uint8_t len = arg[4];
+    if (len > RAWHID_OTA_MAX_CHUNK)
+        return RAWHID_ERR_BAD_ARG;
+
+    rawhid_status_t status = esp_status(ota_update_write(offset, &arg[5], len));
+    if (status != RAWHID_OK)
+        return status;
+    put_u32(out, offset + len);
+    *outLen = 4;
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_ota_end(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    return esp_status(ota_update_end(arg));
+}
+
+static rawhid_status_t cmd_ota_abort(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    ota_update_abort();
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_ota_status(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    ota_update_status_t st;
+    ota_update_status(&st);
+    out[0] = st.state;
+    put_u32(&out[1], st.imageSize);
+    put_u32(&out[5], st.received);
+    put_u32(&out[9], st.elapsedUs);
+    out[13] = st.runningState;
+    *outLen = 14;
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_ota_reboot(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    if (ota_update_in_progress())
+        return RAWHID_ERR_BUSY;
+    ota_update_reboot(RAWHID_REBOOT_DELAY_MS);
+    return RAWHID_OK;
+}
+
+static rawhid_status_t cmd_bench_start(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    return esp_status(bench_start(arg[0], arg[1], get_u16(&arg[2]), arg[4]));
+}
+
+static rawhid_status_t cmd_bench_result(const uint8_t *arg, uint8_t *out, uint8_t *outLen)
+{
+    bench_result_t r;
+    bench_result(&r);
+    out[0] = r.running;
+    out[1] = r.transport;
+    out[2] = r.kind;
+    out[3] = r.window;
+    put_u32(&out[4], r.durationUs);
+    put_u32(&out[8], r.submitted);
+    put_u32(&out[12], r.completed);
+    put_u32(&out[16], r.dropped);
+    put_u32(&out[20], r.latMinUs);
+    put_u32(&out[24], r.latAvgUs);
+    put_u32(&out[28], r.latMaxUs);
+    *outLen = 32;
+    return RAWHID_OK;
+}
+
+void rawhid_process(const uint8_t *req, uint16_t len, uint8_t rsp[RAWHID_REPORT_LEN])
+{
+    // short OUT reports are zero padded, so handlers can always read a full payload
+    uint8_t arg[RAWHID_REPORT_LEN - 2] = {0};
+    uint8_t outLen = 0;
+    rawhid_status_t status;
+
+    memset(rsp, 0, RAWHID_REPORT_LEN);
+    if (len < 2)
+    {
+        rsp[2] = RAWHID_ERR_BAD_LENGTH;
+        return;
+    }
+    rsp[0] = req[0];
+    rsp[1] = req[1];
+    memcpy(arg, &req[2], len > RAWHID_REPORT_LEN ? RAWHID_REPORT_LEN - 2 : len - 2);
+
+    switch (req[0])
+    {
+    case RAWHID_CMD_GET_INFO:
+        status = cmd_get_info(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_KEYMAP_GET:
+        status = cmd_keymap_get(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_KEYMAP_SET:
+        status = cmd_keymap_set(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_KEYMAP_RESET:
+        status = cmd_keymap_reset(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_PARAM_GET:
+        status = cmd_param_get(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_PARAM_SET:
+        status = cmd_param_set(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_COUNTERS_GET:
+        status = cmd_counters_get(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_COUNTERS_RESET:
+        status = cmd_counters_reset(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_STREAM:
+        status = cmd_stream(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_OTA_BEGIN:
+        status = cmd_ota_begin(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_OTA_DATA:
+        status = cmd_ota_data(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_OTA_END:
+        status = cmd_ota_end(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_OTA_ABORT:
+        status = cmd_ota_abort(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_OTA_STATUS:
+        status = cmd_ota_status(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_OTA_REBOOT:
+        status = cmd_ota_reboot(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_BENCH_START:
+        status = cmd_bench_start(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    case RAWHID_CMD_BENCH_RESULT:
+        status = cmd_bench_result(arg, &rsp[RAWHID_HDR_LEN], &outLen);
+        break;
+    default:
+        status = RAWHID_ERR_UNKNOWN_CMD;
+        break;
+    }
+    rsp[2] = status;
+    if (status != RAWHID_OK)
+        memset(&rsp[RAWHID_HDR_LEN], 0, RAWHID_PAYLOAD_LEN);
+}
+
+static bool rawhid_send(const uint8_t *report)
+{
+    for (int i = 0; i < RAWHID_SEND_RETRIES; i++)
+    {
+        if (!tud_mounted())
+            return false;
+        if (tud_hid_n_ready(RAWHID_ITF))
+            return tud_hid_n_report(RAWHID_ITF, 0, report, RAWHID_REPORT_LEN);
+        vTaskDelay(1);
+    }
+    ESP_LOGW(TAG, "IN endpoint busy, report dropped");
+    return false;
+}
+
+static void rawhid_send_telemetry()
+{
+    uint8_t report[RAWHID_REPORT_LEN] = {0};
+    uint8_t first = streamFirst;
+    uint8_t count = KB_COUNTER_COUNT - first < RAWHID_STREAM_MAX_COUNTERS ? KB_COUNTER_COUNT - first
+                                                                        : RAWHID_STREAM_MAX_COUNTERS;
+
+    report[0] = RAWHID_EVT_TELEMETRY;
+    report[1] = streamFrame++;
+    put_u32(&report[3], (uint32_t)esp_timer_get_time());
+    report[7] = first;
+    report[8] = count;
+    for (uint8_t i = 0; i < count; i++)
+        put_u32(&report[9 + 4 * i], __atomic_load_n(&kbCounters[first + i], __ATOMIC_RELAXED));
+    rawhid_send(report);
+}
+
+void rawhid_task(void *param)
+{
+    rawhid_request_t req;
+    uint8_t rsp[RAWHID_REPORT_LEN];
+    TickType_t lastFrame = xTaskGetTickCount();
+
+    while (1)
+    {
+        TickType_t wait = portMAX_DELAY;
+        if (streamEnabled)
+        {
+            // at least a tick, a period rounded down to 0 would send frames back to back
+            TickType_t period = pdMS_TO_TICKS(streamPeriodMs) > 0 ? pdMS_TO_TICKS(streamPeriodMs) : 1;
+            TickType_t elapsed = xTaskGetTickCount() - lastFrame;
+            wait = elapsed >= period ? 0 : period - elapsed;
+        }
+
+        if (xQueueReceive(rawhidQueue, &req, wait) == pdTRUE)
+        {
+            rawhid_process(req.data, req.len, rsp);
+            rawhid_send(rsp);
+        }
+        else if (streamEnabled)
+        {
+            lastFrame = xTaskGetTickCount();
+            rawhid_send_telemetry();
+        }
+    }
+}
+
+void rawhid_receive(const uint8_t *buffer, uint16_t bufsize)
+{
+    rawhid_request_t req = {};
+
+    if (rawhidQueue == nullptr)
+        return;
+    req.len = bufsize > RAWHID_REPORT_LEN ? RAWHID_REPORT_LEN : bufsize;
+    memcpy(req.data, buffer, req.len);
+    // never block the TinyUSB task, the host retries on timeout
+    if (xQueueSend(rawhidQueue, &req, 0) != pdTRUE)
+        ESP_LOGW(TAG, "request queue full, request 0x%02x dropped", req.data[0]);
+}
+
+void start_rawhid_task()
+{
+    rawhidQueue = xQueueCreateStatic(RAWHID_QUEUE_LEN, sizeof(rawhid_request_t),
+                                     rawhidQueueStorage, &rawhidQueueBuffer);
+    xTaskCreateStatic(
+        rawhid_task,     // Task function
+        "RawHidTask",    // Name
+        RAWHID_STACK_SIZE,
+        NULL,            // Parameter
+        4,               // Priority
+        rawhidTaskStack, // Stack array
+        &rawhidTaskTCB   // Task control block
+    );
+}
@@ -0,0 +1,96 @@
+/*
+ * Vendor-defined raw HID interface: live configuration and telemetry.
+ *
+ * Every transfer is a 64-byte report without report ID, on both the
+ * OUT (host -> keyboard) and IN (keyboard -> host) endpoints.
+ * The full protocol is described in doc/rawhid.md, tools/chris_rawhid.py
+ * is the host-side reference client.
+ */
+
+#ifndef RAWHID_H__
+#define RAWHID_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// TinyUSB HID instance (interface number) of the raw HID interface
+#define RAWHID_ITF 2
+
+#define RAWHID_REPORT_LEN 64
+#define RAWHID_PROTOCOL_VERSION 1
+
+/**
+ * Request  (OUT): [0] command, [1] sequence, [2..63] arguments
+ * Response (IN) : [0] command, [1] sequence, [2] status, [3..63] payload
+ * Stream   (IN) : [0] RAWHID_EVT_TELEMETRY, [1] frame counter, [2] 0, [3..63] payload
+ *
+ * Multi-byte values are little endian.
+ */
+#define RAWHID_HDR_LEN 3
+#define RAWHID_PAYLOAD_LEN (RAWHID_REPORT_LEN - RAWHID_HDR_LEN)
+
+typedef enum {
+    RAWHID_CMD_GET_INFO = 0x01,       // -> version, cols, rows, layers, params, counters
+    RAWHID_CMD_KEYMAP_GET = 0x02,     // layer, index(u16), count -> layer, index(u16), count, codes[]
+    RAWHID_CMD_KEYMAP_SET = 0x03,     // layer, index(u16), count, codes[] -> (empty)
+    RAWHID_CMD_KEYMAP_RESET = 0x04,   // -> (empty), restores the compiled-in keymaps
+    RAWHID_CMD_PARAM_GET = 0x05,      // id -> id, value(u32), min(u32), max(u32)
+    RAWHID_CMD_PARAM_SET = 0x06,      // id, value(u32) -> id, value(u32)
+    RAWHID_CMD_COUNTERS_GET = 0x07,   // first, count -> first, count, values(u32)[]
+    RAWHID_CMD_COUNTERS_RESET = 0x08, // -> (empty)
+    RAWHID_CMD_STREAM = 0x09,         // enable, period_ms(u16), first -> enable, period_ms(u16), first
+
+    // Firmware update, see ota_update.h
+    RAWHID_CMD_OTA_BEGIN = 0x10,  // size(u32) -> size(u32), flash block size(u32), partition label[16]
+    RAWHID_CMD_OTA_DATA = 0x11,   // offset(u32), len, data[len] -> next offset(u32)
+    RAWHID_CMD_OTA_END = 0x12,    // sha256[32] -> (empty), image verified and selected for boot
+    RAWHID_CMD_OTA_ABORT = 0x13,  // -> (empty)
+    RAWHID_CMD_OTA_STATUS = 0x14, // -> state, size(u32), received(u32), elapsed_us(u32), running image state
+    RAWHID_CMD_OTA_REBOOT = 0x15, // -> (empty), restarts shortly after the response
+
+    // HID throughput benchmark, see bench.h
+    RAWHID_CMD_BENCH_START = 0x20,  // transport, kind, duration_ms(u16), window -> (empty)
+    RAWHID_CMD_BENCH_RESULT = 0x21, // -> running, transport, kind, window, duration_us(u32), submitted(u32),
+                                    //    completed(u32), dropped(u32), latency min/avg/max_us(u32)
+
+    RAWHID_EVT_TELEMETRY = 0xF0, // unsolicited: timestamp_us(u32), first, count, values(u32)[]
+} rawhid_cmd_t;
+
+typedef enum {
+    RAWHID_OK = 0x00,
+    RAWHID_ERR_UNKNOWN_CMD = 0x01,
+    RAWHID_ERR_BAD_LENGTH = 0x02,
+    RAWHID_ERR_BAD_ARG = 0x03,
+    RAWHID_ERR_OUT_OF_RANGE = 0x04,
+    RAWHID_ERR_BUSY = 0x05,
+    RAWHID_ERR_FAILED = 0x06, // flash write or image verification failed
+} rawhid_status_t;
+
+// Largest number of keycodes / counters that fit in one report
+#define RAWHID_KEYMAP_MAX_COUNT (RAWHID_PAYLOAD_LEN - 4)
+#define RAWHID_COUNTERS_MAX_COUNT ((RAWHID_PAYLOAD_LEN - 2) / 4)
+#define RAWHID_STREAM_MAX_COUNTERS ((RAWHID_PAYLOAD_LEN - 6) / 4)
+#define RAWHID_OTA_MAX_CHUNK (RAWHID_REPORT_LEN - 2 - 5)
+
+#define RAWHID_STREAM_MIN_PERIOD_MS 5
+
+/**
+ * Handle one request and build its response.
+ * Pure protocol logic, does not touch the USB stack.
+ */
+void rawhid_process(const uint8_t *req, uint16_t len, uint8_t rsp[RAWHID_REPORT_LEN]);
+
+/// Called from tud_hid_set_report_cb() for the raw HID instance.
+void rawhid_receive(const uint8_t *buffer, uint16_t bufsize);
+
+/// Start the task serving requests and the telemetry stream.
+void start_rawhid_task(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RAWHID_H__ */
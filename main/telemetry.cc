@@ -0,0 +1,238 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "tinyusb.h"
+#include "tusb_cdc_acm.h"
+
+#include "kb_config.h"
+#include "telemetry.h"
+
+static const char *TAG = "TELEMETRY";
+
+// Must be a power of 2, ~1 s of worst case traffic at a 10 ms scan period
+#define TELEMETRY_RING_SIZE 4096
+#define TELEMETRY_CHUNK 256
+#define TELEMETRY_STACK_SIZE 2048
+#define TELEMETRY_DRAIN_PERIOD_MS 10
+
+// Single producer (scan task) / single consumer (drain task) ring.
+// The producer only moves head, the consumer only moves tail.
+static uint8_t ring[TELEMETRY_RING_SIZE];
+static uint32_t ringHead = 0;
+static uint32_t ringTail = 0;
+static uint32_t ringDropped = 0;
+
+static volatile bool hostListening = false;
+
+StaticTask_t telemetryTaskTCB;
+StackType_t telemetryTaskStack[TELEMETRY_STACK_SIZE];
+
+static void ring_write(uint32_t pos, const uint8_t *data, uint32_t len)
+{
+    uint32_t off = pos & (TELEMETRY_RING_SIZE - 1);
+    uint32_t first = TELEMETRY_RING_SIZE - off;
+    if (first > len)
+        first = len;
+    memcpy(&ring[off], data, first);
+    memcpy(ring, data + first, len - first);
+}
+
+static void ring_read(uint32_t pos, uint8_t *data, uint32_t len)
+{
+    uint32_t off = pos & (TELEMETRY_RING_SIZE - 1);
+    uint32_t first = TELEMETRY_RING_SIZE - off;
+    if (first > len)
+        first = len;
+    memcpy(data, &ring[off], first);
+    memcpy(data + first, ring, len - first);
+}
+
+static void telemetry_push(uint8_t type, uint32_t tsUs, const uint8_t *payload, uint8_t len)
+{
+    uint8_t rec[TELEMETRY_HDR_LEN + TELEMETRY_MAX_PAYLOAD + 1];
+    uint32_t recLen = TELEMETRY_HDR_LEN + len + 1;
+    uint8_t sum = 0;
+
+    if (!hostListening)
+        return;
+
+    uint32_t head = ringHead;
+    uint32_t tail = __atomic_load_n(&ringTail, __ATOMIC_ACQUIRE);
+    if (TELEMETRY_RING_SIZE - (head - tail) < recLen)
+    {
+        // drain task is behind, count it and let the host know later
+        __atomic_fetch_add(&ringDropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec[0] = TELEMETRY_SYNC;
+    rec[1] = type;
+    rec[2] = len;
+    rec[3] = tsUs & 0xFF;
+    rec[4] = (tsUs >> 8) & 0xFF;
+    rec[5] = (tsUs >> 16) & 0xFF;
+    rec[6] = tsUs >> 24;
+    memcpy(&rec[TELEMETRY_HDR_LEN], payload, len);
+    for (uint32_t i = 1; i < recLen - 1; i++)
+        sum += rec[i];
+    rec[recLen - 1] = sum;
+
+    ring_write(head, rec, recLen);
+    __atomic_store_n(&ringHead, head + recLen, __ATOMIC_RELEASE);
+}
+
+bool telemetry_active()
+{
+    return hostListening;
+}
+
+void telemetry_key_event(uint32_t tsUs, uint8_t col, uint8_t row, uint8_t keycode, bool pressed, bool fn)
+{
+    uint8_t p[4] = {col, row, keycode, (uint8_t)((pressed ? 0x01 : 0) | (fn ? 0x02 : 0))};
+    telemetry_push(TELEMETRY_KEY_EVENT, tsUs, p, sizeof(p));
+}
+
+void telemetry_frame_diff(uint32_t tsUs, uint32_t scan, const uint8_t *bitmap, uint8_t len)
+{
+    uint8_t p[TELEMETRY_MAX_PAYLOAD];
+    if (len > TELEMETRY_MAX_PAYLOAD - 4)
+        len = TELEMETRY_MAX_PAYLOAD - 4;
+    memcpy(p, &scan, 4);
+    memcpy(&p[4], bitmap, len);
+    telemetry_push(TELEMETRY_FRAME_DIFF, tsUs, p, 4 + len);
+}
+
+void telemetry_stage_times(uint32_t tsUs, uint16_t readUs, uint16_t deghostUs, uint16_t reportUs, uint16_t totalUs)
+{
+    uint16_t p[4] = {readUs, deghostUs, reportUs, totalUs};
+    telemetry_push(TELEMETRY_STAGE_TIMES, tsUs, (const uint8_t *)p, sizeof(p));
+}
+
+void telemetry_keyboard_report(uint8_t modifiers, const uint8_t *keys)
+{
+    uint8_t p[7];
+    p[0] = modifiers;
+    memcpy(&p[1], keys, 6);
+    telemetry_push(TELEMETRY_KBD_REPORT, (uint32_t)esp_timer_get_time(), p, sizeof(p));
+}
+
+void telemetry_consumer_report(uint16_t usage)
+{
+    telemetry_push(TELEMETRY_CC_REPORT, (uint32_t)esp_timer_get_time(), (const uint8_t *)&usage, sizeof(usage));
+}
+
+// Runs on the drain task, the only place allowed to move the tail
+static void telemetry_discard()
+{
+    __atomic_store_n(&ringTail, __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+// Bytes of the whole records from tail on that fit in room, tail always on a record start
+static uint32_t ring_records(uint32_t tail, uint32_t head, uint32_t room)
+{
+    uint32_t n = 0;
+    while (tail + n != head)
+    {
+        uint8_t len;
+        ring_read(tail + n + 2, &len, 1);
+        uint32_t recLen = TELEMETRY_HDR_LEN + len + 1;
+        if (n + recLen > room)
+            break;
+        n += recLen;
+    }
+    return n;
+}
+
+// Drain task. False when the CDC FIFO has no room for it, nothing is written then.
+static bool telemetry_send_dropped(uint32_t dropped)
+{
+    // built here rather than through the ring, which is producer-owned
+    uint8_t rec[TELEMETRY_HDR_LEN + 4 + 1];
+    if (tud_cdc_n_write_available(0) < sizeof(rec))
+        return false;
+    uint32_t ts = (uint32_t)esp_timer_get_time();
+    uint8_t sum = 0;
+    rec[0] = TELEMETRY_SYNC;
+    rec[1] = TELEMETRY_DROPPED;
+    rec[2] = 4;
+    memcpy(&rec[3], &ts, 4);
+    memcpy(&rec[7], &dropped, 4);
+    for (int i = 1; i < TELEMETRY_HDR_LEN + 4; i++)
+        sum += rec[i];
+    rec[TELEMETRY_HDR_LEN + 4] = sum;
+    tinyusb_cdcacm_write_queue(TINYUSB_CDC_ACM_0, rec, sizeof(rec));
+    return true;
+}
+
+void telemetry_task(void *param)
+{
+    uint8_t chunk[TELEMETRY_CHUNK];
+
+    while (1)
+    {
+        vTaskDelay(pdMS_TO_TICKS(TELEMETRY_DRAIN_PERIOD_MS));
+
+        bool listening = tud_mounted() && tud_cdc_n_connected(0);
+        if (listening != hostListening)
+        {
+            // fresh start for every new session, nothing stale in the ring
+            hostListening = listening;
+            telemetry_discard();
+            kb_counter_add(KB_COUNTER_TELEMETRY_DROPS, __atomic_exchange_n(&ringDropped, 0, __ATOMIC_RELAXED));
+        }
+        if (!listening)
+            continue;
+
+        // whole records only: the FIFO never ends in the middle of one, where
+        // the next record or a DROPPED would be written into it
+        uint32_t tail = ringTail;
+        uint32_t head = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE);
+        while (tail != head)
+        {
+            uint32_t room = tud_cdc_n_write_available(0);
+            uint32_t n = ring_records(tail, head, room < TELEMETRY_CHUNK ? room : TELEMETRY_CHUNK);
+            if (n == 0)
+                break; // TinyUSB FIFO full, retry on the next period
+            ring_read(tail, chunk, n);
+            tinyusb_cdcacm_write_queue(TINYUSB_CDC_ACM_0, chunk, n);
+            tail += n;
+            __atomic_store_n(&ringTail, tail, __ATOMIC_RELEASE);
+            kb_counter_add(KB_COUNTER_TELEMETRY_BYTES, n);
+        }
+
+        // at a record boundary, after what was drained; kept for the next period if it does not fit
+        uint32_t dropped = __atomic_exchange_n(&ringDropped, 0, __ATOMIC_RELAXED);
+        if (dropped)
+        {
+            if (telemetry_send_dropped(dropped))
+                kb_counter_add(KB_COUNTER_TELEMETRY_DROPS, dropped);
+            else
+                __atomic_fetch_add(&ringDropped, dropped, __ATOMIC_RELAXED);
+        }
+        tinyusb_cdcacm_write_flush(TINYUSB_CDC_ACM_0, 0);
+    }
+}
+
+void telemetry_init()
+{
+    tinyusb_config_cdcacm_t acm_cfg = {};
+    acm_cfg.usb_dev = TINYUSB_USBDEV_0;
+    acm_cfg.cdc_port = TINYUSB_CDC_ACM_0;
+    if (tusb_cdc_acm_init(&acm_cfg) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "CDC-ACM init failed, telemetry disabled");
+        return;
+    }
+
+    xTaskCreateStatic(
+        telemetry_task,     // Task function
+        "TelemetryTask",    // Name
+        TELEMETRY_STACK_SIZE,
+        NULL,               // Parameter
+        2,                  // Priority, background
+        telemetryTaskStack, // Stack array
+        &telemetryTaskTCB   // Task control block
+    );
+}
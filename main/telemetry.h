@@ -0,0 +1,78 @@
+/*
+ * Binary telemetry stream over a USB CDC-ACM interface.
+ *
+ * Records are pushed by the scan task into a lock-free single-producer ring
+ * and drained to the host by a dedicated task, so that recording costs a few
+ * memcpy and never waits on USB. Decoder: tools/telemetry_decode.py, format
+ * in doc/telemetry.md.
+ */
+
+#ifndef TELEMETRY_H__
+#define TELEMETRY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CDC interface numbers (control + data), after the 3 HID ones
+#define TELEMETRY_ITF 3
+
+#define TELEMETRY_SYNC 0xA5
+
+/**
+ * Record: [sync 0xA5][type u8][len u8][timestamp_us u32][payload len bytes][checksum u8]
+ * checksum = sum of every byte from type to the end of the payload, mod 256.
+ * Multi-byte values are little endian.
+ */
+#define TELEMETRY_HDR_LEN 7
+#define TELEMETRY_MAX_PAYLOAD 32
+
+typedef enum {
+    TELEMETRY_KEY_EVENT = 0x01,   // col u8, row u8, keycode u8, flags u8 (bit0 pressed, bit1 Fn layer)
+    TELEMETRY_FRAME_DIFF = 0x02,  // scan u32, changed-key bitmap (bit = col * KB_ROWS + row)
+    TELEMETRY_STAGE_TIMES = 0x03, // read_us u16, deghost_us u16, report_us u16, total_us u16
+    TELEMETRY_KBD_REPORT = 0x04,  // modifiers u8, keys u8[6]
+    TELEMETRY_CC_REPORT = 0x05,   // usage u16
+    TELEMETRY_DROPPED = 0x06,     // records lost since the last DROPPED record, u32
+} telemetry_type_t;
+
+#if CONFIG_KB_TELEMETRY
+
+/// Install the CDC-ACM class and start the drain task (after tinyusb_driver_install()).
+void telemetry_init(void);
+
+/// True while a host holds the port open (DTR set), recording is a no-op otherwise.
+bool telemetry_active(void);
+
+void telemetry_key_event(uint32_t tsUs, uint8_t col, uint8_t row, uint8_t keycode, bool pressed, bool fn);
+
+void telemetry_frame_diff(uint32_t tsUs, uint32_t scan, const uint8_t *bitmap, uint8_t len);
+
+void telemetry_stage_times(uint32_t tsUs, uint16_t readUs, uint16_t deghostUs, uint16_t reportUs, uint16_t totalUs);
+
+void telemetry_keyboard_report(uint8_t modifiers, const uint8_t *keys);
+
+void telemetry_consumer_report(uint16_t usage);
+
+#else
+
+// Built without telemetry (CONFIG_KB_TELEMETRY): no CDC interface, never active
+static inline void telemetry_init(void) {}
+static inline bool telemetry_active(void) { return false; }
+static inline void telemetry_key_event(uint32_t tsUs, uint8_t col, uint8_t row, uint8_t keycode, bool pressed, bool fn) {}
+static inline void telemetry_frame_diff(uint32_t tsUs, uint32_t scan, const uint8_t *bitmap, uint8_t len) {}
+static inline void telemetry_stage_times(uint32_t tsUs, uint16_t readUs, uint16_t deghostUs, uint16_t reportUs, uint16_t totalUs) {}
+static inline void telemetry_keyboard_report(uint8_t modifiers, const uint8_t *keys) {}
+static inline void telemetry_consumer_report(uint16_t usage) {}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TELEMETRY_H__ */
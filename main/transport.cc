@@ -0,0 +1,686 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "tinyusb.h"
+#include "class/hid/hid_device.h"
+#if CONFIG_KB_BLE
+#include "nvs.h"
+#include "esp_hidd_prf_api.h"
+#endif
+#include "hid_dev.h"
+
+#include "kb_config.h"
+#include "transport.h"
+#include "ble_conn.h"
+#include "ble_adv.h"
+
+static const char *TAG = "TRANSPORT";
+
+#define TRANSPORT_STACK_SIZE 3072
+// Longest wait for the previous report of a USB interface to go out
+#define TRANSPORT_USB_READY_TIMEOUT_MS 50
+// Notification state of the bonded hosts, the stack does not keep it across reboots
+#define TRANSPORT_CCCD_NVS_NAMESPACE "ble_cccd"
+// BLE notifications handed to the stack and not reported sent yet, for the latency
+#define TRANSPORT_LAT_INFLIGHT 32
+
+// Input reports the host enabled notifications for
+#define CCCD_KEYBOARD (1 << 0)
+#define CCCD_BOOT_KEYBOARD (1 << 1)
+#define CCCD_CONSUMER (1 << 2)
+#define CCCD_NKRO (1 << 3)
+
+typedef enum {
+    REPORT_KEYBOARD = 0,
+    REPORT_CONSUMER,
+} report_kind_t;
+
+typedef struct {
+    uint8_t kind;      // report_kind_t
+    uint8_t modifiers; // keyboard
+    uint8_t keys[6];   // keyboard
+    uint8_t bitmap[TRANSPORT_KEY_BITMAP_LEN]; // keyboard, every key held
+    uint16_t usage;    // consumer
+    int64_t edgeUs;    // matrix read of the scan that saw the key edge, 0 for a state sent again
+} transport_report_t;
+
+StaticTask_t usbSenderTaskTCB;
+StackType_t usbSenderTaskStack[TRANSPORT_STACK_SIZE];
+static TaskHandle_t usbSenderTask = nullptr;
+static StaticQueue_t usbQueueBuffer;
+static uint8_t usbQueueStorage[TRANSPORT_QUEUE_LEN * sizeof(transport_report_t)];
+static QueueHandle_t usbQueue = nullptr;
+
+// BLE link, written from the BT callbacks; never up without CONFIG_KB_BLE
+static volatile bool bleConnected = false;
+static volatile bool bleEncrypted = false;
+// Reports enabled since the last transport_update(), their current state is sent again
+static volatile uint8_t bleCccdEnabled = 0;
+
+#if CONFIG_KB_BLE
+StaticTask_t bleSenderTaskTCB;
+StackType_t bleSenderTaskStack[TRANSPORT_STACK_SIZE];
+static TaskHandle_t bleSenderTask = nullptr;
+
+// BLE reports waiting, oldest first. Not a FreeRTOS queue: while the link
+// is congested, entries are merged in place.
+static portMUX_TYPE bleLock = portMUX_INITIALIZER_UNLOCKED;
+static transport_report_t bleRing[TRANSPORT_QUEUE_LEN];
+static uint8_t bleCount = 0;
+// Last state handed to the stack, per report kind
+static transport_report_t bleHostKeyboard = {REPORT_KEYBOARD};
+static transport_report_t bleHostConsumer = {REPORT_CONSUMER};
+
+static volatile bool bleCongested = false;
+static volatile uint16_t bleConnId = 0;
+static volatile uint8_t bleCccd = 0;
+static esp_bd_addr_t blePeer;
+static bool blePeerKnown = false;
+// Connection time, 0 once the keyboard report is deliverable
+static int64_t bleConnectUs = 0;
+static bool bleBootReady = false;
+
+typedef struct {
+    int64_t edgeUs;   // 0: no key edge behind it, not measured
+    int64_t submitUs; // handed to the stack
+} transport_lat_t;
+
+// Notifications in flight, oldest first. The stack reports them sent in order.
+static portMUX_TYPE latLock = portMUX_INITIALIZER_UNLOCKED;
+static transport_lat_t latRing[TRANSPORT_LAT_INFLIGHT];
+static uint8_t latHead = 0;
+static uint8_t latCount = 0;
+#endif
+
+// Scan task only: routing and last state handed to the router
+static int64_t scanReadUs = 0;
+static uint8_t active = 0;
+static uint8_t lastModifiers = 0;
+static uint8_t lastKeys[6] = {0};
+static uint8_t lastBitmap[TRANSPORT_KEY_BITMAP_LEN] = {0};
+static uint16_t lastUsage = 0;
+
+// Never blocks the scanner: a full queue loses its oldest report
+static void transport_enqueue(QueueHandle_t queue, kb_counter_id_t drops, const transport_report_t *report)
+{
+    if (xQueueSend(queue, report, 0) == pdTRUE)
+        return;
+    transport_report_t stale;
+    xQueueReceive(queue, &stale, 0);
+    kb_counter_add(drops, 1);
+    xQueueSend(queue, report, 0);
+}
+
+#if CONFIG_KB_BLE
+// A bit set within cur only, or cleared within cur only
+static bool bits_lost(uint8_t prev, uint8_t cur, uint8_t next)
+{
+    return ((cur & ~prev & ~next) | (~cur & prev & next)) != 0;
+}
+
+// Going straight from prev to next would hide a key pressed and released
+// within cur, or released and pressed again
+static bool transition_lost(const transport_report_t *prev, const transport_report_t *cur,
+                            const transport_report_t *next)
+{
+    if (cur->kind == REPORT_CONSUMER)
+        return (cur->usage != 0 && cur->usage != prev->usage && cur->usage != next->usage) ||
+               (prev->usage != 0 && prev->usage != cur->usage && prev->usage == next->usage);
+
+    if (bits_lost(prev->modifiers, cur->modifiers, next->modifiers))
+        return true;
+    // the keys of the 6 key array are in the bitmap too
+    for (uint8_t i = 0; i < TRANSPORT_KEY_BITMAP_LEN; i++)
+        if (bits_lost(prev->bitmap[i], cur->bitmap[i], next->bitmap[i]))
+            return true;
+    return false;
+}
+
+// bleLock held. Entry i can go if a later report of its kind carries all its transitions.
+static bool ble_mergeable(uint8_t i)
+{
+    const transport_report_t *cur = &bleRing[i];
+    const transport_report_t *prev = cur->kind == REPORT_CONSUMER ? &bleHostConsumer : &bleHostKeyboard;
+    for (uint8_t j = 0; j < i; j++)
+        if (bleRing[j].kind == cur->kind)
+            prev = &bleRing[j];
+    for (uint8_t j = i + 1; j < bleCount; j++)
+        if (bleRing[j].kind == cur->kind)
+            return !transition_lost(prev, cur, &bleRing[j]);
+    return false;
+}
+
+// bleLock held
+static void ble_remove(uint8_t i)
+{
+    memmove(&bleRing[i], &bleRing[i + 1], (bleCount - i - 1) * sizeof(transport_report_t));
+    bleCount--;
+}
+
+// bleLock held. Removes a mergeable entry i, the report carrying its transitions
+// inherits its key edge: the latency is the one of the oldest key waiting.
+static void ble_merge(uint8_t i)
+{
+    for (uint8_t j = i + 1; j < bleCount; j++)
+    {
+        if (bleRing[j].kind != bleRing[i].kind)
+            continue;
+        if (bleRing[i].edgeUs != 0 && (bleRing[j].edgeUs == 0 || bleRing[i].edgeUs < bleRing[j].edgeUs))
+            bleRing[j].edgeUs = bleRing[i].edgeUs;
+        break;
+    }
+    ble_remove(i);
+    kb_counter_add(KB_COUNTER_BLE_NOTIFY_COALESCED, 1);
+}
+
+static void ble_enqueue(const transport_report_t *report)
+{
+    portENTER_CRITICAL(&bleLock);
+    if (bleCount == TRANSPORT_QUEUE_LEN)
+    {
+        // make room by merging, the oldest report only goes if nothing can be merged
+        uint8_t i = 0;
+        while (i < bleCount && !ble_mergeable(i))
+            i++;
+        if (i < bleCount)
+            ble_merge(i);
+        else
+        {
+            ble_remove(0);
+            kb_counter_add(KB_COUNTER_BLE_DROPS, 1);
+        }
+    }
+    bleRing[bleCount++] = *report;
+    portEXIT_CRITICAL(&bleLock);
+    kb_counter_add(KB_COUNTER_BLE_NOTIFY_QUEUED, 1);
+    xTaskNotifyGive(bleSenderTask);
+}
+
+// Oldest report that is not merged into a later one
+static bool ble_dequeue(transport_report_t *report)
+{
+    bool found = false;
+    portENTER_CRITICAL(&bleLock);
+    while (bleCount > 1 && ble_mergeable(0))
+        ble_merge(0);
+    if (bleCount > 0)
+    {
+        *report = bleRing[0];
+        ble_remove(0);
+        if (report->kind == REPORT_CONSUMER)
+            bleHostConsumer = *report;
+        else
+            bleHostKeyboard = *report;
+        found = true;
+    }
+    portEXIT_CRITICAL(&bleLock);
+    return found;
+}
+
+// Before the notification is handed to the stack, its sent event may come first.
+// A full ring means events went missing: start over.
+static void lat_submitted(int64_t edgeUs)
+{
+    portENTER_CRITICAL(&latLock);
+    if (latCount == TRANSPORT_LAT_INFLIGHT)
+        latCount = 0;
+    transport_lat_t *lat = &latRing[(latHead + latCount) % TRANSPORT_LAT_INFLIGHT];
+    lat->edgeUs = edgeUs;
+    lat->submitUs = esp_timer_get_time();
+    latCount++;
+    portEXIT_CRITICAL(&latLock);
+}
+
+// The stack refused the last notification submitted, no event will come
+static void lat_cancel()
+{
+    portENTER_CRITICAL(&latLock);
+    if (latCount > 0)
+        latCount--;
+    portEXIT_CRITICAL(&latLock);
+}
+
+// Sent event of the oldest notification in flight
+static void lat_sent(bool ok)
+{
+    transport_lat_t lat;
+    portENTER_CRITICAL(&latLock);
+    if (latCount == 0)
+    {
+        portEXIT_CRITICAL(&latLock);
+        return;
+    }
+    lat = latRing[latHead];
+    latHead = (latHead + 1) % TRANSPORT_LAT_INFLIGHT;
+    latCount--;
+    portEXIT_CRITICAL(&latLock);
+    if (!ok || lat.edgeUs == 0)
+        return;
+
+    int64_t now = esp_timer_get_time();
+    uint32_t us = (uint32_t)(now - lat.edgeUs);
+    uint8_t bucket = 0;
+    while (bucket < TRANSPORT_LAT_BUCKETS - 1 && us >= (1000u << bucket))
+        bucket++;
+    kb_counter_add((kb_counter_id_t)(KB_COUNTER_BLE_LAT_LT_1MS + bucket), 1);
+    kb_counter_set(KB_COUNTER_BLE_LAT_LAST_US, us);
+    kb_counter_max(KB_COUNTER_BLE_LAT_QUEUE_MAX_US, (uint32_t)(lat.submitUs - lat.edgeUs));
+    kb_counter_max(KB_COUNTER_BLE_LAT_STACK_MAX_US, (uint32_t)(now - lat.submitUs));
+    kb_counter_set(KB_COUNTER_BLE_LAT_INTERVAL_US, ble_conn_interval_us());
+}
+
+// Notifications that can carry a report kind in the current protocol mode.
+// Boot mode has no consumer report, even with its notifications restored from NVS.
+static uint8_t cccd_bits(uint8_t kind)
+{
+    if (kind == REPORT_CONSUMER)
+        return hidProtocolMode == HID_PROTOCOL_MODE_BOOT ? 0 : CCCD_CONSUMER;
+    return hidProtocolMode == HID_PROTOCOL_MODE_BOOT ? CCCD_BOOT_KEYBOARD : CCCD_KEYBOARD | CCCD_NKRO;
+}
+
+// The host would drop it: not encrypted yet or notifications off
+static bool ble_deliverable(uint8_t kind)
+{
+    return bleEncrypted && (bleCccd & cccd_bits(kind));
+}
+
+// In report mode the keyboard state goes as the bitmap, as long as the host listens to it
+static bool ble_nkro()
+{
+    return hidProtocolMode == HID_PROTOCOL_MODE_REPORT && (bleCccd & CCCD_NKRO);
+}
+
+// BT callbacks: first moment the host can receive a keypress on this link
+static void ble_check_ready()
+{
+    if (bleConnectUs == 0 || !ble_deliverable(REPORT_KEYBOARD))
+        return;
+    int64_t now = esp_timer_get_time();
+    kb_counter_set(KB_COUNTER_BLE_READY_US, (uint32_t)(now - bleConnectUs));
+    ble_adv_host_ready();
+    if (!bleBootReady)
+    {
+        // since the esp_timer start, as the boot milestones: the bootloader is not included
+        bleBootReady = true;
+        kb_counter_set(KB_COUNTER_BLE_BOOT_READY_US, (uint32_t)now);
+        ESP_LOGI(TAG, "BLE ready %lu ms after boot", (unsigned long)(now / 1000));
+    }
+    bleConnectUs = 0;
+}
+#else
+static void ble_enqueue(const transport_report_t *report) {}
+static uint8_t cccd_bits(uint8_t kind) { return 0; }
+static bool ble_deliverable(uint8_t kind) { return false; }
+static bool ble_nkro() { return false; }
+#endif
+
+static void transport_push(uint8_t transports, const transport_report_t *report)
+{
+    if (transports & TRANSPORT_USB)
+        transport_enqueue(usbQueue, KB_COUNTER_USB_DROPS, report);
+    if ((transports & TRANSPORT_BLE) && ble_deliverable(report->kind))
+    {
+        ble_enqueue(report);
+        ble_conn_activity();
+    }
+}
+
+static void transport_push_keyboard(uint8_t transports, uint8_t modifiers, const uint8_t keys[6],
+                                    const uint8_t bitmap[TRANSPORT_KEY_BITMAP_LEN], int64_t edgeUs)
+{
+    transport_report_t report = {};
+    report.kind = REPORT_KEYBOARD;
+    report.modifiers = modifiers;
+    memcpy(report.keys, keys, sizeof(report.keys));
+    memcpy(report.bitmap, bitmap, sizeof(report.bitmap));
+    report.edgeUs = edgeUs;
+    transport_push(transports, &report);
+}
+
+static void transport_push_consumer(uint8_t transports, uint16_t usage, int64_t edgeUs)
+{
+    transport_report_t report = {};
+    report.kind = REPORT_CONSUMER;
+    report.usage = usage;
+    report.edgeUs = edgeUs;
+    transport_push(transports, &report);
+}
+
+static uint8_t transport_route()
+{
+    uint8_t up = (tud_mounted() ? TRANSPORT_USB : 0) | (bleConnected && bleEncrypted ? TRANSPORT_BLE : 0);
+
+    switch (kbParams[KB_PARAM_TRANSPORT_MODE])
+    {
+    case TRANSPORT_MODE_USB:
+        return up & TRANSPORT_USB;
+    case TRANSPORT_MODE_BLE:
+        return up & TRANSPORT_BLE;
+    case TRANSPORT_MODE_MIRROR:
+        return up;
+    default:
+        return (up & TRANSPORT_USB) ? TRANSPORT_USB : up;
+    }
+}
+
+void transport_scan_time(int64_t readUs)
+{
+    scanReadUs = readUs;
+}
+
+void transport_update()
+{
+    static const uint8_t noKeys[6] = {0};
+    static const uint8_t noBitmap[TRANSPORT_KEY_BITMAP_LEN] = {0};
+    // the bitmap holds the keys of the array
+    bool keyboardDown = lastModifiers != 0 || memcmp(lastBitmap, noBitmap, sizeof(noBitmap)) != 0;
+
+    // reports the host just subscribed to start from its "all released"
+    uint8_t enabled = __atomic_exchange_n(&bleCccdEnabled, 0, __ATOMIC_RELAXED);
+    if (enabled && (active & TRANSPORT_BLE))
+    {
+        if (keyboardDown && (enabled & cccd_bits(REPORT_KEYBOARD)))
+            transport_push_keyboard(TRANSPORT_BLE, lastModifiers, lastKeys, lastBitmap, 0);
+        if (lastUsage != 0 && (enabled & cccd_bits(REPORT_CONSUMER)))
+            transport_push_consumer(TRANSPORT_BLE, lastUsage, 0);
+    }
+
+    uint8_t route = transport_route();
+    if (route == active)
+        return;
+
+    // keys held on the host we leave would repeat forever
+    uint8_t left = active & ~route;
+    if (keyboardDown)
+        transport_push_keyboard(left, 0, noKeys, noBitmap, 0);
+    if (lastUsage != 0)
+        transport_push_consumer(left, 0, 0);
+
+    uint8_t joined = route & ~active;
+    if (keyboardDown)
+        transport_push_keyboard(joined, lastModifiers, lastKeys, lastBitmap, 0);
+    if (lastUsage != 0)
+        transport_push_consumer(joined, lastUsage, 0);
+
+    ESP_LOGI(TAG, "reports to:%s%s%s", route & TRANSPORT_USB ? " usb" : "", route & TRANSPORT_BLE ? " ble" : "",
+             route ? "" : " none");
+    active = route;
+    kb_counter_add(KB_COUNTER_TRANSPORT_SWITCHES, 1);
+}
+
+void transport_send_keyboard(uint8_t modifiers, const uint8_t keys[6], const uint8_t bitmap[TRANSPORT_KEY_BITMAP_LEN])
+{
+    // a key beyond the 6 of the array only changes the bitmap
+    if (modifiers == lastModifiers && memcmp(keys, lastKeys, sizeof(lastKeys)) == 0 &&
+        memcmp(bitmap, lastBitmap, sizeof(lastBitmap)) == 0)
+        return;
+    lastModifiers = modifiers;
+    memcpy(lastKeys, keys, sizeof(lastKeys));
+    memcpy(lastBitmap, bitmap, sizeof(lastBitmap));
+    transport_push_keyboard(active, modifiers, keys, bitmap, scanReadUs);
+}
+
+void transport_send_consumer(uint16_t usage)
+{
+    if (usage == lastUsage)
+        return;
+    lastUsage = usage;
+    transport_push_consumer(active, usage, scanReadUs);
+}
+
+uint8_t transport_active()
+{
+    return active;
+}
+
+bool transport_nkro_active()
+{
+    return (active & TRANSPORT_BLE) && ble_nkro();
+}
+
+#if CONFIG_KB_BLE
+void transport_ble_link(bool connected, bool encrypted, uint16_t connId)
+{
+    if (connected && !bleConnected)
+    {
+        // a new host starts with everything released
+        portENTER_CRITICAL(&bleLock);
+        memset(&bleHostKeyboard, 0, sizeof(bleHostKeyboard));
+        bleHostKeyboard.kind = REPORT_KEYBOARD;
+        memset(&bleHostConsumer, 0, sizeof(bleHostConsumer));
+        bleHostConsumer.kind = REPORT_CONSUMER;
+        portEXIT_CRITICAL(&bleLock);
+    }
+    if (!connected)
+    {
+        bleCongested = false;
+        bleCccd = 0;
+        blePeerKnown = false;
+        // the sent events of a lost link do not come
+        portENTER_CRITICAL(&latLock);
+        latCount = 0;
+        portEXIT_CRITICAL(&latLock);
+    }
+    if (connected != bleConnected)
+        bleConnectUs = connected ? esp_timer_get_time() : 0;
+    bleConnId = connId;
+    bleEncrypted = connected && encrypted;
+    bleConnected = connected;
+    ble_check_ready();
+}
+
+static void cccd_key(char key[13], const esp_bd_addr_t bda)
+{
+    snprintf(key, 13, "%02x%02x%02x%02x%02x%02x", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+}
+
+static void cccd_save()
+{
+    nvs_handle_t nvs;
+    char key[13];
+    if (!blePeerKnown || nvs_open(TRANSPORT_CCCD_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+        return;
+    cccd_key(key, blePeer);
+    if (nvs_set_u8(nvs, key, bleCccd) == ESP_OK)
+        nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+void transport_ble_forget(const esp_bd_addr_t bda)
+{
+    nvs_handle_t nvs;
+    char key[13];
+    if (nvs_open(TRANSPORT_CCCD_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+        return;
+    cccd_key(key, bda);
+    if (nvs_erase_key(nvs, key) == ESP_OK)
+        nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+void transport_ble_peer(const esp_bd_addr_t bda)
+{
+    nvs_handle_t nvs;
+    char key[13];
+    uint8_t saved = 0;
+
+    memcpy(blePeer, bda, sizeof(esp_bd_addr_t));
+    blePeerKnown = true;
+    cccd_key(key, bda);
+    if (nvs_open(TRANSPORT_CCCD_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK)
+    {
+        nvs_get_u8(nvs, key, &saved);
+        nvs_close(nvs);
+    }
+    // a bonded host does not write its CCCDs again on reconnection
+    uint8_t added = saved & ~bleCccd;
+    bleCccd = bleCccd | saved;
+    __atomic_fetch_or(&bleCccdEnabled, added, __ATOMIC_RELAXED);
+    if (added)
+        ESP_LOGI(TAG, "notifications restored: 0x%02x", bleCccd);
+    cccd_save();
+    ble_check_ready();
+}
+
+void transport_ble_cccd(uint8_t reportId, uint8_t mode, bool notify)
+{
+    uint8_t bit;
+    if (reportId == HID_RPT_ID_CC_IN)
+        bit = CCCD_CONSUMER;
+    else if (reportId == HID_RPT_ID_KEY_IN)
+        bit = mode == HID_PROTOCOL_MODE_BOOT ? CCCD_BOOT_KEYBOARD : CCCD_KEYBOARD;
+    else if (reportId == HID_RPT_ID_NKRO_IN)
+        bit = CCCD_NKRO;
+    else
+        return;
+
+    if (notify && !(bleCccd & bit))
+        __atomic_fetch_or(&bleCccdEnabled, bit, __ATOMIC_RELAXED);
+    bleCccd = notify ? (bleCccd | bit) : (bleCccd & ~bit);
+    cccd_save();
+    ble_check_ready();
+}
+
+void transport_ble_congested(bool congested)
+{
+    bleCongested = congested;
+    // flow control of the stack under load, not a sign of packets lost over the air
+    if (congested)
+        kb_counter_add(KB_COUNTER_BLE_CONGESTIONS, 1);
+    else if (bleSenderTask != nullptr)
+        xTaskNotifyGive(bleSenderTask);
+}
+
+void transport_ble_report_sent(uint16_t handle, bool ok)
+{
+    // the battery level notifies too, only the input reports are in flight
+    bool input = hid_dev_is_input_report(handle);
+    if (input)
+        lat_sent(ok);
+    if (!ok)
+    {
+        kb_counter_add(KB_COUNTER_BLE_NOTIFY_FAILED, 1);
+        // a key report did not get through, the TX power may be too low
+        if (input)
+            ble_conn_link_loss();
+    }
+}
+#endif
+
+void transport_usb_report_complete(uint8_t instance)
+{
+    if (usbSenderTask != nullptr && (instance == KB_USB_KBD_ITF || instance == KB_USB_CC_ITF))
+        xTaskNotifyGive(usbSenderTask);
+}
+
+static void usb_sender_task(void *param)
+{
+    transport_report_t report;
+
+    while (1)
+    {
+        xQueueReceive(usbQueue, &report, portMAX_DELAY);
+        if (!tud_mounted())
+            continue; // unplugged with reports queued
+
+        // one transfer per endpoint, wait for the previous one to complete
+        uint8_t itf = report.kind == REPORT_CONSUMER ? KB_USB_CC_ITF : KB_USB_KBD_ITF;
+        TickType_t start = xTaskGetTickCount();
+        while (!tud_hid_n_ready(itf) && xTaskGetTickCount() - start < pdMS_TO_TICKS(TRANSPORT_USB_READY_TIMEOUT_MS))
+            ulTaskNotifyTake(pdTRUE, 1);
+
+        bool sent;
+        if (report.kind == REPORT_CONSUMER)
+        {
+            uint8_t cc[HID_CC_IN_RPT_LEN];
+            hid_consumer_build_report(cc, report.usage);
+            sent = tud_hid_n_report(KB_USB_CC_ITF, KB_USB_CC_REPORT_ID, cc, sizeof(cc));
+        }
+        else
+            sent = tud_hid_n_keyboard_report(KB_USB_KBD_ITF, 0, report.modifiers, report.keys);
+
+        if (!sent)
+            kb_counter_add(KB_COUNTER_USB_DROPS, 1);
+        else if (report.kind == REPORT_CONSUMER)
+            kb_counter_add(KB_COUNTER_USB_CC_REPORTS, 1);
+        else
+            kb_counter_add(KB_COUNTER_USB_KBD_REPORTS, 1);
+    }
+}
+
+#if CONFIG_KB_BLE
+static void ble_sender_task(void *param)
+{
+    transport_report_t report;
+
+    while (1)
+    {
+        // reports pile up (and merge) while the stack is congested
+        if (bleCongested || !ble_dequeue(&report))
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        if (!ble_deliverable(report.kind))
+            continue; // link lost or notifications turned off with reports queued
+
+        bool nkro = report.kind == REPORT_KEYBOARD && ble_nkro();
+        lat_submitted(report.edgeUs);
+        esp_err_t err;
+        if (report.kind == REPORT_CONSUMER)
+            err = esp_hidd_send_consumer_value(bleConnId, report.usage, report.usage != 0);
+        else if (nkro)
+            err = esp_hidd_send_keyboard_bitmap(bleConnId, report.modifiers, report.bitmap, sizeof(report.bitmap));
+        else
+            err = esp_hidd_send_keyboard_value(bleConnId, report.modifiers, report.keys, sizeof(report.keys));
+
+        if (err != ESP_OK)
+        {
+            lat_cancel();
+            kb_counter_add(KB_COUNTER_BLE_NOTIFY_FAILED, 1);
+            continue;
+        }
+        // 6 key report: modifiers, reserved byte and the keys
+        uint16_t len = report.kind == REPORT_CONSUMER ? HID_CC_IN_RPT_LEN
+                       : nkro                         ? HID_NKRO_IN_RPT_LEN
+                                                      : 2 + sizeof(report.keys);
+        kb_counter_set(KB_COUNTER_BLE_NOTIFY_AIRTIME_US, ble_conn_airtime_us(len));
+        if (report.kind == REPORT_CONSUMER)
+            kb_counter_add(KB_COUNTER_BLE_CC_REPORTS, 1);
+        else
+            kb_counter_add(KB_COUNTER_BLE_KBD_REPORTS, 1);
+        if (nkro)
+            kb_counter_add(KB_COUNTER_BLE_NKRO_REPORTS, 1);
+    }
+}
+#endif
+
+void transport_init()
+{
+    usbQueue = xQueueCreateStatic(TRANSPORT_QUEUE_LEN, sizeof(transport_report_t), usbQueueStorage, &usbQueueBuffer);
+
+    usbSenderTask = xTaskCreateStatic(
+        usb_sender_task,    // Task function
+        "UsbSendTask",      // Name
+        TRANSPORT_STACK_SIZE,
+        NULL,               // Parameter
+        3,                  // Priority, above the scanner
+        usbSenderTaskStack, // Stack array
+        &usbSenderTaskTCB   // Task control block
+    );
+#if CONFIG_KB_BLE
+    bleSenderTask = xTaskCreateStatic(
+        ble_sender_task,    // Task function
+        "BleSendTask",      // Name
+        TRANSPORT_STACK_SIZE,
+        NULL,               // Parameter
+        3,                  // Priority, above the scanner
+        bleSenderTaskStack, // Stack array
+        &bleSenderTaskTCB   // Task control block
+    );
+#endif
+}
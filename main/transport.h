@@ -0,0 +1,104 @@
+/*
+ * Report routing between the USB and BLE transports.
+ *
+ * The scanner hands every keyboard/consumer state change to the router,
+ * which queues it for the active transport(s). Each transport has its own
+ * bounded queue and sender task, so a stalled BLE link never delays USB
+ * and the other way around.
+ *
+ * A keyboard state is both the 6 key array of the boot layout and a bitmap
+ * of every key held. USB and a BLE host in boot protocol mode get the
+ * array; a BLE host in report protocol mode that subscribed to the NKRO
+ * report gets the bitmap, one notification per change.
+ *
+ * BLE latency: each report remembers the scan that saw its key edge, the
+ * sender stamps its submission to the stack, and the sent event of the
+ * profile (notification handed to the controller) closes the sample.
+ * Samples go to a histogram of power of two buckets in the counters, with
+ * the connection interval they were taken at; reset the counters before
+ * comparing two sets of connection parameters.
+ */
+
+#ifndef TRANSPORT_H__
+#define TRANSPORT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble_host_defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// KB_PARAM_TRANSPORT_MODE values
+typedef enum {
+    TRANSPORT_MODE_AUTO = 0, // USB when mounted, BLE otherwise
+    TRANSPORT_MODE_USB,      // USB only
+    TRANSPORT_MODE_BLE,      // BLE only
+    TRANSPORT_MODE_MIRROR,   // every transport that is up
+
+    TRANSPORT_MODE_COUNT
+} transport_mode_t;
+
+// Bits of transport_active()
+#define TRANSPORT_USB (1 << 0)
+#define TRANSPORT_BLE (1 << 1)
+
+// Reports are full state snapshots: when a queue is full its oldest entry
+// is dropped, the latest state always gets through. The BLE queue first
+// merges reports whose key transitions a later one still carries.
+#define TRANSPORT_QUEUE_LEN 16
+
+// Keyboard state bitmap: one bit per key usage below the modifiers (0xE0)
+#define TRANSPORT_KEY_BITMAP_LEN 28
+
+// BLE latency histogram, KB_COUNTER_BLE_LAT_LT_1MS onwards: bucket n holds
+// the samples below 2^n ms, the last one everything above
+#define TRANSPORT_LAT_BUCKETS 8
+
+void transport_init(void);
+
+/// Once per scan, when the matrix was read: the key edge time of the reports handed over next.
+void transport_scan_time(int64_t readUs);
+
+/// Re-evaluate the routing, once per scan. On a change the transport left
+/// gets an "all released" report and the new one the current state.
+void transport_update(void);
+
+/// keys: the 6 key report, bitmap: every key held, those of keys included.
+void transport_send_keyboard(uint8_t modifiers, const uint8_t keys[6], const uint8_t bitmap[TRANSPORT_KEY_BITMAP_LEN]);
+void transport_send_consumer(uint16_t usage);
+
+/// TRANSPORT_USB / TRANSPORT_BLE bits of the transports reports go to.
+uint8_t transport_active(void);
+
+/// A transport of the route gets the bitmap: keys beyond the 6 of the array still reach a host.
+bool transport_nkro_active(void);
+
+/// BLE link state, from the GAP/HID callbacks. Reports only go to an encrypted link.
+void transport_ble_link(bool connected, bool encrypted, uint16_t connId);
+
+/// Identity of the host, once paired. Restores the notification state it had.
+void transport_ble_peer(const esp_bd_addr_t bda);
+
+/// The bond of a host was removed: drops the notification state kept for it.
+void transport_ble_forget(const esp_bd_addr_t bda);
+
+/// The host turned notifications of an input report on or off. Reports
+/// without notifications are not sent, enabling them resends the current state.
+void transport_ble_cccd(uint8_t reportId, uint8_t mode, bool notify);
+
+/// BLE stack congestion, the sender holds the reports until it clears.
+void transport_ble_congested(bool congested);
+
+/// BLE notification result, from the HID profile. handle: the characteristic notified.
+void transport_ble_report_sent(uint16_t handle, bool ok);
+
+/// From tud_hid_report_complete_cb(), paces the USB sender.
+void transport_usb_report_complete(uint8_t instance);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRANSPORT_H__ */
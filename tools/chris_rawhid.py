@@ -0,0 +1,860 @@
+#!/usr/bin/env python3
+"""Reference host client for the ChrisT1 raw HID configuration interface.
+
+Protocol: doc/rawhid.md. Talks to the keyboard through Linux hidraw, or to
+an in-process simulated device with --sim.
+
+    ./chris_rawhid.py info
+    ./chris_rawhid.py keymap-get 0 0 17
+    ./chris_rawhid.py keymap-set 0 3 0x29          # col 0 row 3 -> Escape
+    ./chris_rawhid.py param-set scan_interval_ms 20
+    ./chris_rawhid.py counters
+    ./chris_rawhid.py latency                       # BLE key edge to notification sent
+    ./chris_rawhid.py stream 50
+    ./chris_rawhid.py stream 100 --first ble_lat_lt_1ms
+    ./chris_rawhid.py flash build/tusb_hid.bin      # firmware update, then reboot
+    ./chris_rawhid.py bench usb keyboard 2000       # HID throughput, or "bench all all"
+    ./chris_rawhid.py --sim selftest
+"""
+
+import argparse
+import glob
+import hashlib
+import os
+import select
+import struct
+import sys
+import time
+
+REPORT_LEN = 64
+HDR_LEN = 3
+PAYLOAD_LEN = REPORT_LEN - HDR_LEN
+PROTOCOL_VERSION = 1
+
+CMD_GET_INFO = 0x01
+CMD_KEYMAP_GET = 0x02
+CMD_KEYMAP_SET = 0x03
+CMD_KEYMAP_RESET = 0x04
+CMD_PARAM_GET = 0x05
+CMD_PARAM_SET = 0x06
+CMD_COUNTERS_GET = 0x07
+CMD_COUNTERS_RESET = 0x08
+CMD_STREAM = 0x09
+CMD_OTA_BEGIN = 0x10
+CMD_OTA_DATA = 0x11
+CMD_OTA_END = 0x12
+CMD_OTA_ABORT = 0x13
+CMD_OTA_STATUS = 0x14
+CMD_OTA_REBOOT = 0x15
+CMD_BENCH_START = 0x20
+CMD_BENCH_RESULT = 0x21
+EVT_TELEMETRY = 0xF0
+
+OK = 0x00
+ERR_UNKNOWN_CMD = 0x01
+ERR_BAD_LENGTH = 0x02
+ERR_BAD_ARG = 0x03
+ERR_OUT_OF_RANGE = 0x04
+ERR_BUSY = 0x05
+ERR_FAILED = 0x06
+
+STATUS_NAMES = {
+    OK: "ok",
+    ERR_UNKNOWN_CMD: "unknown command",
+    ERR_BAD_LENGTH: "bad length",
+    ERR_BAD_ARG: "bad argument",
+    ERR_OUT_OF_RANGE: "out of range",
+    ERR_BUSY: "busy",
+    ERR_FAILED: "failed",
+}
+
+KEYMAP_MAX_COUNT = PAYLOAD_LEN - 4
+COUNTERS_MAX_COUNT = (PAYLOAD_LEN - 2) // 4
+STREAM_MAX_COUNTERS = (PAYLOAD_LEN - 6) // 4
+OTA_MAX_CHUNK = REPORT_LEN - 2 - 5
+
+# ota_state_t, and esp_ota_img_states_t for the running image
+OTA_STATES = ["idle", "receiving", "done", "failed"]
+# bench_transport_t / bench_kind_t
+BENCH_TRANSPORTS = ["usb", "ble"]
+BENCH_KINDS = ["keyboard", "consumer", "nkro"]
+
+IMG_STATES = {0: "new", 1: "pending verify", 2: "valid", 3: "invalid", 4: "aborted", 0xFF: "undefined"}
+
+# kb_param_id_t / kb_counter_id_t order (main/kb_config.h)
+PARAM_NAMES = [
+    "scan_interval_ms",
+    "settle_us",
+    "buzzer_enabled",
+    "transport_mode",
+    "ble_idle_s",
+]
+
+COUNTER_NAMES = [
+    "scans",
+    "scan_last_us",
+    "scan_max_us",
+    "key_presses",
+    "ghost_drops",
+    "rollover_drops",
+    "usb_kbd_reports",
+    "usb_cc_reports",
+    "ble_kbd_reports",
+    "ble_cc_reports",
+    "telemetry_bytes",
+    "telemetry_drops",
+    "ota_bytes",
+    "ota_time_us",
+    "ota_scan_gap_max_us",
+    "usb_drops",
+    "ble_drops",
+    "transport_switches",
+    "ble_conn_interval_us",
+    "ble_conn_latency",
+    "ble_conn_updates",
+    "ble_conn_rejects",
+    "ble_fast_ms",
+    "ble_idle_ms",
+    "ble_idle_entries",
+    "ble_notify_queued",
+    "ble_notify_coalesced",
+    "ble_notify_failed",
+    "ble_congestions",
+    "ble_ready_us",
+    "ble_boot_ready_us",
+    "ble_host_slot",
+    "ble_host_switches",
+    "ble_host_switch_us",
+    "ble_phy",
+    "ble_tx_octets",
+    "ble_notify_airtime_us",
+    "ble_init_us",
+    "ble_init_heap",
+    "ble_adv_ms",
+    "ble_reconnect_ms",
+    "ble_adv_timeouts",
+    "ble_adv_wakes",
+    "ble_rssi_neg",
+    "ble_tx_atten_db",
+    "ble_tx_atten_db_s",
+    "ble_tx_power_downs",
+    "ble_tx_power_ups",
+    "battery_mv",
+    "battery_percent",
+    "battery_level_updates",
+    "boot_first_scan_us",
+    "boot_usb_mount_us",
+    "boot_ble_adv_us",
+    "boot_app_main_us",
+    "ble_nkro_reports",
+    "ble_lat_lt_1ms",
+    "ble_lat_lt_2ms",
+    "ble_lat_lt_4ms",
+    "ble_lat_lt_8ms",
+    "ble_lat_lt_16ms",
+    "ble_lat_lt_32ms",
+    "ble_lat_lt_64ms",
+    "ble_lat_ge_64ms",
+    "ble_lat_last_us",
+    "ble_lat_queue_max_us",
+    "ble_lat_stack_max_us",
+    "ble_lat_interval_us",
+    "ble_host_rejects",
+]
+
+
+class RawHidError(Exception):
+    pass
+
+
+def name_of(names, i):
+    return names[i] if i < len(names) else "#%d" % i
+
+
+# --------------------------------------------------------------------------
+# Transports
+
+
+class HidrawTransport:
+    """Keyboard plugged in, through /dev/hidrawN."""
+
+    def __init__(self, path=None):
+        self.path = path or self.find()
+        self.fd = os.open(self.path, os.O_RDWR)
+
+    @staticmethod
+    def find():
+        for dev in sorted(glob.glob("/sys/class/hidraw/hidraw*")):
+            try:
+                with open(os.path.join(dev, "device", "uevent")) as f:
+                    uevent = f.read()
+            except OSError:
+                continue
+            if "ChrisT1" in uevent and "input2" in uevent:
+                return "/dev/" + os.path.basename(dev)
+        raise RawHidError("no ChrisT1 raw HID interface found, use --dev")
+
+    def write(self, report):
+        # unnumbered reports: hidraw wants a leading report id 0
+        os.write(self.fd, b"\x00" + report)
+
+    def read(self, timeout):
+        r, _, _ = select.select([self.fd], [], [], timeout)
+        if not r:
+            return None
+        return os.read(self.fd, REPORT_LEN)
+
+    def close(self):
+        os.close(self.fd)
+
+
+class SimDevice:
+    """Device side of the protocol, mirrors main/rawhid.cc."""
+
+    COLS = 8
+    ROWS = 17
+    LAYERS = 2
+    # {min, max, default}, kbParamLimits order
+    PARAM_LIMITS = [(10, 100, 10), (1, 500, 10), (0, 1, 1), (0, 3, 0), (0, 3600, 30)]
+
+    def __init__(self):
+        self.default_keymap = [bytearray(self.COLS * self.ROWS) for _ in range(self.LAYERS)]
+        self.default_keymap[0][0 * self.ROWS + 3] = 0x29  # Escape, as on the real board
+        self.keymap = [bytearray(layer) for layer in self.default_keymap]
+        self.params = [lim[2] for lim in self.PARAM_LIMITS]
+        self.counters = [0] * len(COUNTER_NAMES)
+        self.stream_enabled = False
+        self.stream_period = 100
+        self.stream_first = 0
+        self.stream_frame = 0
+        self.last_frame = time.monotonic()
+        self.pending = []
+        self.t0 = time.monotonic()
+        self.ota_state = 0
+        self.ota_size = 0
+        self.ota_image = bytearray()
+        self.ota_t0 = 0.0
+        self.ota_elapsed = 0
+        self.bench = None
+
+    def process(self, req):
+        req = bytes(req).ljust(REPORT_LEN, b"\x00")
+        arg = req[2:]
+        out = b""
+        status = OK
+        cmd = req[0]
+        if cmd == CMD_GET_INFO:
+            out = bytes([PROTOCOL_VERSION, self.COLS, self.ROWS, self.LAYERS,
+                         len(self.params), len(self.counters)])
+        elif cmd in (CMD_KEYMAP_GET, CMD_KEYMAP_SET):
+            layer, index, count = struct.unpack_from("<BHB", arg)
+            if layer >= self.LAYERS or count > KEYMAP_MAX_COUNT:
+                status = ERR_BAD_ARG
+            elif index + count > self.COLS * self.ROWS:
+                status = ERR_OUT_OF_RANGE
+            elif cmd == CMD_KEYMAP_GET:
+                out = arg[:4] + bytes(self.keymap[layer][index:index + count])
+            else:
+                self.keymap[layer][index:index + count] = arg[4:4 + count]
+        elif cmd == CMD_KEYMAP_RESET:
+            self.keymap = [bytearray(layer) for layer in self.default_keymap]
+        elif cmd == CMD_PARAM_GET:
+            pid = arg[0]
+            if pid >= len(self.params):
+                status = ERR_BAD_ARG
+            else:
+                lo, hi, _ = self.PARAM_LIMITS[pid]
+                out = struct.pack("<BIII", pid, self.params[pid], lo, hi)
+        elif cmd == CMD_PARAM_SET:
+            pid, value = struct.unpack_from("<BI", arg)
+            if pid >= len(self.params):
+                status = ERR_BAD_ARG
+            elif not self.PARAM_LIMITS[pid][0] <= value <= self.PARAM_LIMITS[pid][1]:
+                status = ERR_OUT_OF_RANGE
+            else:
+                self.params[pid] = value
+                out = struct.pack("<BI", pid, value)
+        elif cmd == CMD_COUNTERS_GET:
+            first, count = arg[0], arg[1]
+            if count > COUNTERS_MAX_COUNT:
+                status = ERR_BAD_ARG
+            elif first + count > len(self.counters):
+                status = ERR_OUT_OF_RANGE
+            else:
+                out = bytes([first, count]) + struct.pack(
+                    "<%dI" % count, *self.counters[first:first + count])
+        elif cmd == CMD_COUNTERS_RESET:
+            self.counters = [0] * len(self.counters)
+        elif cmd == CMD_STREAM:
+            enable, period, first = struct.unpack_from("<BHB", arg)
+            if enable > 1:
+                status = ERR_BAD_ARG
+            elif enable and (period < 5 or first >= len(self.counters)):
+                status = ERR_OUT_OF_RANGE
+            else:
+                if enable:
+                    self.stream_period = period
+                    self.stream_first = first
+                self.stream_enabled = bool(enable)
+                out = struct.pack("<BHB", enable, self.stream_period, self.stream_first)
+        elif cmd == CMD_OTA_BEGIN:
+            (size,) = struct.unpack_from("<I", arg)
+            if not 0 < size <= 0x1E0000:
+                status = ERR_OUT_OF_RANGE
+            else:
+                self.ota_state, self.ota_size, self.ota_image = 1, size, bytearray()
+                self.ota_t0 = time.monotonic()
+                out = struct.pack("<II16s", size, 4096, b"ota_1")
+        elif cmd == CMD_OTA_DATA:
+            offset, n = struct.unpack_from("<IB", arg)
+            if self.ota_state != 1:
+                status = ERR_BUSY
+            elif n > OTA_MAX_CHUNK or n == 0 or offset != len(self.ota_image):
+                status = ERR_BAD_ARG
+            elif offset + n > self.ota_size:
+                status = ERR_OUT_OF_RANGE
+            else:
+                self.ota_image += arg[5:5 + n]
+                self.ota_elapsed = int((time.monotonic() - self.ota_t0) * 1e6)
+                self.counters[12] = len(self.ota_image)
+                self.counters[13] = self.ota_elapsed
+                self.counters[14] = max(self.counters[14], 10500)
+                out = struct.pack("<I", offset + n)
+        elif cmd == CMD_OTA_END:
+            if self.ota_state != 1:
+                status = ERR_BUSY
+            elif len(self.ota_image) != self.ota_size:
+                status = ERR_OUT_OF_RANGE
+            elif hashlib.sha256(self.ota_image).digest() != arg[:32]:
+                status = ERR_FAILED
+                self.ota_state = 3
+            else:
+                self.ota_state = 2
+        elif cmd == CMD_OTA_ABORT:
+            if self.ota_state == 1:
+                self.ota_state = 3
+        elif cmd == CMD_OTA_STATUS:
+            out = struct.pack("<BIIIB", self.ota_state, self.ota_size, len(self.ota_image),
+                              self.ota_elapsed, 2)
+        elif cmd == CMD_OTA_REBOOT:
+            if self.ota_state == 1:
+                status = ERR_BUSY
+        elif cmd == CMD_BENCH_START:
+            transport, kind, duration, window = struct.unpack_from("<BBHB", arg)
+            if self.bench and time.monotonic() < self.bench[0]:
+                status = ERR_BUSY
+            elif transport > 1 or kind > 2:
+                status = ERR_BAD_ARG
+            elif kind == 2 and transport == 0:
+                status = ERR_BAD_ARG  # no NKRO report on USB
+            elif not 100 <= duration <= 60000 or not 1 <= window <= 8:
+                status = ERR_OUT_OF_RANGE
+            elif transport == 1:
+                status = ERR_FAILED  # BLE not connected
+            else:
+                self.bench = (time.monotonic() + duration / 1000.0, transport, kind, duration)
+        elif cmd == CMD_BENCH_RESULT:
+            if self.bench:
+                end, transport, kind, duration = self.bench
+                running = time.monotonic() < end
+                done = 0 if running else duration  # 1 report/ms on full speed USB
+                out = struct.pack("<BBBB7I", running, transport, kind, 1, duration * 1000,
+                                  done, done, 0, 980, 1010, 1100 if done else 0)
+            else:
+                out = bytes(32)
+        else:
+            status = ERR_UNKNOWN_CMD
+        if status != OK:
+            out = b""
+        return (bytes([cmd, req[1], status]) + out).ljust(REPORT_LEN, b"\x00")
+
+    def tick(self):
+        # pretend the keyboard is scanning
+        self.counters[0] += 1
+        self.counters[1] = 420
+        self.counters[2] = max(self.counters[2], 420)
+
+    # transport interface
+    def write(self, report):
+        self.tick()
+        self.pending.append(self.process(report))
+
+    def read(self, timeout):
+        if self.pending:
+            return self.pending.pop(0)
+        if self.stream_enabled:
+            due = self.last_frame + self.stream_period / 1000.0
+            time.sleep(max(0.0, min(timeout, due - time.monotonic())))
+            if time.monotonic() >= due:
+                self.last_frame = time.monotonic()
+                first = self.stream_first
+                count = min(len(self.counters) - first, STREAM_MAX_COUNTERS)
+                ts = int((time.monotonic() - self.t0) * 1e6) & 0xFFFFFFFF
+                frame = bytes([EVT_TELEMETRY, self.stream_frame & 0xFF, 0])
+                frame += struct.pack("<IBB", ts, first, count)
+                frame += struct.pack("<%dI" % count, *self.counters[first:first + count])
+                self.stream_frame += 1
+                return frame.ljust(REPORT_LEN, b"\x00")
+            return None
+        time.sleep(timeout)
+        return None
+
+    def close(self):
+        pass
+
+
+# --------------------------------------------------------------------------
+# Client
+
+
+class Client:
+    def __init__(self, transport, timeout=0.5, retries=3):
+        self.t = transport
+        self.timeout = timeout
+        self.retries = retries
+        self.seq = 0
+        self.frames = []
+
+    def send(self, cmd, args=b""):
+        self.seq = (self.seq + 1) & 0xFF
+        self.t.write(bytes([cmd, self.seq]) + args.ljust(REPORT_LEN - 2, b"\x00"))
+        return self.seq
+
+    def receive(self, cmd, timeout):
+        """Next response to `cmd` as (seq, status, payload), None on timeout."""
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            rsp = self.t.read(deadline - time.monotonic())
+            if rsp is None:
+                break
+            if rsp[0] == EVT_TELEMETRY:
+                self.frames.append(rsp)
+                continue
+            if rsp[0] == cmd:
+                return rsp[1], rsp[2], bytes(rsp[HDR_LEN:])
+        return None
+
+    def request(self, cmd, args=b"", check=True):
+        for _ in range(self.retries):
+            seq = self.send(cmd, args)
+            while True:
+                rsp = self.receive(cmd, self.timeout)
+                if rsp is None:
+                    break
+                if rsp[0] == seq:
+                    status = rsp[1]
+                    if check and status != OK:
+                        raise RawHidError("command 0x%02x failed: %s"
+                                          % (cmd, STATUS_NAMES.get(status, hex(status))))
+                    return status, rsp[2]
+        raise RawHidError("command 0x%02x: no response" % cmd)
+
+    def info(self):
+        _, p = self.request(CMD_GET_INFO)
+        keys = ("version", "cols", "rows", "layers", "params", "counters")
+        return dict(zip(keys, p[:6]))
+
+    def keymap_get(self, layer, index, count):
+        codes = b""
+        while count > 0:
+            n = min(count, KEYMAP_MAX_COUNT)
+            _, p = self.request(CMD_KEYMAP_GET, struct.pack("<BHB", layer, index, n))
+            codes += p[4:4 + n]
+            index += n
+            count -= n
+        return codes
+
+    def keymap_set(self, layer, index, codes):
+        codes = bytes(codes)
+        while codes:
+            chunk = codes[:KEYMAP_MAX_COUNT]
+            self.request(CMD_KEYMAP_SET, struct.pack("<BHB", layer, index, len(chunk)) + chunk)
+            index += len(chunk)
+            codes = codes[len(chunk):]
+
+    def keymap_reset(self):
+        self.request(CMD_KEYMAP_RESET)
+
+    def param_get(self, pid):
+        _, p = self.request(CMD_PARAM_GET, bytes([pid]))
+        _, value, lo, hi = struct.unpack_from("<BIII", p)
+        return value, lo, hi
+
+    def param_set(self, pid, value):
+        self.request(CMD_PARAM_SET, struct.pack("<BI", pid, value))
+
+    def counters(self, total):
+        values = []
+        first = 0
+        while first < total:
+            n = min(total - first, COUNTERS_MAX_COUNT)
+            _, p = self.request(CMD_COUNTERS_GET, bytes([first, n]))
+            values += struct.unpack_from("<%dI" % n, p, 2)
+            first += n
+        return values
+
+    def counters_reset(self):
+        self.request(CMD_COUNTERS_RESET)
+
+    def stream(self, enable, period_ms=100, first=0):
+        self.request(CMD_STREAM, struct.pack("<BHB", 1 if enable else 0, period_ms, first))
+
+    def ota_status(self):
+        _, p = self.request(CMD_OTA_STATUS)
+        state, size, received, elapsed, running = struct.unpack_from("<BIIIB", p)
+        return {"state": state, "size": size, "received": received, "elapsed_us": elapsed,
+                "running": running}
+
+    def ota_flash(self, image, window=3, progress=None):
+        """Stream `image` with up to `window` chunks in flight (the device
+        queues 4 requests). Returns (partition label, resyncs)."""
+        _, p = self.request(CMD_OTA_BEGIN, struct.pack("<I", len(image)))
+        label = p[8:24].rstrip(b"\x00").decode()
+        sent = 0
+        inflight = []
+        resyncs = 0
+        try:
+            while sent < len(image) or inflight:
+                while sent < len(image) and len(inflight) < window:
+                    n = min(OTA_MAX_CHUNK, len(image) - sent)
+                    seq = self.send(CMD_OTA_DATA, struct.pack("<IB", sent, n) + image[sent:sent + n])
+                    inflight.append(seq)
+                    sent += n
+                # a flash sector write holds the device for tens of ms
+                rsp = self.receive(CMD_OTA_DATA, self.timeout * 4)
+                if rsp is not None and rsp[0] == inflight[0] and rsp[1] == OK:
+                    inflight.pop(0)
+                    if progress:
+                        progress(struct.unpack_from("<I", rsp[2])[0], len(image))
+                    continue
+                # lost request or response: let the queue drain, resume where the device is
+                resyncs += 1
+                if resyncs > 50:
+                    raise RawHidError("too many resyncs")
+                while self.receive(CMD_OTA_DATA, self.timeout) is not None:
+                    pass
+                st = self.ota_status()
+                if st["state"] != 1:
+                    raise RawHidError("update stopped (%s)" % OTA_STATES[st["state"]])
+                sent = st["received"]
+                inflight = []
+            self.request(CMD_OTA_END, hashlib.sha256(image).digest())
+        except BaseException:
+            try:
+                self.request(CMD_OTA_ABORT)
+            except RawHidError:
+                pass
+            raise
+        return label, resyncs
+
+    def ota_reboot(self):
+        self.request(CMD_OTA_REBOOT)
+
+    def next_frame(self, timeout):
+        if self.frames:
+            return self.frames.pop(0)
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            rsp = self.t.read(deadline - time.monotonic())
+            if rsp is not None and rsp[0] == EVT_TELEMETRY:
+                return rsp
+        return None
+
+
+def decode_frame(frame):
+    ts, first, count = struct.unpack_from("<IBB", frame, HDR_LEN)
+    values = struct.unpack_from("<%dI" % count, frame, HDR_LEN + 6)
+    return frame[1], ts, {name_of(COUNTER_NAMES, first + i): v for i, v in enumerate(values)}
+
+
+def parse_param(s):
+    if s in PARAM_NAMES:
+        return PARAM_NAMES.index(s)
+    return int(s, 0)
+
+
+def parse_counter(s):
+    if s in COUNTER_NAMES:
+        return COUNTER_NAMES.index(s)
+    return int(s, 0)
+
+
+# --------------------------------------------------------------------------
+# Commands
+
+
+def do_info(c, a):
+    for k, v in c.info().items():
+        print("%-9s %d" % (k, v))
+
+
+def do_keymap_get(c, a):
+    info = c.info()
+    codes = c.keymap_get(a.layer, a.col * info["rows"], info["rows"] * a.cols)
+    for i in range(a.cols):
+        row = codes[i * info["rows"]:(i + 1) * info["rows"]]
+        print("col %d: %s" % (a.col + i, " ".join("%02x" % k for k in row)))
+
+
+def do_keymap_set(c, a):
+    info = c.info()
+    c.keymap_set(a.layer, a.col * info["rows"] + a.row, [a.code])
+
+
+def do_keymap_reset(c, a):
+    c.keymap_reset()
+
+
+def do_params(c, a):
+    for pid in range(c.info()["params"]):
+        value, lo, hi = c.param_get(pid)
+        print("%-20s %10d  [%d..%d]" % (name_of(PARAM_NAMES, pid), value, lo, hi))
+
+
+def do_param_set(c, a):
+    c.param_set(parse_param(a.param), a.value)
+
+
+def do_counters(c, a):
+    values = c.counters(c.info()["counters"])
+    for i, v in enumerate(values):
+        print("%-20s %10d" % (name_of(COUNTER_NAMES, i), v))
+
+
+def do_counters_reset(c, a):
+    c.counters_reset()
+
+
+LAT_BUCKETS = ["< 1 ms", "< 2 ms", "< 4 ms", "< 8 ms", "< 16 ms", "< 32 ms", "< 64 ms", ">= 64 ms"]
+
+
+def do_latency(c, a):
+    values = dict(zip(COUNTER_NAMES, c.counters(c.info()["counters"])))
+    if "ble_lat_lt_1ms" not in values:
+        sys.exit("firmware without BLE latency counters")
+    hist = [values[n] for n in COUNTER_NAMES if n.startswith("ble_lat_lt_") or n.startswith("ble_lat_ge_")]
+    total = sum(hist)
+    print("key edge to BLE notification sent, %d keys, interval %.2f ms" %
+          (total, values["ble_lat_interval_us"] / 1000.0))
+    for label, n in zip(LAT_BUCKETS, hist):
+        print("%-9s %8d %5.1f%% %s" % (label, n, 100.0 * n / total if total else 0.0,
+                                       "#" * (40 * n // total if total else 0)))
+    print("last %.3f ms, longest in the queue %.3f ms, in the stack %.3f ms" %
+          (values["ble_lat_last_us"] / 1000.0, values["ble_lat_queue_max_us"] / 1000.0,
+           values["ble_lat_stack_max_us"] / 1000.0))
+
+
+def do_stream(c, a):
+    c.stream(True, a.period, parse_counter(a.first))
+    try:
+        end = time.monotonic() + a.duration if a.duration else None
+        while end is None or time.monotonic() < end:
+            frame = c.next_frame(1.0)
+            if frame is None:
+                continue
+            n, ts, values = decode_frame(frame)
+            print("#%3d %10.3f ms  %s" % (n, ts / 1000.0,
+                                          " ".join("%s=%d" % kv for kv in values.items())))
+    except KeyboardInterrupt:
+        pass
+    finally:
+        c.stream(False)
+
+
+def do_ota_status(c, a):
+    st = c.ota_status()
+    print("update   %s, %d/%d bytes, %.1f s" % (OTA_STATES[st["state"]], st["received"], st["size"],
+                                                 st["elapsed_us"] / 1e6))
+    print("running  %s" % IMG_STATES.get(st["running"], hex(st["running"])))
+
+
+def do_flash(c, a):
+    with open(a.image, "rb") as f:
+        image = f.read()
+
+    def progress(done, total):
+        if done % (OTA_MAX_CHUNK * 256) < OTA_MAX_CHUNK or done == total:
+            sys.stderr.write("\r%7d / %d bytes" % (done, total))
+            sys.stderr.flush()
+
+    c.counters_reset()
+    t0 = time.monotonic()
+    label, resyncs = c.ota_flash(image, a.window, progress)
+    elapsed = time.monotonic() - t0
+    sys.stderr.write("\n")
+    info = c.info()
+    values = dict(zip(COUNTER_NAMES, c.counters(info["counters"])))
+    nominal = c.param_get(PARAM_NAMES.index("scan_interval_ms"))[0] * 1000 + values["scan_max_us"]
+    print("wrote %d bytes to %s in %.1f s: %.1f KiB/s (device %.1f KiB/s), %d resyncs"
+          % (len(image), label, elapsed, len(image) / elapsed / 1024,
+             len(image) / max(values["ota_time_us"], 1) * 1e6 / 1024, resyncs))
+    print("scan gap during update: max %.1f ms (nominal %.1f ms), %d scans"
+          % (values["ota_scan_gap_max_us"] / 1000.0, nominal / 1000.0, values["scans"]))
+    if a.no_reboot:
+        print("image verified, boots on next reset")
+        return
+    c.ota_reboot()
+    print("image verified, rebooting; it must pass its health check or the previous one comes back")
+
+
+def bench_result(c):
+    _, p = c.request(CMD_BENCH_RESULT)
+    keys = ("running", "transport", "kind", "window", "duration_us", "submitted", "completed",
+            "dropped", "lat_min_us", "lat_avg_us", "lat_max_us")
+    return dict(zip(keys, struct.unpack_from("<BBBB7I", p)))
+
+
+def bench_run(c, transport, kind, duration, window):
+    c.request(CMD_BENCH_START, struct.pack("<BBHB", transport, kind, duration, window))
+    time.sleep(duration / 1000.0)
+    while True:
+        r = bench_result(c)
+        if not r["running"]:
+            return r
+        time.sleep(0.1)
+
+
+def do_bench(c, a):
+    transports = range(len(BENCH_TRANSPORTS)) if a.transport == "all" else [BENCH_TRANSPORTS.index(a.transport)]
+    kinds = range(len(BENCH_KINDS)) if a.transport == "all" or a.kind == "all" else [BENCH_KINDS.index(a.kind)]
+    print("%-4s %-9s %3s %9s %9s %8s %8s %8s %8s"
+          % ("", "", "win", "reports/s", "completed", "dropped", "lat min", "lat avg", "lat max"))
+    for t in transports:
+        for k in kinds:
+            try:
+                r = bench_run(c, t, k, a.duration, a.window)
+            except RawHidError as e:
+                print("%-4s %-9s skipped: %s" % (BENCH_TRANSPORTS[t], BENCH_KINDS[k], e))
+                continue
+            rate = r["completed"] * 1e6 / max(r["duration_us"], 1)
+            print("%-4s %-9s %3d %9.0f %9d %8d %6d us %6d us %6d us"
+                  % (BENCH_TRANSPORTS[t], BENCH_KINDS[k], r["window"], rate, r["completed"],
+                     r["dropped"], r["lat_min_us"], r["lat_avg_us"], r["lat_max_us"]))
+
+
+def do_selftest(c, a):
+    """Exercise every command, restoring the initial state."""
+    info = c.info()
+    assert info["version"] == PROTOCOL_VERSION, info
+    n = info["cols"] * info["rows"]
+
+    base = c.keymap_get(0, 0, n)
+    assert len(base) == n
+    c.keymap_set(1, n - 2, b"\x40\x41")
+    assert c.keymap_get(1, n - 2, 2) == b"\x40\x41"
+    c.keymap_reset()
+    assert c.keymap_get(0, 0, n) == base
+
+    status, _ = c.request(CMD_KEYMAP_GET, struct.pack("<BHB", 0, n - 1, 2), check=False)
+    assert status == ERR_OUT_OF_RANGE, status
+    status, _ = c.request(CMD_KEYMAP_GET, struct.pack("<BHB", 7, 0, 1), check=False)
+    assert status == ERR_BAD_ARG, status
+
+    for pid in range(info["params"]):
+        value, lo, hi = c.param_get(pid)
+        c.param_set(pid, hi)
+        assert c.param_get(pid)[0] == hi
+        status, _ = c.request(CMD_PARAM_SET, struct.pack("<BI", pid, hi + 1), check=False)
+        assert status == ERR_OUT_OF_RANGE, status
+        c.param_set(pid, value)
+
+    values = c.counters(info["counters"])
+    assert len(values) == info["counters"]
+    c.counters_reset()
+
+    c.stream(True, 10)
+    frame = c.next_frame(1.0)
+    c.stream(False)
+    assert frame is not None, "no telemetry frame"
+    decode_frame(frame)
+    last = info["counters"] - 1
+    c.stream(True, 10, last)
+    frame = c.next_frame(1.0)
+    c.stream(False)
+    assert frame is not None and list(decode_frame(frame)[2]) == [name_of(COUNTER_NAMES, last)]
+
+    st = c.ota_status()
+    assert st["state"] != 1, st
+    c.request(CMD_OTA_BEGIN, struct.pack("<I", 1000))
+    c.request(CMD_OTA_DATA, struct.pack("<IB", 0, 8) + bytes(8))
+    status, _ = c.request(CMD_OTA_DATA, struct.pack("<IB", 0, 8) + bytes(8), check=False)
+    assert status == ERR_BAD_ARG, status
+    status, _ = c.request(CMD_OTA_END, bytes(32), check=False)
+    assert status == ERR_OUT_OF_RANGE, status
+    c.request(CMD_OTA_ABORT)
+    assert c.ota_status()["state"] == 3
+    status, _ = c.request(CMD_BENCH_START, struct.pack("<BBHB", 0, 2, 100, 1), check=False)
+    assert status == ERR_BAD_ARG, status
+    status, _ = c.request(CMD_BENCH_START, struct.pack("<BBHB", 0, 0, 10, 1), check=False)
+    assert status == ERR_OUT_OF_RANGE, status
+    r = bench_run(c, 0, 0, 100, 1)
+    assert not r["running"] and r["completed"] <= r["submitted"], r
+
+    if a.sim:
+        image = os.urandom(5000)
+        c.ota_flash(image)
+        assert c.ota_status()["state"] == 2
+
+    status, _ = c.request(0x7E, check=False)
+    assert status == ERR_UNKNOWN_CMD, status
+    print("selftest passed")
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--dev", help="hidraw device (default: autodetect)")
+    ap.add_argument("--sim", action="store_true", help="use the simulated device")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+
+    sub.add_parser("info").set_defaults(fn=do_info)
+    p = sub.add_parser("keymap-get")
+    p.add_argument("layer", type=int)
+    p.add_argument("col", type=int)
+    p.add_argument("cols", type=int, nargs="?", default=1)
+    p.set_defaults(fn=do_keymap_get)
+    p = sub.add_parser("keymap-set")
+    p.add_argument("layer", type=int)
+    p.add_argument("col", type=int)
+    p.add_argument("row", type=int)
+    p.add_argument("code", type=lambda s: int(s, 0))
+    p.set_defaults(fn=do_keymap_set)
+    sub.add_parser("keymap-reset").set_defaults(fn=do_keymap_reset)
+    sub.add_parser("params").set_defaults(fn=do_params)
+    p = sub.add_parser("param-set")
+    p.add_argument("param")
+    p.add_argument("value", type=lambda s: int(s, 0))
+    p.set_defaults(fn=do_param_set)
+    sub.add_parser("counters").set_defaults(fn=do_counters)
+    sub.add_parser("counters-reset").set_defaults(fn=do_counters_reset)
+    sub.add_parser("latency").set_defaults(fn=do_latency)
+    p = sub.add_parser("stream")
+    p.add_argument("period", type=int, nargs="?", default=100)
+    p.add_argument("--duration", type=float, default=0)
+    p.add_argument("--first", default="0", help="first counter, name or id")
+    p.set_defaults(fn=do_stream)
+    sub.add_parser("ota-status").set_defaults(fn=do_ota_status)
+    p = sub.add_parser("flash")
+    p.add_argument("image", help="application binary, build/tusb_hid.bin")
+    p.add_argument("--window", type=int, default=3, help="chunks in flight (1-4)")
+    p.add_argument("--no-reboot", action="store_true")
+    p.set_defaults(fn=do_flash)
+    p = sub.add_parser("bench")
+    p.add_argument("transport", choices=BENCH_TRANSPORTS + ["all"])
+    p.add_argument("kind", choices=BENCH_KINDS + ["all"], nargs="?", default="all")
+    p.add_argument("duration", type=int, nargs="?", default=2000, help="ms per run")
+    p.add_argument("--window", type=int, default=4, help="BLE reports in flight (1-8)")
+    p.set_defaults(fn=do_bench)
+    sub.add_parser("selftest").set_defaults(fn=do_selftest)
+
+    a = ap.parse_args()
+    transport = SimDevice() if a.sim else HidrawTransport(a.dev)
+    try:
+        a.fn(Client(transport), a)
+    except RawHidError as e:
+        sys.exit("error: %s" % e)
+    finally:
+        transport.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""Decoder for the ChrisT1 CDC telemetry stream (format: doc/telemetry.md).
+
+    ./telemetry_decode.py /dev/ttyACM0            # live, one line per record
+    ./telemetry_decode.py /dev/ttyACM0 --stats 10 # stage timing summary every 10 s
+    ./telemetry_decode.py capture.bin             # offline, from a raw capture
+"""
+
+import argparse
+import os
+import struct
+import sys
+import termios
+import time
+import tty
+
+SYNC = 0xA5
+HDR_LEN = 7
+MAX_PAYLOAD = 32
+
+KEY_EVENT = 0x01
+FRAME_DIFF = 0x02
+STAGE_TIMES = 0x03
+KBD_REPORT = 0x04
+CC_REPORT = 0x05
+DROPPED = 0x06
+
+KB_ROWS = 17
+
+
+class Decoder:
+    """Byte stream -> records, resyncing on the sync byte and checksum."""
+
+    def __init__(self):
+        self.buf = bytearray()
+        self.bad = 0
+        self.ts_high = 0
+        self.last_ts = 0
+
+    def feed(self, data):
+        self.buf += data
+        while True:
+            i = self.buf.find(SYNC)
+            if i < 0:
+                self.bad += len(self.buf)
+                self.buf.clear()
+                return
+            if i:
+                self.bad += i
+                del self.buf[:i]
+            if len(self.buf) < HDR_LEN:
+                return
+            rtype, length = self.buf[1], self.buf[2]
+            if length > MAX_PAYLOAD:
+                self.bad += 1
+                del self.buf[:1]
+                continue
+            total = HDR_LEN + length + 1
+            if len(self.buf) < total:
+                return
+            if sum(self.buf[1:total - 1]) & 0xFF != self.buf[total - 1]:
+                self.bad += 1
+                del self.buf[:1]
+                continue
+            (ts,) = struct.unpack_from("<I", self.buf, 3)
+            payload = bytes(self.buf[HDR_LEN:HDR_LEN + length])
+            del self.buf[:total]
+            yield rtype, self.unwrap(ts), payload
+
+    def unwrap(self, ts):
+        # 32-bit microsecond clock wraps every ~71 minutes
+        if ts < self.last_ts and self.last_ts - ts > 1 << 31:
+            self.ts_high += 1 << 32
+        self.last_ts = ts
+        return self.ts_high + ts
+
+
+def describe(rtype, payload):
+    if rtype == KEY_EVENT:
+        col, row, code, flags = payload
+        return "key   c%d r%-2d 0x%02x %s%s" % (col, row, code, "down" if flags & 1 else "up",
+                                                " (Fn)" if flags & 2 else "")
+    if rtype == FRAME_DIFF:
+        (scan,) = struct.unpack_from("<I", payload)
+        bits = [i for i in range((len(payload) - 4) * 8) if payload[4 + i // 8] >> (i % 8) & 1]
+        return "diff  scan %d: %s" % (scan, " ".join("c%dr%d" % divmod(b, KB_ROWS) for b in bits))
+    if rtype == STAGE_TIMES:
+        read, deghost, report, total = struct.unpack("<4H", payload)
+        return "stage read %4d  deghost %4d  report %4d  total %4d us" % (read, deghost, report, total)
+    if rtype == KBD_REPORT:
+        return "kbd   mod %02x keys %s" % (payload[0], " ".join("%02x" % k for k in payload[1:]))
+    if rtype == CC_REPORT:
+        return "cc    usage 0x%04x" % struct.unpack("<H", payload)
+    if rtype == DROPPED:
+        return "DROPPED %d records" % struct.unpack("<I", payload)
+    return "type 0x%02x %s" % (rtype, payload.hex())
+
+
+class Stats:
+    def __init__(self):
+        self.stages = []
+        self.keys = 0
+        self.dropped = 0
+
+    def add(self, rtype, payload):
+        if rtype == STAGE_TIMES:
+            self.stages.append(struct.unpack("<4H", payload))
+        elif rtype == KEY_EVENT and payload[3] & 1:
+            self.keys += 1
+        elif rtype == DROPPED:
+            self.dropped += struct.unpack("<I", payload)[0]
+
+    def dump(self, bad):
+        print("%d scans, %d key presses, %d records dropped, %d bad bytes"
+              % (len(self.stages), self.keys, self.dropped, bad))
+        for i, name in enumerate(("read", "deghost", "report", "total")):
+            v = sorted(s[i] for s in self.stages)
+            if v:
+                print("  %-8s p50 %5d  p99 %5d  max %5d us"
+                      % (name, v[len(v) // 2], v[min(len(v) - 1, len(v) * 99 // 100)], v[-1]))
+        self.__init__()
+
+
+def open_source(path):
+    fd = os.open(path, os.O_RDONLY)
+    if os.isatty(fd):
+        tty.setraw(fd)
+        # opening the port raises DTR, which starts the stream
+        attrs = termios.tcgetattr(fd)
+        termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    return fd
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("source", help="CDC tty or raw capture file")
+    ap.add_argument("--stats", type=float, metavar="SEC", help="print a summary every SEC seconds instead of records")
+    ap.add_argument("--raw", metavar="FILE", help="also save the raw stream to FILE")
+    a = ap.parse_args()
+
+    fd = open_source(a.source)
+    raw = open(a.raw, "wb") if a.raw else None
+    dec = Decoder()
+    stats = Stats()
+    next_dump = time.monotonic() + (a.stats or 0)
+    try:
+        while True:
+            data = os.read(fd, 4096)
+            if not data:
+                break
+            if raw:
+                raw.write(data)
+            for rtype, ts, payload in dec.feed(data):
+                if a.stats:
+                    stats.add(rtype, payload)
+                else:
+                    print("%14.3f ms  %s" % (ts / 1000.0, describe(rtype, payload)))
+            if a.stats and time.monotonic() >= next_dump:
+                stats.dump(dec.bad)
+                next_dump += a.stats
+    except KeyboardInterrupt:
+        pass
+    if a.stats:
+        stats.dump(dec.bad)
+    if raw:
+        raw.close()
+
+
+if __name__ == "__main__":
+    sys.exit(main())